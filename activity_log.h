@@ -0,0 +1,238 @@
+// activity_log.h - Asynchronous activity log fed by a lock-free ring buffer
+#ifndef ACTIVITY_LOG_H
+#define ACTIVITY_LOG_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LOG_RING_SIZE 8192          // Records; must be a power of two
+#define LOG_FLUSH_INTERVAL_MS 50
+#define LOG_ROTATE_KEEP 5           // server.log.1 .. server.log.N
+
+// Request threads copy a fixed-size record into a bounded MPSC ring (one
+// CAS, no locks, no syscalls) and return. A single background thread drains
+// the ring every LOG_FLUSH_INTERVAL_MS, formats the whole batch, and hands
+// it to the file in one write(). If the writer falls so far behind that the
+// ring fills up, new records are counted and dropped rather than stalling
+// the request, and the loss is reported in the log itself.
+class ActivityLog {
+private:
+    struct Record {
+        time_t time;
+        char ip[48];
+        char user[32];
+        char text[200];
+    };
+
+    // Vyukov-style cell: the sequence number says whose turn it is
+    struct Cell {
+        std::atomic<size_t> sequence;
+        Record record;
+    };
+
+    std::string path;
+    size_t max_bytes;       // Rotate once the file would grow past this; 0 = never
+    bool fsync_batches;     // fdatasync() after every batch
+
+    std::unique_ptr<Cell[]> cells;
+    std::atomic<size_t> enqueue_pos;
+    size_t dequeue_pos;     // Only touched by the writer thread
+    std::atomic<size_t> dropped;
+
+    int fd;
+    size_t file_bytes;
+    std::mutex stop_lock;
+    std::condition_variable stop_cv;
+    bool stopping;
+    std::thread writer;
+
+    static void copyField(char* dst, size_t size, const std::string& src) {
+        size_t n = std::min(src.size(), size - 1);
+        memcpy(dst, src.data(), n);
+        dst[n] = '\0';
+    }
+
+    bool openFile() {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        file_bytes = (fstat(fd, &st) == 0) ? st.st_size : 0;
+        return true;
+    }
+
+    // server.log -> server.log.1 -> ... -> server.log.LOG_ROTATE_KEEP (dropped)
+    void rotate() {
+        close(fd);
+        for (int i = LOG_ROTATE_KEEP - 1; i >= 1; i--) {
+            std::string from = path + "." + std::to_string(i);
+            std::string to = path + "." + std::to_string(i + 1);
+            rename(from.c_str(), to.c_str());
+        }
+        rename(path.c_str(), (path + ".1").c_str());
+        openFile();
+    }
+
+    void appendRecord(std::string& batch, const Record& record, time_t& cached_time, char* stamp) {
+        if (record.time != cached_time) {
+            // Same layout ctime() produces, formatted once per second
+            struct tm tm;
+            localtime_r(&record.time, &tm);
+            strftime(stamp, 32, "%a %b %e %H:%M:%S %Y", &tm);
+            cached_time = record.time;
+        }
+        batch += "[";
+        batch += stamp;
+        batch += "] [";
+        batch += record.ip;
+        batch += "] [";
+        batch += record.user;
+        batch += "] ";
+        batch += record.text;
+        batch += "\n";
+    }
+
+    // Formats everything queued so far; returns false if the ring was empty
+    bool drain(std::string& batch) {
+        time_t cached_time = 0;
+        char stamp[32] = "";
+        bool any = false;
+
+        while (true) {
+            Cell& cell = cells[dequeue_pos & (LOG_RING_SIZE - 1)];
+            if (cell.sequence.load(std::memory_order_acquire) != dequeue_pos + 1) {
+                break; // Slot not published yet
+            }
+            appendRecord(batch, cell.record, cached_time, stamp);
+            cell.sequence.store(dequeue_pos + LOG_RING_SIZE, std::memory_order_release);
+            dequeue_pos++;
+            any = true;
+        }
+
+        size_t lost = dropped.exchange(0, std::memory_order_relaxed);
+        if (lost > 0) {
+            Record note = {time(nullptr), "-", "LOGGER", ""};
+            snprintf(note.text, sizeof(note.text), "%zu records dropped (log writer behind)", lost);
+            appendRecord(batch, note, cached_time, stamp);
+            any = true;
+        }
+        return any;
+    }
+
+    void writeBatch(const std::string& batch) {
+        if (fd < 0 && !openFile()) {
+            return;
+        }
+        if (max_bytes > 0 && file_bytes > 0 && file_bytes + batch.size() > max_bytes) {
+            rotate();
+            if (fd < 0) {
+                return;
+            }
+        }
+
+        size_t written = 0;
+        while (written < batch.size()) {
+            ssize_t n = write(fd, batch.data() + written, batch.size() - written);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            written += n;
+        }
+        file_bytes += written;
+        if (fsync_batches) {
+            fdatasync(fd);
+        }
+    }
+
+    void writerLoop() {
+        std::string batch;
+        while (true) {
+            bool stop;
+            {
+                std::unique_lock<std::mutex> guard(stop_lock);
+                stop_cv.wait_for(guard, std::chrono::milliseconds(LOG_FLUSH_INTERVAL_MS),
+                                 [this] { return stopping; });
+                stop = stopping;
+            }
+
+            batch.clear();
+            if (drain(batch)) {
+                writeBatch(batch);
+            }
+            if (stop) {
+                return;
+            }
+        }
+    }
+
+public:
+    ActivityLog(const std::string& log_path, size_t rotate_bytes, bool fsync_each_batch)
+        : path(log_path), max_bytes(rotate_bytes), fsync_batches(fsync_each_batch),
+          cells(new Cell[LOG_RING_SIZE]), enqueue_pos(0), dequeue_pos(0), dropped(0),
+          fd(-1), file_bytes(0), stopping(false) {
+        for (size_t i = 0; i < LOG_RING_SIZE; i++) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        openFile();
+        writer = std::thread(&ActivityLog::writerLoop, this);
+    }
+
+    // Queues one line; never blocks and never touches the file
+    void append(const std::string& ip, const std::string& user, const std::string& text) {
+        size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+        Cell* cell;
+        while (true) {
+            cell = &cells[pos & (LOG_RING_SIZE - 1)];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueue_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                dropped.fetch_add(1, std::memory_order_relaxed); // Ring full
+                return;
+            } else {
+                pos = enqueue_pos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->record.time = time(nullptr);
+        copyField(cell->record.ip, sizeof(cell->record.ip), ip);
+        copyField(cell->record.user, sizeof(cell->record.user), user);
+        copyField(cell->record.text, sizeof(cell->record.text), text);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+    }
+
+    // Flushes whatever is still queued before returning
+    ~ActivityLog() {
+        {
+            std::lock_guard<std::mutex> guard(stop_lock);
+            stopping = true;
+        }
+        stop_cv.notify_one();
+        writer.join();
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,85 @@
+// admission.h - Caps on open sessions, overall and per client address
+//
+// Every accepted connection must be admitted before it becomes a session.
+// Past either cap it is refused at once with a BUSY reply that says when to
+// try again (see protocol.h), so a storm of connections, such as every job
+// of a CI pipeline starting together, gets a quick answer instead of piling
+// up in the listen backlog until clients time out. The retry hint carries
+// random jitter so refused clients don't all come back in the same instant.
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#define ADMISSION_RETRY_MS 100      // Shortest retry hint; up to twice this with jitter
+
+class AdmissionControl {
+private:
+    std::mutex lock;
+    size_t max_sessions;    // 0 = unlimited
+    size_t max_per_address; // 0 = unlimited
+    size_t admitted;
+    uint64_t refused;
+    std::unordered_map<std::string, size_t> per_address;
+    std::minstd_rand jitter;
+
+public:
+    AdmissionControl() : max_sessions(0), max_per_address(0), admitted(0), refused(0), jitter(std::random_device()()) {}
+
+    AdmissionControl(const AdmissionControl&) = delete;
+    AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+    void configure(size_t sessions, size_t per_address_limit) {
+        std::lock_guard<std::mutex> guard(lock);
+        max_sessions = sessions;
+        max_per_address = per_address_limit;
+    }
+
+    // Counts a new session from address, or says why it can't have one and
+    // how many milliseconds the client should wait before trying again
+    bool admit(const std::string& address, std::string& reason, long& retry_ms) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (max_sessions > 0 && admitted >= max_sessions) {
+            reason = "server at capacity (" + std::to_string(max_sessions) + " sessions)";
+        } else if (max_per_address > 0 && per_address[address] >= max_per_address) {
+            reason = "too many connections from " + address + " (limit " + std::to_string(max_per_address) + ")";
+        } else {
+            admitted++;
+            per_address[address]++;
+            return true;
+        }
+        refused++;
+        retry_ms = ADMISSION_RETRY_MS + static_cast<long>(jitter() % ADMISSION_RETRY_MS);
+        return false;
+    }
+
+    // A session admitted for address has ended
+    void release(const std::string& address) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = per_address.find(address);
+        if (it == per_address.end()) {
+            return;
+        }
+        admitted--;
+        if (--it->second == 0) {
+            per_address.erase(it);
+        }
+    }
+
+    size_t sessions() {
+        std::lock_guard<std::mutex> guard(lock);
+        return admitted;
+    }
+
+    uint64_t refusedTotal() {
+        std::lock_guard<std::mutex> guard(lock);
+        return refused;
+    }
+};
+
+#endif
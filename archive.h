@@ -0,0 +1,124 @@
+// archive.h - Packed multi-file stream used by MGET and MPUT
+//
+// MGET answers with a single stream that carries every matching file back
+// to back, so fetching a directory of small files costs one request instead
+// of a DOWNLOAD round trip per file; MPUT sends one the other way. Each entry is
+//
+//   FILE <size> <name>\n
+//   <size bytes of file data>
+//   CRC32C:<hex>\n
+//
+// The stream is cut into DATA frames without regard to entry boundaries.
+// ArchiveReader reassembles it incrementally, so the receiver can unpack
+// each file while it arrives and never buffers more than one header line.
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include "checksum.h"
+
+#define ARCHIVE_ENTRY "FILE "
+#define ARCHIVE_LINE_MAX 4096     // Longest header or trailer line a reader accepts
+
+inline void appendArchiveHeader(std::string& out, const std::string& name, long size) {
+    out.append(ARCHIVE_ENTRY).append(std::to_string(size)).append(" ").append(name) += '\n';
+}
+
+// A name that stays inside the directory it is unpacked into
+inline bool archiveNameSafe(const std::string& name) {
+    return !name.empty() && name != "." && name != ".." &&
+           name.find('/') == std::string::npos && name.find('\0') == std::string::npos;
+}
+
+class ArchiveReader {
+private:
+    enum class State { HEADER, BODY, TRAILER };
+
+    State state;
+    std::string line;       // Header or trailer line collected so far
+    long body_left;
+    uint32_t crc;           // CRC32C of the current entry's body
+
+    static bool parseHeader(const std::string& line, std::string& name, long& size) {
+        size_t prefix = strlen(ARCHIVE_ENTRY);
+        if (line.compare(0, prefix, ARCHIVE_ENTRY) != 0) {
+            return false;
+        }
+        char* end;
+        size = strtol(line.c_str() + prefix, &end, 10);
+        if (end == line.c_str() + prefix || *end != ' ' || size < 0) {
+            return false;
+        }
+        const char* start = end + 1;
+        name.assign(start, line.c_str() + line.size() - 1 - start); // Without the newline
+        return archiveNameSafe(name);
+    }
+
+public:
+    ArchiveReader() : state(State::HEADER), body_left(0), crc(0) {}
+
+    // Consumes all of data. begin() announces an entry, body() hands over
+    // its bytes, end() reports whether they matched the entry's checksum.
+    // Returns false if the stream is malformed.
+    bool feed(const char* data, size_t length,
+              const std::function<void(const std::string&, long)>& begin,
+              const std::function<void(const char*, size_t)>& body,
+              const std::function<void(bool)>& end) {
+        while (length > 0) {
+            if (state == State::BODY) {
+                size_t take = std::min<size_t>(body_left, length);
+                crc = crc32c(crc, data, take);
+                body(data, take);
+                data += take;
+                length -= take;
+                body_left -= take;
+                if (body_left == 0) {
+                    state = State::TRAILER;
+                }
+                continue;
+            }
+
+            const char* newline = static_cast<const char*>(memchr(data, '\n', length));
+            size_t take = newline ? newline - data + 1 : length;
+            line.append(data, take);
+            data += take;
+            length -= take;
+            if (line.size() > ARCHIVE_LINE_MAX) {
+                return false;
+            }
+            if (!newline) {
+                break;
+            }
+
+            if (state == State::HEADER) {
+                std::string name;
+                if (!parseHeader(line, name, body_left)) {
+                    return false;
+                }
+                crc = 0;
+                begin(name, body_left);
+                state = body_left > 0 ? State::BODY : State::TRAILER;
+            } else {
+                uint32_t expected;
+                if (!parseChecksumTrailer(line, expected)) {
+                    return false;
+                }
+                end(expected == crc);
+                state = State::HEADER;
+            }
+            line.clear();
+        }
+        return true;
+    }
+
+    // True between entries, i.e. the stream could legitimately end here
+    bool idle() const {
+        return state == State::HEADER && line.empty();
+    }
+};
+
+#endif
@@ -0,0 +1,127 @@
+// buffer_pool.h - Recycled, page-aligned transfer buffers
+//
+// Buffers are carved out of large mmap()ed slabs and kept on one free list
+// (shelf) per worker. A worker borrows a buffer for the session it is
+// servicing and returns it to its own shelf afterwards, so in steady state
+// each worker reuses the same cache-warm buffer: nothing is allocated or
+// zeroed on the data path, and idle connections hold no buffer at all.
+// Slab pages only become resident once a buffer on them is first used.
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <sys/mman.h>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#define POOL_BUFFER (256 * 1024)   // Size of every pooled buffer
+#define POOL_SLAB_BUFFERS 4        // Buffers carved per slab allocation
+
+class BufferPool {
+private:
+    struct Shelf {
+        std::mutex lock;
+        std::vector<char*> free;
+    };
+
+    std::vector<std::unique_ptr<Shelf>> shelves;
+    std::mutex slab_lock;
+    std::vector<char*> slabs;
+
+    // Maps a new slab and puts its buffers on shelf; false if out of memory
+    bool grow(Shelf& shelf) {
+        size_t bytes = static_cast<size_t>(POOL_SLAB_BUFFERS) * POOL_BUFFER;
+        void* slab = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED) {
+            return false;
+        }
+        {
+            std::lock_guard<std::mutex> guard(slab_lock);
+            slabs.push_back(static_cast<char*>(slab));
+        }
+        for (size_t i = 0; i < POOL_SLAB_BUFFERS; i++) {
+            shelf.free.push_back(static_cast<char*>(slab) + i * POOL_BUFFER);
+        }
+        return true;
+    }
+
+    void giveBack(size_t worker, char* buffer) {
+        Shelf& shelf = *shelves[worker];
+        std::lock_guard<std::mutex> guard(shelf.lock);
+        shelf.free.push_back(buffer);
+    }
+
+public:
+    // A buffer on loan; it goes back to the borrowing worker's shelf when
+    // released or destroyed
+    class Lease {
+    private:
+        BufferPool* pool;
+        size_t worker;
+        char* bytes;
+
+    public:
+        Lease() : pool(nullptr), worker(0), bytes(nullptr) {}
+        Lease(BufferPool* p, size_t w, char* b) : pool(p), worker(w), bytes(b) {}
+        Lease(const Lease&) = delete;
+        Lease& operator=(const Lease&) = delete;
+        Lease(Lease&& other) noexcept : pool(other.pool), worker(other.worker), bytes(other.bytes) {
+            other.bytes = nullptr;
+        }
+        Lease& operator=(Lease&& other) noexcept {
+            if (this != &other) {
+                release();
+                pool = other.pool;
+                worker = other.worker;
+                bytes = other.bytes;
+                other.bytes = nullptr;
+            }
+            return *this;
+        }
+        ~Lease() {
+            release();
+        }
+
+        void release() {
+            if (bytes) {
+                pool->giveBack(worker, bytes);
+                bytes = nullptr;
+            }
+        }
+
+        char* data() const { return bytes; }
+        size_t size() const { return POOL_BUFFER; }
+        explicit operator bool() const { return bytes != nullptr; }
+    };
+
+    explicit BufferPool(size_t workers) {
+        for (size_t i = 0; i < workers; i++) {
+            shelves.push_back(std::make_unique<Shelf>());
+        }
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    ~BufferPool() {
+        for (char* slab : slabs) {
+            munmap(slab, static_cast<size_t>(POOL_SLAB_BUFFERS) * POOL_BUFFER);
+        }
+    }
+
+    // Lends a buffer from worker's shelf, mapping another slab only when
+    // the shelf is empty; an empty lease if memory is exhausted
+    Lease acquire(size_t worker) {
+        Shelf& shelf = *shelves[worker];
+        std::lock_guard<std::mutex> guard(shelf.lock);
+        if (shelf.free.empty() && !grow(shelf)) {
+            return Lease();
+        }
+        char* buffer = shelf.free.back();
+        shelf.free.pop_back();
+        return Lease(this, worker, buffer);
+    }
+};
+
+#endif
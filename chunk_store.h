@@ -0,0 +1,451 @@
+// chunk_store.h - Content-defined chunking and a deduplicating chunk store
+#ifndef CHUNK_STORE_H
+#define CHUNK_STORE_H
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sha256.h"
+
+#define CHUNK_MIN_SIZE (2 * 1024)
+#define CHUNK_AVG_SIZE (8 * 1024)
+#define CHUNK_MAX_SIZE (64 * 1024)
+#define MANIFEST_SUFFIX ".chunks"   // <file>.chunks in the shared directory lists as <file>
+#define MANIFEST_MAGIC "FSCHUNK1"
+
+// A manifest is a header followed by one fixed-size entry per chunk, in
+// file order. Fixed-size entries let a reader binary-search for the chunk
+// holding any offset with a few pread() calls instead of loading the list.
+// Integers are in host byte order; manifests never leave the server.
+struct ManifestHeader {
+    char magic[8];
+    uint64_t size;          // Logical file size
+    uint64_t count;         // Number of entries; both are 0 while the upload is partial
+    uint64_t reserved;
+};
+
+struct ManifestEntry {
+    uint64_t offset;        // Where the chunk starts in the logical file
+    uint32_t length;
+    uint32_t reserved;
+    unsigned char hash[SHA256_DIGEST_SIZE];
+};
+
+// Reads and validates a manifest header; false if fd is not a finished manifest
+inline bool readManifestHeader(int fd, ManifestHeader& header) {
+    return pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+           memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) == 0 &&
+           header.count > 0;
+}
+
+inline bool isManifestName(const std::string& name) {
+    size_t suffix = strlen(MANIFEST_SUFFIX);
+    return name.size() > suffix && name.compare(name.size() - suffix, suffix, MANIFEST_SUFFIX) == 0;
+}
+
+// FastCDC: a gear hash rolls over the data and a chunk ends where its top
+// bits are all zero. Cut points depend only on nearby content, so an insert
+// early in a file shifts a chunk or two instead of every block after it.
+// A stricter mask below the average size and a looser one above it
+// ("normalized chunking") keep most chunks close to CHUNK_AVG_SIZE.
+class ContentChunker {
+private:
+    static const uint64_t MASK_STRICT = 0xFFFE000000000000ULL;  // 15 bits
+    static const uint64_t MASK_LOOSE = 0xFFE0000000000000ULL;   // 11 bits
+
+    static const uint64_t* gearTable() {
+        static uint64_t table[256];
+        static bool ready = [] {
+            uint64_t seed = 0x9E3779B97F4A7C15ULL;
+            for (int i = 0; i < 256; i++) {
+                // splitmix64: fixed seed, so cut points never change between builds
+                uint64_t z = (seed += 0x9E3779B97F4A7C15ULL);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+                table[i] = z ^ (z >> 31);
+            }
+            return true;
+        }();
+        (void)ready;
+        return table;
+    }
+
+public:
+    // Length of the chunk at the front of data. Only meaningful when at
+    // least CHUNK_MAX_SIZE bytes are available or data is the end of the file.
+    static size_t cut(const unsigned char* data, size_t length) {
+        if (length <= CHUNK_MIN_SIZE) {
+            return length;
+        }
+        if (length > CHUNK_MAX_SIZE) {
+            length = CHUNK_MAX_SIZE;
+        }
+        size_t normal = (length < CHUNK_AVG_SIZE) ? length : CHUNK_AVG_SIZE;
+
+        const uint64_t* gear = gearTable();
+        uint64_t fingerprint = 0;
+        size_t i = CHUNK_MIN_SIZE;
+        for (; i < normal; i++) {
+            fingerprint = (fingerprint << 1) + gear[data[i]];
+            if ((fingerprint & MASK_STRICT) == 0) {
+                return i;
+            }
+        }
+        for (; i < length; i++) {
+            fingerprint = (fingerprint << 1) + gear[data[i]];
+            if ((fingerprint & MASK_LOOSE) == 0) {
+                return i;
+            }
+        }
+        return length;
+    }
+};
+
+// Unique chunks live at <root>/<first hash byte>/<hash>, each written once
+// to a temporary name and renamed into place, so a chunk that exists is
+// always complete and two sessions storing the same bytes cannot collide.
+class ChunkStore {
+private:
+    std::string root;
+    int dir_fd;
+    std::atomic<uint64_t> temp_counter;
+
+    static std::string relativePath(const unsigned char* hash) {
+        std::string hex = Sha256::hex(hash);
+        return hex.substr(0, 2) + "/" + hex;
+    }
+
+public:
+    ChunkStore() : dir_fd(-1), temp_counter(0) {}
+
+    bool open(const std::string& path) {
+        root = path;
+        if (mkdir(root.c_str(), 0755) != 0 && errno != EEXIST) {
+            return false;
+        }
+        dir_fd = ::open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0) {
+            return false;
+        }
+        for (int i = 0; i < 256; i++) {
+            char fanout[3];
+            snprintf(fanout, sizeof(fanout), "%02x", i);
+            if (mkdirat(dir_fd, fanout, 0755) != 0 && errno != EEXIST) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const std::string& path() const {
+        return root;
+    }
+
+    // Stores a chunk unless an identical one is already there; stored says which
+    bool put(const unsigned char* hash, const unsigned char* data, size_t length, bool& stored) {
+        std::string name = relativePath(hash);
+        if (faccessat(dir_fd, name.c_str(), F_OK, 0) == 0) {
+            stored = false;
+            return true;
+        }
+
+        std::string temp = name.substr(0, 3) + ".tmp." + std::to_string(getpid()) + "." +
+                           std::to_string(temp_counter.fetch_add(1, std::memory_order_relaxed));
+        int fd = openat(dir_fd, temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        size_t written = 0;
+        while (written < length) {
+            ssize_t n = write(fd, data + written, length - written);
+            if (n <= 0) {
+                if (n < 0 && errno == EINTR) {
+                    continue;
+                }
+                break;
+            }
+            written += n;
+        }
+        close(fd);
+        if (written < length || renameat(dir_fd, temp.c_str(), dir_fd, name.c_str()) != 0) {
+            unlinkat(dir_fd, temp.c_str(), 0);
+            return false;
+        }
+        stored = true;
+        return true;
+    }
+
+    int openChunk(const unsigned char* hash) const {
+        return openat(dir_fd, relativePath(hash).c_str(), O_RDONLY | O_CLOEXEC);
+    }
+
+    // Makes every chunk written so far durable. Chunks are small and many,
+    // so one filesystem-wide sync beats an fdatasync() per chunk.
+    bool sync() const {
+        return syncfs(dir_fd) == 0;
+    }
+
+    ~ChunkStore() {
+        if (dir_fd >= 0) {
+            close(dir_fd);
+        }
+    }
+};
+
+// Turns an upload byte stream into chunks and manifest entries. Bytes are
+// buffered until a cut point is certain; everything before the last cut is
+// already stored and listed in the (still partial) manifest, which is what
+// an interrupted upload resumes from.
+class ChunkWriter {
+private:
+    ChunkStore& store;
+    int manifest_fd;            // Owned by the caller
+    uint64_t committed;         // Bytes covered by manifest entries
+    uint64_t count;
+    std::vector<unsigned char> pending;
+    size_t pending_start;
+    uint64_t stored_bytes;      // New chunk data written by this upload
+    uint64_t duplicate_bytes;   // Bytes that matched chunks already stored
+
+    bool emit(size_t length) {
+        const unsigned char* data = pending.data() + pending_start;
+        ManifestEntry entry = {committed, static_cast<uint32_t>(length), 0, {0}};
+        Sha256::hash(data, length, entry.hash);
+
+        bool stored = false;
+        if (!store.put(entry.hash, data, length, stored)) {
+            return false;
+        }
+        off_t position = sizeof(ManifestHeader) + count * sizeof(ManifestEntry);
+        if (pwrite(manifest_fd, &entry, sizeof(entry), position) != sizeof(entry)) {
+            return false;
+        }
+        (stored ? stored_bytes : duplicate_bytes) += length;
+        committed += length;
+        count++;
+        pending_start += length;
+        return true;
+    }
+
+    // Stores chunks while a full CHUNK_MAX_SIZE window (or the tail) is buffered
+    bool drain(bool final) {
+        while (pending.size() - pending_start >= (final ? 1 : CHUNK_MAX_SIZE)) {
+            size_t length = ContentChunker::cut(pending.data() + pending_start, pending.size() - pending_start);
+            if (!emit(length)) {
+                return false;
+            }
+        }
+        if (pending_start >= CHUNK_MAX_SIZE) {
+            pending.erase(pending.begin(), pending.begin() + pending_start);
+            pending_start = 0;
+        }
+        return true;
+    }
+
+public:
+    ChunkWriter(ChunkStore& chunk_store, int fd)
+        : store(chunk_store), manifest_fd(fd), committed(0), count(0), pending_start(0),
+          stored_bytes(0), duplicate_bytes(0) {}
+
+    // Entries and logical length of a partial manifest, ignoring a torn
+    // trailing entry; false if the file is not a manifest
+    static bool partialLength(int fd, uint64_t& entries, uint64_t& length) {
+        struct stat st;
+        char magic[sizeof(MANIFEST_MAGIC) - 1];
+        if (fstat(fd, &st) != 0 || st.st_size < static_cast<off_t>(sizeof(ManifestHeader)) ||
+            pread(fd, magic, sizeof(magic), 0) != sizeof(magic) ||
+            memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) != 0) {
+            return false;
+        }
+        entries = (st.st_size - sizeof(ManifestHeader)) / sizeof(ManifestEntry);
+        length = 0;
+        if (entries > 0) {
+            ManifestEntry last;
+            off_t position = sizeof(ManifestHeader) + (entries - 1) * sizeof(ManifestEntry);
+            if (pread(fd, &last, sizeof(last), position) != sizeof(last)) {
+                return false;
+            }
+            length = last.offset + last.length;
+        }
+        return true;
+    }
+
+    // Starts a new manifest, or continues one whose entries end exactly at offset
+    bool begin(uint64_t offset) {
+        if (offset == 0) {
+            ManifestHeader header = {{0}, 0, 0, 0};
+            memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+            return ftruncate(manifest_fd, 0) == 0 &&
+                   pwrite(manifest_fd, &header, sizeof(header), 0) == sizeof(header);
+        }
+        uint64_t entries = 0, length = 0;
+        if (!partialLength(manifest_fd, entries, length) || length != offset) {
+            return false;
+        }
+        count = entries;
+        committed = length;
+        return ftruncate(manifest_fd, sizeof(ManifestHeader) + count * sizeof(ManifestEntry)) == 0;
+    }
+
+    bool write(const char* data, size_t length) {
+        pending.insert(pending.end(), data, data + length);
+        return drain(false);
+    }
+
+    // Stores the tail, then seals the manifest once its chunks are durable
+    bool finish() {
+        if (!drain(true) || !store.sync()) {
+            return false;
+        }
+        ManifestHeader header = {{0}, committed, count, 0};
+        memcpy(header.magic, MANIFEST_MAGIC, sizeof(header.magic));
+        return pwrite(manifest_fd, &header, sizeof(header), 0) == sizeof(header) &&
+               fdatasync(manifest_fd) == 0;
+    }
+
+    // Makes the chunks listed so far durable, for an upload cut short
+    void sync() {
+        store.sync();
+        fdatasync(manifest_fd);
+    }
+
+    uint64_t committedBytes() const {
+        return committed;
+    }
+
+    uint64_t duplicateBytes() const {
+        return duplicate_bytes;
+    }
+
+    uint64_t storedBytes() const {
+        return stored_bytes;
+    }
+};
+
+// Reads a finished manifest back as one logical file. The caller asks for
+// the chunk holding an offset and streams straight from that chunk's file,
+// so a download reassembles the original without copying it anywhere.
+class ChunkedFile {
+private:
+    const ChunkStore& store;
+    int manifest_fd;            // Owned by the caller
+    ManifestHeader header;
+    uint64_t index;             // Entry of the open chunk
+    uint64_t chunk_start;
+    uint64_t chunk_end;
+    int chunk_fd;
+
+    bool readEntry(uint64_t i, ManifestEntry& entry) const {
+        off_t position = sizeof(ManifestHeader) + i * sizeof(ManifestEntry);
+        return pread(manifest_fd, &entry, sizeof(entry), position) == sizeof(entry);
+    }
+
+    bool openEntry(uint64_t i) {
+        ManifestEntry entry;
+        if (!readEntry(i, entry)) {
+            return false;
+        }
+        int fd = store.openChunk(entry.hash);
+        if (fd < 0) {
+            return false;
+        }
+        if (chunk_fd >= 0) {
+            close(chunk_fd);
+        }
+        chunk_fd = fd;
+        index = i;
+        chunk_start = entry.offset;
+        chunk_end = entry.offset + entry.length;
+        return true;
+    }
+
+public:
+    ChunkedFile(const ChunkStore& chunk_store, int fd)
+        : store(chunk_store), manifest_fd(fd), header(), index(0), chunk_start(0), chunk_end(0), chunk_fd(-1) {}
+
+    ChunkedFile(const ChunkedFile&) = delete;
+    ChunkedFile& operator=(const ChunkedFile&) = delete;
+
+    bool open() {
+        return readManifestHeader(manifest_fd, header);
+    }
+
+    uint64_t size() const {
+        return header.size;
+    }
+
+    // Opens the chunk that holds offset; sequential reads just step to the next entry
+    bool seek(uint64_t offset) {
+        if (chunk_fd >= 0 && offset >= chunk_start && offset < chunk_end) {
+            return true;
+        }
+        if (offset >= header.size) {
+            return false;
+        }
+        if (chunk_fd >= 0 && offset == chunk_end) {
+            return openEntry(index + 1);
+        }
+
+        // Last entry starting at or before offset
+        uint64_t low = 0, high = header.count - 1;
+        while (low < high) {
+            uint64_t middle = low + (high - low + 1) / 2;
+            ManifestEntry entry;
+            if (!readEntry(middle, entry)) {
+                return false;
+            }
+            if (entry.offset <= offset) {
+                low = middle;
+            } else {
+                high = middle - 1;
+            }
+        }
+        return openEntry(low) && offset < chunk_end;
+    }
+
+    // Copies logical bytes out for callers that need them in memory;
+    // returns the count read, short only at the end, or -1 on error
+    ssize_t read(uint64_t offset, char* buffer, size_t length) {
+        size_t done = 0;
+        while (done < length && offset + done < header.size) {
+            if (!seek(offset + done)) {
+                return -1;
+            }
+            size_t take = std::min<uint64_t>(length - done, chunk_end - (offset + done));
+            ssize_t n = pread(chunk_fd, buffer + done, take, offset + done - chunk_start);
+            if (n <= 0) {
+                return -1;
+            }
+            done += n;
+        }
+        return done;
+    }
+
+    int chunkFd() const {
+        return chunk_fd;
+    }
+
+    uint64_t chunkStart() const {
+        return chunk_start;
+    }
+
+    uint64_t chunkEnd() const {
+        return chunk_end;
+    }
+
+    ~ChunkedFile() {
+        if (chunk_fd >= 0) {
+            close(chunk_fd);
+        }
+    }
+};
+
+#endif
@@ -11,19 +11,252 @@
 #include <sys/stat.h>
 #include <dirent.h>
 #include <termios.h>
+#include <fcntl.h>
+#include <vector>
+#include <map>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <fnmatch.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include "protocol.h"
+#include "delta.h"
+#include "compression.h"
+#include "checksum.h"
+#include "archive.h"
+#include "trace.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 4096
+#define RECEIVE_BUFFER (256 * 1024)   // Download reads; long runs keep CRC32C on its fast path
 #define DOWNLOAD_DIR "./downloads"
 #define UPLOAD_DIR "./uploads"
+#define PIPELINE_WINDOW 32
+#define PARTIAL_SUFFIX ".part"
+#define DEFAULT_SEGMENTS 4
+#define MAX_SEGMENTS 16
+#define SEGMENT_THRESHOLD (8 * 1024 * 1024)
+#define SEGMENT_BUFFER (256 * 1024)
+#define SEGMENT_ATTEMPTS 3
+#define LIST_PAGE 5000
+#define DELTA_THRESHOLD (1024 * 1024)   // Smaller files are simply re-sent
+#define ARCHIVE_BLOCK (256 * 1024)      // MPUT stream bytes per DATA frame
+#define ARCHIVE_READ_AHEAD 4            // MPUT blocks read from disk ahead of the socket
+#define CONNECT_ATTEMPTS 10             // Connections tried while the server answers BUSY
+#define TRACE_FILE "./client-trace.json"
+
+// An extra binary-protocol connection that fetches one byte range of a file
+// and writes it into place with pwrite(). Segmented downloads run several of
+// these side by side to get past the throughput of a single TCP stream.
+class SegmentConnection {
+private:
+    int fd;
+    uint32_t next_request_id;
+
+    bool sendAll(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+            if (sent <= 0) {
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    bool recvAll(char* data, size_t length) {
+        while (length > 0) {
+            ssize_t received = read(fd, data, length);
+            if (received <= 0) {
+                return false;
+            }
+            data += received;
+            length -= received;
+        }
+        return true;
+    }
+
+    bool readFrame(FrameHeader& header, std::string& payload) {
+        char header_bytes[FRAME_HEADER_SIZE];
+        if (!recvAll(header_bytes, FRAME_HEADER_SIZE) || !decodeFrameHeader(header_bytes, header)) {
+            return false;
+        }
+        payload.clear();
+        if (header.type == FRAME_DATA) {
+            return true;
+        }
+        if (header.length > MAX_CONTROL_PAYLOAD) {
+            return false;
+        }
+        payload.resize(header.length);
+        return recvAll(&payload[0], header.length);
+    }
+
+    bool sendCommand(const std::string& command, uint8_t flags, uint32_t& request_id) {
+        std::string frame;
+        request_id = ++next_request_id;
+        appendFrame(frame, FRAME_COMMAND, flags, request_id, command);
+        return sendAll(frame.data(), frame.size());
+    }
+
+    // Writes one DATA payload of the range at offset + done, decoding it first if compressed
+    bool receiveData(uint64_t length, Codec encoding, std::vector<char>& buffer, int file_fd,
+                     long offset, long length_left, long& done, std::atomic<long>& progress, uint32_t& crc) {
+        if (encoding != CODEC_NONE) {
+            std::string raw;
+            if (length > COMPRESS_FRAME_MAX || !recvAll(buffer.data(), length) ||
+                !decodeBlock(buffer.data(), length, raw) || raw.size() > static_cast<size_t>(length_left) ||
+                pwrite(file_fd, raw.data(), raw.size(), offset + done) != static_cast<ssize_t>(raw.size())) {
+                return false;
+            }
+            crc = crc32c(crc, raw.data(), raw.size());
+            done += raw.size();
+            progress += raw.size();
+            return true;
+        }
+
+        if (length > static_cast<uint64_t>(length_left)) {
+            return false;
+        }
+        while (length > 0) {
+            size_t chunk = std::min<uint64_t>(length, buffer.size());
+            if (!recvAll(buffer.data(), chunk)) {
+                return false;
+            }
+            if (pwrite(file_fd, buffer.data(), chunk, offset + done) != static_cast<ssize_t>(chunk)) {
+                return false;
+            }
+            crc = crc32c(crc, buffer.data(), chunk);
+            done += chunk;
+            progress += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+public:
+    SegmentConnection() : fd(-1), next_request_id(0) {}
+
+    ~SegmentConnection() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Connects, switches to frames, resumes the session with its token and
+    // asks for codec (if any). Both commands go out before either reply is read.
+    bool open(const struct sockaddr_in& addr, const std::string& token, Codec codec) {
+        fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (fd < 0 || connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            return false;
+        }
+
+        std::string request = std::string(PROTO_REQUEST) + " " + std::to_string(PROTOCOL_VERSION) + "\n";
+        if (!sendAll(request.data(), request.size())) {
+            return false;
+        }
+
+        // Nothing but the welcome banner and the PROTO reply arrives before
+        // the first frame is sent, so reading text until the reply is safe
+        std::string text;
+        char buffer[BUFFER_SIZE];
+        while (text.find(PROTO_ACCEPTED) == std::string::npos || text.back() != '\n') {
+            ssize_t received = read(fd, buffer, sizeof(buffer));
+            if (received <= 0 || text.size() > MAX_CONTROL_PAYLOAD) {
+                // Turned away by a busy server: hold the retry off as asked
+                long retry_ms = busyRetryMs(text);
+                if (retry_ms > 0) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
+                }
+                return false;
+            }
+            text.append(buffer, received);
+        }
+
+        uint32_t request_id;
+        FrameHeader header;
+        std::string payload;
+        if (!sendCommand("AUTH " + token, 0, request_id) ||
+            (codec != CODEC_NONE && !sendCommand(std::string("COMPRESS ") + codecName(codec), 0, request_id)) ||
+            !readFrame(header, payload) || header.type != FRAME_RESPONSE || payload.compare(0, 2, "OK") != 0) {
+            return false;
+        }
+        // A refusal just leaves this connection uncompressed
+        return codec == CODEC_NONE || readFrame(header, payload);
+    }
+
+    // Fetches [offset, offset + length) of filename into file_fd. done counts
+    // the bytes written so far, so a retry can continue where this one stopped.
+    // Bytes that fail the END frame's checksum are fetched again.
+    bool fetch(const std::string& filename, int file_fd, long offset, long length,
+               long& done, std::atomic<long>& progress) {
+        uint32_t request_id;
+        std::string command = "DOWNLOAD " + filename + " " + std::to_string(offset + done) +
+                              " " + std::to_string(length - done);
+        if (!sendCommand(command, FLAG_PIPELINED, request_id)) {
+            return false;
+        }
+
+        std::vector<char> buffer(std::max(SEGMENT_BUFFER, COMPRESS_FRAME_MAX));
+        Codec encoding = CODEC_NONE;
+        long attempt_start = done;
+        uint32_t crc = 0;
+        while (true) {
+            FrameHeader header;
+            std::string payload;
+            if (!readFrame(header, payload) || header.request_id != request_id) {
+                return false;
+            }
+            if (header.type == FRAME_METADATA) {
+                size_t pos = payload.find("ENCODING:");
+                if (pos != std::string::npos) {
+                    encoding = codecByName(payload.substr(pos + 9, payload.find('\n', pos) - pos - 9));
+                }
+                continue;
+            }
+            if (header.type == FRAME_END) {
+                uint32_t expected;
+                if (!parseChecksumTrailer(payload, expected) || expected != crc) {
+                    progress -= done - attempt_start;
+                    done = attempt_start;
+                    return false;
+                }
+                return done == length;
+            }
+            if (header.type != FRAME_DATA) {
+                return false; // Error reply, e.g. file removed meanwhile
+            }
+            if (!receiveData(header.length, encoding, buffer, file_fd, offset, length - done, done, progress, crc)) {
+                return false;
+            }
+        }
+    }
+};
 
 class FileClient {
 private:
     int sock;
     struct sockaddr_in serv_addr;
     bool connected;
+    std::string welcome;       // Banner read on connecting
     bool authenticated;
     std::string username;
+    std::string session_token; // From LOGIN; lets segment connections skip it
+    bool binary;               // Server accepted the framed protocol
+    uint32_t next_request_id;
+    int segments;              // Parallel connections for large downloads
+    Codec wanted_codec;        // Compression to ask for; CODEC_NONE = off
+    Codec codec;               // Compression the server agreed to
+    TraceLog tracer;           // Samples single-file downloads and uploads (see trace.h)
+
+    static void tracePhase(RequestTrace* trace, const char* name) {
+        if (trace) {
+            trace->phase(name);
+        }
+    }
 
     std::string getPassword() {
         // Disable echo for password input
@@ -51,6 +284,33 @@ private:
         return 0;
     }
 
+    // Opens the partial file a download is written to, keeping the first
+    // offset bytes when the server resumed an earlier attempt
+    bool openPartial(std::ofstream& file, const std::string& path, long offset) {
+        std::string partpath = path + PARTIAL_SUFFIX;
+        if (offset > 0 && truncate(partpath.c_str(), offset) == 0) {
+            file.open(partpath, std::ios::binary | std::ios::app);
+        } else {
+            file.open(partpath, std::ios::binary | std::ios::trunc);
+        }
+        return file.is_open();
+    }
+
+    // Gives a finished download its real name
+    bool commitPartial(const std::string& path) {
+        return rename((path + PARTIAL_SUFFIX).c_str(), path.c_str()) == 0;
+    }
+
+    // DOWNLOAD command that resumes from a partial file left by an earlier attempt
+    std::string downloadRequest(const std::string& filename) {
+        std::string command = "DOWNLOAD " + filename;
+        long have = getFileSize(std::string(DOWNLOAD_DIR) + "/" + filename + PARTIAL_SUFFIX);
+        if (have > 0) {
+            command += " " + std::to_string(have);
+        }
+        return command;
+    }
+
     std::string formatFileSize(long bytes) {
         const char* units[] = {"B", "KB", "MB", "GB"};
         int unit = 0;
@@ -66,11 +326,175 @@ private:
         return oss.str();
     }
 
+    bool sendAll(const char* data, size_t length) {
+        while (length > 0) {
+            ssize_t sent = send(sock, data, length, 0);
+            if (sent <= 0) {
+                connected = false;
+                return false;
+            }
+            data += sent;
+            length -= sent;
+        }
+        return true;
+    }
+
+    bool recvAll(char* data, size_t length) {
+        while (length > 0) {
+            ssize_t received = read(sock, data, length);
+            if (received <= 0) {
+                std::cout << "✗ Server disconnected" << std::endl;
+                connected = false;
+                return false;
+            }
+            data += received;
+            length -= received;
+        }
+        return true;
+    }
+
+    bool sendFrame(uint8_t type, const std::string& payload, uint32_t request_id, uint8_t flags = 0) {
+        std::string frame;
+        appendFrame(frame, type, flags, request_id, payload);
+        return sendAll(frame.data(), frame.size());
+    }
+
+    bool sendFrameHeader(uint8_t type, uint32_t request_id, uint64_t length) {
+        char header_bytes[FRAME_HEADER_SIZE];
+        encodeFrameHeader(header_bytes, {type, 0, request_id, length});
+        return sendAll(header_bytes, FRAME_HEADER_SIZE);
+    }
+
+    bool readFrameHeader(FrameHeader& header) {
+        char header_bytes[FRAME_HEADER_SIZE];
+        if (!recvAll(header_bytes, FRAME_HEADER_SIZE)) {
+            return false;
+        }
+        if (!decodeFrameHeader(header_bytes, header)) {
+            std::cout << "✗ Malformed frame from server" << std::endl;
+            connected = false;
+            return false;
+        }
+        return true;
+    }
+
+    // Reads one control frame whole; DATA payloads are read by the caller
+    bool readFrame(FrameHeader& header, std::string& payload) {
+        if (!readFrameHeader(header)) {
+            return false;
+        }
+        if (header.type == FRAME_DATA) {
+            payload.clear();
+            return true;
+        }
+        if (header.length > MAX_CONTROL_PAYLOAD) {
+            std::cout << "✗ Oversized frame from server" << std::endl;
+            connected = false;
+            return false;
+        }
+        payload.resize(header.length);
+        if (!recvAll(&payload[0], header.length)) {
+            return false;
+        }
+        if (header.type == FRAME_ERROR) {
+            connected = false; // Server closes after a protocol error
+        }
+        return true;
+    }
+
+    // Asks the server for the framed protocol; stays on text if it declines
+    void negotiateProtocol() {
+        std::string request = std::string(PROTO_REQUEST) + " " + std::to_string(PROTOCOL_VERSION) + "\n";
+        sendCommand(request);
+
+        std::string response = receiveResponse();
+        if (response.compare(0, strlen(PROTO_ACCEPTED), PROTO_ACCEPTED) == 0) {
+            binary = true;
+            std::cout << "✓ Using binary protocol v" << PROTOCOL_VERSION << std::endl;
+        }
+    }
+
+    // Offers a compression codec; the server compresses a transfer only when
+    // its data looks compressible, so this is safe to leave on
+    void negotiateCompression() {
+        if (!binary || wanted_codec == CODEC_NONE) {
+            return;
+        }
+        std::string name = codecName(wanted_codec);
+        sendCommand("COMPRESS " + name + "\n");
+        if (receiveResponse() == "OK COMPRESS " + name + "\n") {
+            codec = wanted_codec;
+            std::cout << "✓ Compression: " << name << std::endl;
+        }
+    }
+
+    // Reads the payload of a compressed DATA frame and appends its decoded bytes to raw
+    bool readBlockPayload(const FrameHeader& header, std::string& raw, long& wire_bytes) {
+        if (header.type != FRAME_DATA || header.length > COMPRESS_FRAME_MAX) {
+            std::cout << "\n✗ Unexpected reply from server" << std::endl;
+            connected = false;
+            return false;
+        }
+        std::string block(header.length, '\0');
+        if (!recvAll(&block[0], header.length)) {
+            return false;
+        }
+        wire_bytes += FRAME_HEADER_SIZE + header.length;
+        if (!decodeBlock(block.data(), block.size(), raw)) {
+            std::cout << "\n✗ Corrupt compressed block" << std::endl;
+            connected = false;
+            return false;
+        }
+        return true;
+    }
+
+    // Checks a download's END frame against the CRC32C of what was received
+    bool trailerMatches(const std::string& trailer, uint32_t crc) {
+        uint32_t expected;
+        return parseChecksumTrailer(trailer, expected) && expected == crc;
+    }
+
+    // Share of the raw size that went over the wire, for transfer summaries
+    std::string compressionSummary(Codec encoding, long wire_bytes, long raw_bytes) {
+        std::ostringstream oss;
+        oss << codecName(encoding) << ", " << formatFileSize(wire_bytes) << " sent";
+        if (raw_bytes > 0) {
+            oss << " (" << (wire_bytes * 100 / raw_bytes) << "%)";
+        }
+        return oss.str();
+    }
+
     void sendCommand(const std::string& command) {
+        if (binary) {
+            std::string text = command;
+            if (!text.empty() && text.back() == '\n') {
+                text.pop_back();
+            }
+            sendFrame(FRAME_COMMAND, text, ++next_request_id);
+            return;
+        }
         send(sock, command.c_str(), command.length(), 0);
     }
 
+    // Sends the READY acknowledgement that starts a transfer
+    void sendReady() {
+        if (binary) {
+            sendFrame(FRAME_READY, "", next_request_id);
+        } else {
+            send(sock, "READY", 5, 0);
+        }
+    }
+
     std::string receiveResponse() {
+        if (binary) {
+            FrameHeader header;
+            std::string payload;
+            if (!readFrame(header, payload)) {
+                return "";
+            }
+            return payload;
+        }
+
         char buffer[BUFFER_SIZE] = {0};
         int bytes_read = read(sock, buffer, BUFFER_SIZE);
         
@@ -143,6 +567,12 @@ private:
         
         std::string response = receiveResponse();
         if (!response.empty()) {
+            size_t token_pos = response.find("TOKEN:");
+            if (token_pos != std::string::npos) {
+                size_t token_end = response.find('\n', token_pos);
+                session_token = response.substr(token_pos + 6, token_end - token_pos - 6);
+                response.erase(token_pos, token_end == std::string::npos ? token_end : token_end + 1 - token_pos);
+            }
             std::cout << "\n" << response;
             
             if (response.find("OK") != std::string::npos) {
@@ -166,10 +596,118 @@ private:
         
         authenticated = false;
         username = "";
+        session_token.clear();
         std::cout << "✓ Logged out successfully" << std::endl;
     }
 
+    // Prints one "name\tsize\ttype\tperms\tmtime" line of a streamed listing
+    void renderListEntry(const std::string& line) {
+        std::istringstream fields(line);
+        std::string name, size, type, perms, mtime;
+        std::getline(fields, name, '\t');
+        std::getline(fields, size, '\t');
+        std::getline(fields, type, '\t');
+        std::getline(fields, perms, '\t');
+        std::getline(fields, mtime, '\t');
+        
+        time_t modified = strtol(mtime.c_str(), nullptr, 10);
+        struct tm tm;
+        char date[32] = "";
+        if (localtime_r(&modified, &tm)) {
+            strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+        }
+        std::cout << std::left << std::setw(30) << name
+                  << std::setw(15) << formatFileSize(strtol(size.c_str(), nullptr, 10))
+                  << std::setw(8) << (type == "DIR" ? "[DIR]" : "[FILE]")
+                  << std::setw(12) << perms << date << "\n";
+    }
+
+    // Streams the listing page by page, rendering each chunk as it arrives,
+    // so memory stays bounded however large the directory is
+    void listStreaming(const std::string& options) {
+        std::cout << std::string(80, '-') << "\n";
+        std::cout << std::left << std::setw(30) << "Name" << std::setw(15) << "Size"
+                  << std::setw(8) << "Type" << std::setw(12) << "Permissions" << "Modified\n";
+        std::cout << std::string(80, '-') << "\n";
+        
+        long total = 0;
+        std::string cursor;
+        do {
+            std::string command = "LIST limit=" + std::to_string(LIST_PAGE) + options;
+            if (!cursor.empty()) {
+                command += " after=" + cursor;
+            }
+            if (!sendFrame(FRAME_COMMAND, command, ++next_request_id)) {
+                return;
+            }
+            cursor.clear();
+            
+            while (true) {
+                FrameHeader header;
+                std::string payload;
+                if (!readFrame(header, payload)) {
+                    return;
+                }
+                if (header.type == FRAME_DATA) {
+                    if (header.length > MAX_CONTROL_PAYLOAD) {
+                        std::cout << "✗ Oversized listing chunk" << std::endl;
+                        connected = false;
+                        return;
+                    }
+                    payload.resize(header.length);
+                    if (!recvAll(&payload[0], header.length)) {
+                        return;
+                    }
+                    std::istringstream lines(payload);
+                    std::string line;
+                    while (std::getline(lines, line)) {
+                        renderListEntry(line);
+                    }
+                    continue;
+                }
+                if (header.type != FRAME_END) {
+                    std::cout << payload << std::endl;
+                    return;
+                }
+                
+                std::istringstream summary(payload);
+                std::string line;
+                while (std::getline(summary, line)) {
+                    if (line.compare(0, 6, "COUNT:") == 0) {
+                        total += strtol(line.c_str() + 6, nullptr, 10);
+                    } else if (line.compare(0, 5, "NEXT:") == 0) {
+                        cursor = line.substr(5);
+                    }
+                }
+                break;
+            }
+        } while (!cursor.empty());
+        
+        std::cout << std::string(80, '-') << "\n";
+        std::cout << "Total: " << total << " items" << std::endl;
+    }
+
     void handleListCommand() {
+        if (binary) {
+            std::cout << "\nFilter (glob, Enter for all): ";
+            std::string filter;
+            std::getline(std::cin, filter);
+            std::cout << "Sort by name/size/mtime [name]: ";
+            std::string sort;
+            std::getline(std::cin, sort);
+            
+            std::string options;
+            if (!filter.empty()) {
+                options += " match=" + filter;
+            }
+            if (!sort.empty()) {
+                options += " sort=" + sort;
+            }
+            std::cout << "\n📁 Requesting file list from server...\n" << std::endl;
+            listStreaming(options);
+            return;
+        }
+        
         std::cout << "\n📁 Requesting file list from server...\n" << std::endl;
         sendCommand("LIST\n");
         
@@ -179,8 +717,37 @@ private:
         }
     }
 
+    std::vector<std::string> splitNames(const std::string& line) {
+        std::istringstream iss(line);
+        std::vector<std::string> names;
+        std::string name;
+        while (iss >> name) {
+            names.push_back(name);
+        }
+        return names;
+    }
+
+    // Sends every INFO request up front and prints replies as they arrive
+    void handleInfoPipelined(const std::vector<std::string>& names) {
+        std::string batch;
+        for (const auto& name : names) {
+            appendFrame(batch, FRAME_COMMAND, FLAG_PIPELINED, ++next_request_id, "INFO " + name);
+        }
+        if (!sendAll(batch.data(), batch.size())) {
+            return;
+        }
+
+        for (size_t i = 0; i < names.size() && connected; i++) {
+            std::string response = receiveResponse();
+            if (!response.empty()) {
+                std::cout << "\n" << response;
+            }
+        }
+        std::cout << std::endl;
+    }
+
     void handleInfoCommand() {
-        std::cout << "\nEnter filename: ";
+        std::cout << "\nEnter filename(s): ";
         std::string filename;
         std::getline(std::cin, filename);
         
@@ -189,6 +756,12 @@ private:
             return;
         }
         
+        std::vector<std::string> names = splitNames(filename);
+        if (binary && names.size() > 1) {
+            handleInfoPipelined(names);
+            return;
+        }
+        
         std::string command = "INFO " + filename + "\n";
         sendCommand(command);
         
@@ -198,8 +771,320 @@ private:
         }
     }
 
+    struct PendingDownload {
+        std::string name;
+        std::string path;
+        std::ofstream file;
+        long size;
+        long received;
+        Codec encoding;
+        uint32_t crc;
+    };
+
+    // Keeps up to PIPELINE_WINDOW downloads in flight and writes each DATA
+    // frame to the file its request id belongs to, in whatever order the
+    // server completes them.
+    void downloadPipelined(const std::vector<std::string>& names) {
+        std::map<uint32_t, PendingDownload> pending;
+        size_t next_name = 0;
+        int completed = 0, failed = 0;
+        long total_bytes = 0;
+        std::vector<char> data_buffer(RECEIVE_BUFFER);
+
+        std::cout << "\n📥 Requesting " << names.size() << " files (pipelined)" << std::endl;
+
+        while (connected && (next_name < names.size() || !pending.empty())) {
+            // Top the window up in a single send
+            std::string batch;
+            while (next_name < names.size() && pending.size() < PIPELINE_WINDOW) {
+                uint32_t id = ++next_request_id;
+                appendFrame(batch, FRAME_COMMAND, FLAG_PIPELINED, id, downloadRequest(names[next_name]));
+                pending[id].name = names[next_name++];
+            }
+            if (!batch.empty() && !sendAll(batch.data(), batch.size())) {
+                return;
+            }
+
+            FrameHeader header;
+            std::string payload;
+            if (!readFrame(header, payload)) {
+                return;
+            }
+            auto it = pending.find(header.request_id);
+            if (it == pending.end()) {
+                std::cout << "✗ Reply for unknown request " << header.request_id << std::endl;
+                connected = false;
+                return;
+            }
+            PendingDownload& download = it->second;
+
+            if (header.type == FRAME_METADATA) {
+                std::istringstream iss(payload);
+                std::string line, recv_filename = download.name;
+                long offset = 0;
+                download.size = 0;
+                download.encoding = CODEC_NONE;
+                while (std::getline(iss, line)) {
+                    if (line.find("FILESIZE:") != std::string::npos) {
+                        download.size = std::stol(line.substr(9));
+                    } else if (line.find("FILENAME:") != std::string::npos) {
+                        recv_filename = line.substr(9);
+                    } else if (line.find("OFFSET:") != std::string::npos) {
+                        offset = std::stol(line.substr(7));
+                    } else if (line.compare(0, 9, "ENCODING:") == 0) {
+                        download.encoding = codecByName(line.substr(9));
+                    }
+                }
+                download.received = 0;
+                download.crc = 0;
+                download.path = std::string(DOWNLOAD_DIR) + "/" + recv_filename;
+                openPartial(download.file, download.path, offset);
+            } else if (header.type == FRAME_DATA && download.encoding != CODEC_NONE) {
+                std::string raw;
+                long wire_bytes = 0;
+                if (!readBlockPayload(header, raw, wire_bytes)) {
+                    return;
+                }
+                download.file.write(raw.data(), raw.size());
+                download.crc = crc32c(download.crc, raw.data(), raw.size());
+                download.received += raw.size();
+            } else if (header.type == FRAME_DATA) {
+                uint64_t left = header.length;
+                while (left > 0) {
+                    size_t chunk = std::min<uint64_t>(left, data_buffer.size());
+                    if (!recvAll(data_buffer.data(), chunk)) {
+                        return;
+                    }
+                    download.file.write(data_buffer.data(), chunk);
+                    download.crc = crc32c(download.crc, data_buffer.data(), chunk);
+                    download.received += chunk;
+                    left -= chunk;
+                }
+            } else if (header.type == FRAME_END) {
+                download.file.close();
+                if (!trailerMatches(payload, download.crc)) {
+                    unlink((download.path + PARTIAL_SUFFIX).c_str());
+                    std::cout << "  ✗ " << std::left << std::setw(30) << download.name
+                              << "Checksum mismatch, discarded" << std::endl;
+                    failed++;
+                } else if (download.file.fail() || !commitPartial(download.path)) {
+                    std::cout << "  ✗ " << std::left << std::setw(30) << download.name
+                              << "Cannot write file" << std::endl;
+                    failed++;
+                } else {
+                    std::cout << "  ✓ " << std::left << std::setw(30) << download.name
+                              << formatFileSize(download.received) << std::endl;
+                    total_bytes += download.received;
+                    completed++;
+                }
+                pending.erase(it);
+            } else {
+                std::cout << "  ✗ " << std::left << std::setw(30) << download.name << payload;
+                failed++;
+                pending.erase(it);
+            }
+        }
+
+        std::cout << "\n✓ Downloaded " << completed << " file(s), "
+                  << formatFileSize(total_bytes) << " total";
+        if (failed > 0) {
+            std::cout << " (" << failed << " failed)";
+        }
+        std::cout << std::endl;
+    }
+
+    // MGET: the server streams every match back to back as one archive
+    // (see archive.h), unpacked into DOWNLOAD_DIR as it arrives. Each file
+    // is written to a partial file and only kept if its checksum matches.
+    void downloadArchive(const std::vector<std::string>& patterns) {
+        std::string command = "MGET";
+        for (const auto& pattern : patterns) {
+            command += " " + pattern;
+        }
+        sendCommand(command + "\n");
+
+        FrameHeader header;
+        std::string payload;
+        if (!readFrame(header, payload)) {
+            return;
+        }
+        if (header.type != FRAME_METADATA) {
+            std::cout << "\n" << payload << std::endl;
+            return;
+        }
+        std::istringstream iss(payload);
+        std::string line;
+        long count = 0, bytes = 0;
+        while (std::getline(iss, line)) {
+            if (line.compare(0, 6, "COUNT:") == 0) {
+                count = std::stol(line.substr(6));
+            } else if (line.compare(0, 6, "BYTES:") == 0) {
+                bytes = std::stol(line.substr(6));
+            }
+        }
+        std::cout << "\n📦 Receiving " << count << " file(s), " << formatFileSize(bytes)
+                  << " as one stream" << std::endl;
+
+        ArchiveReader reader;
+        std::ofstream file;
+        std::string name, path;
+        long size = 0;
+        int completed = 0, failed = 0;
+        long total_bytes = 0;
+        bool malformed = false;
+        auto begin = [&](const std::string& entry, long entry_size) {
+            name = entry;
+            size = entry_size;
+            path = std::string(DOWNLOAD_DIR) + "/" + entry;
+            openPartial(file, path, 0);
+        };
+        auto body = [&](const char* data, size_t length) {
+            file.write(data, length);
+        };
+        auto end = [&](bool intact) {
+            file.close();
+            if (!intact) {
+                unlink((path + PARTIAL_SUFFIX).c_str());
+                std::cout << "\r  ✗ " << std::left << std::setw(30) << name << "Checksum mismatch, discarded"
+                          << std::endl;
+                failed++;
+            } else if (file.fail() || !commitPartial(path)) {
+                std::cout << "\r  ✗ " << std::left << std::setw(30) << name << "Cannot write file" << std::endl;
+                failed++;
+            } else {
+                total_bytes += size;
+                completed++;
+            }
+            std::cout << "\r  " << completed + failed << "/" << count << " files" << std::flush;
+        };
+
+        std::vector<char> data_buffer(RECEIVE_BUFFER);
+        while (true) {
+            if (!readFrame(header, payload)) {
+                return;
+            }
+            if (header.request_id != next_request_id || (header.type != FRAME_DATA && header.type != FRAME_END)) {
+                std::cout << "\n✗ Unexpected reply from server" << std::endl;
+                connected = false;
+                return;
+            }
+            if (header.type == FRAME_END) {
+                break;
+            }
+            uint64_t left = header.length;
+            while (left > 0) {
+                size_t chunk = std::min<uint64_t>(left, data_buffer.size());
+                if (!recvAll(data_buffer.data(), chunk)) {
+                    return;
+                }
+                // After a malformed entry the rest is drained so the connection stays usable
+                malformed = malformed || !reader.feed(data_buffer.data(), chunk, begin, body, end);
+                left -= chunk;
+            }
+        }
+        if (malformed || !reader.idle()) {
+            // The stream stopped inside an entry
+            file.close();
+            unlink((path + PARTIAL_SUFFIX).c_str());
+            std::cout << "\r  ✗ " << std::left << std::setw(30) << name << "Incomplete, discarded" << std::endl;
+            failed++;
+        }
+        if (payload.compare(0, 5, "ERROR") == 0) {
+            std::cout << "\n" << payload;
+        }
+
+        std::cout << "\n✓ Unpacked " << completed << " file(s), " << formatFileSize(total_bytes)
+                  << " total into " << DOWNLOAD_DIR;
+        if (failed > 0) {
+            std::cout << " (" << failed << " failed)";
+        }
+        std::cout << std::endl;
+    }
+
+    // Splits one file into segments fetched over parallel connections, each
+    // written into place in a preallocated partial file
+    void downloadSegmented(const std::string& filename, long filesize) {
+        std::string filepath = std::string(DOWNLOAD_DIR) + "/" + filename;
+        std::string partpath = filepath + PARTIAL_SUFFIX;
+        
+        int file_fd = open(partpath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file_fd < 0) {
+            std::cout << "Error: Cannot create file for writing" << std::endl;
+            return;
+        }
+        if (posix_fallocate(file_fd, 0, filesize) != 0 && ftruncate(file_fd, filesize) != 0) {
+            std::cout << "Error: Cannot allocate " << formatFileSize(filesize) << std::endl;
+            close(file_fd);
+            unlink(partpath.c_str());
+            return;
+        }
+        
+        std::cout << "\n🔀 Fetching in " << segments << " segments over parallel connections" << std::endl;
+        
+        std::atomic<long> progress(0);
+        std::atomic<int> running(segments);
+        std::vector<char> ok(segments, 0);
+        std::vector<std::thread> workers;
+        long segment_size = filesize / segments;
+        auto start_time = std::chrono::steady_clock::now();
+        
+        for (int i = 0; i < segments; i++) {
+            long offset = i * segment_size;
+            long length = (i == segments - 1) ? filesize - offset : segment_size;
+            workers.emplace_back([&, i, offset, length] {
+                long done = 0;
+                for (int attempt = 0; attempt < SEGMENT_ATTEMPTS && !ok[i]; attempt++) {
+                    SegmentConnection connection;
+                    ok[i] = connection.open(serv_addr, session_token, codec) &&
+                            connection.fetch(filename, file_fd, offset, length, done, progress);
+                }
+                running--;
+            });
+        }
+        
+        std::cout << "Progress: [" << std::flush;
+        int last_progress = -1;
+        while (true) {
+            bool finished = running == 0;
+            int current = (progress * 50) / filesize;
+            for (int i = last_progress + 1; i <= current; i++) {
+                std::cout << "=" << std::flush;
+            }
+            last_progress = std::max(last_progress, current);
+            if (finished) {
+                break;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        close(file_fd);
+        
+        int failed = 0;
+        for (int i = 0; i < segments; i++) {
+            failed += ok[i] ? 0 : 1;
+        }
+        if (failed > 0 || !commitPartial(filepath)) {
+            // A segmented partial file has holes, so it can't be resumed by size
+            unlink(partpath.c_str());
+            std::cout << "]\n✗ Download failed (" << failed << " segment(s) incomplete)" << std::endl;
+            return;
+        }
+        
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time).count();
+        std::cout << "] 100%" << std::endl;
+        std::cout << "\n✓ Download complete!" << std::endl;
+        std::cout << "  File saved: " << filepath << std::endl;
+        std::cout << "  Size: " << formatFileSize(filesize) 
+                  << " (" << filesize << " bytes)" << std::endl;
+        if (seconds > 0) {
+            std::cout << "  Rate: " << formatFileSize(static_cast<long>(filesize / seconds)) << "/s" << std::endl;
+        }
+    }
+
     void handleDownloadCommand() {
-        std::cout << "\nEnter filename to download: ";
+        std::cout << "\nEnter filename(s) or pattern(s) to download: ";
         std::string filename;
         std::getline(std::cin, filename);
         
@@ -210,31 +1095,44 @@ private:
         
         system(("mkdir -p " + std::string(DOWNLOAD_DIR)).c_str());
         
+        std::vector<std::string> names = splitNames(filename);
+        if (binary && filename.find_first_of("*?[") != std::string::npos) {
+            downloadArchive(names);
+            return;
+        }
+        if (binary && names.size() > 1) {
+            downloadPipelined(names);
+            return;
+        }
+        
         std::cout << "\n📥 Requesting download: " << filename << std::endl;
         
-        std::string command = "DOWNLOAD " + filename + "\n";
+        std::unique_ptr<RequestTrace> trace = tracer.start("DOWNLOAD", filename);
+        tracePhase(trace.get(), "send command");
+        std::string command = downloadRequest(filename) + "\n";
         sendCommand(command);
         
-        char buffer[BUFFER_SIZE] = {0};
-        int bytes_read = read(sock, buffer, BUFFER_SIZE);
-        
-        if (bytes_read <= 0) {
-            std::cout << "✗ Server disconnected" << std::endl;
-            connected = false;
+        tracePhase(trace.get(), "await metadata");
+        std::string response = receiveResponse();
+        if (response.empty()) {
             return;
         }
         
-        std::string response(buffer);
-        
         if (response.find("ERROR") != std::string::npos) {
             std::cout << response << std::endl;
+            if (trace) {
+                trace->setOutcome("rejected");
+            }
             return;
         }
         
         std::istringstream iss(response);
         std::string line;
         long filesize = 0;
+        long offset = 0;
+        long length = -1;
         std::string recv_filename;
+        Codec encoding = CODEC_NONE;
         bool start_found = false;
         
         while (std::getline(iss, line)) {
@@ -242,6 +1140,12 @@ private:
                 filesize = std::stol(line.substr(9));
             } else if (line.find("FILENAME:") != std::string::npos) {
                 recv_filename = line.substr(9);
+            } else if (line.find("OFFSET:") != std::string::npos) {
+                offset = std::stol(line.substr(7));
+            } else if (line.find("LENGTH:") != std::string::npos) {
+                length = std::stol(line.substr(7));
+            } else if (line.compare(0, 9, "ENCODING:") == 0) {
+                encoding = codecByName(line.substr(9));
             } else if (line.find("START") != std::string::npos) {
                 start_found = true;
                 break;
@@ -253,46 +1157,115 @@ private:
             return;
         }
         
+        if (length < 0) {
+            length = filesize - offset;
+        }
+        
         std::cout << "File size: " << formatFileSize(filesize) 
                   << " (" << filesize << " bytes)" << std::endl;
         std::cout << "Saving to: " << DOWNLOAD_DIR << "/" << recv_filename << std::endl;
+        if (offset > 0) {
+            std::cout << "↻ Resuming at " << formatFileSize(offset) << std::endl;
+        }
+        
+        if (binary && segments > 1 && offset == 0 && filesize >= SEGMENT_THRESHOLD) {
+            // Not acknowledging the metadata declines this single-stream transfer
+            if (trace) {
+                trace->setOutcome("segmented");
+            }
+            downloadSegmented(recv_filename, filesize);
+            return;
+        }
         
-        send(sock, "READY", 5, 0);
+        tracePhase(trace.get(), "await data");
+        sendReady();
+        
+        // A compressed download arrives as one DATA frame per block instead
+        if (binary && encoding == CODEC_NONE) {
+            FrameHeader data_header;
+            if (!readFrameHeader(data_header)) {
+                return;
+            }
+            if (data_header.type != FRAME_DATA || data_header.length != static_cast<uint64_t>(length)) {
+                std::cout << "Error: Unexpected reply from server" << std::endl;
+                connected = false;
+                return;
+            }
+        }
         
         std::string filepath = std::string(DOWNLOAD_DIR) + "/" + recv_filename;
-        std::ofstream outfile(filepath, std::ios::binary);
+        std::ofstream outfile;
         
-        if (!outfile.is_open()) {
+        tracePhase(trace.get(), "open");
+        if (!openPartial(outfile, filepath, offset)) {
             std::cout << "Error: Cannot create file for writing" << std::endl;
             return;
         }
         
         long bytes_received = 0;
-        char data_buffer[BUFFER_SIZE];
+        long wire_bytes = 0;
+        uint32_t crc = 0;
+        std::vector<char> data_buffer(RECEIVE_BUFFER);
         
         std::cout << "\n🔄 Downloading..." << std::endl;
         std::cout << "Progress: [" << std::flush;
         
         int last_progress = -1;
         
-        while (bytes_received < filesize) {
-            memset(data_buffer, 0, BUFFER_SIZE);
+        tracePhase(trace.get(), "receive");
+        while (bytes_received < length) {
+            long remaining = length - bytes_received;
             
-            long remaining = filesize - bytes_received;
-            int to_read = (remaining < BUFFER_SIZE) ? remaining : BUFFER_SIZE;
-            
-            int received = read(sock, data_buffer, to_read);
-            
-            if (received <= 0) {
-                std::cout << "\n✗ Error receiving file data" << std::endl;
-                outfile.close();
-                return;
+            if (encoding != CODEC_NONE) {
+                FrameHeader header;
+                std::string raw;
+                bool received;
+                {
+                    TraceSpan span(trace.get(), "socket read+decode");
+                    received = readFrameHeader(header) && readBlockPayload(header, raw, wire_bytes);
+                }
+                if (!received) {
+                    outfile.close();
+                    return;
+                }
+                if (raw.size() > static_cast<size_t>(remaining)) {
+                    std::cout << "\n✗ Server sent more data than announced" << std::endl;
+                    connected = false;
+                    outfile.close();
+                    return;
+                }
+                {
+                    TraceSpan span(trace.get(), "disk write");
+                    outfile.write(raw.data(), raw.size());
+                }
+                TraceSpan span(trace.get(), "checksum");
+                crc = crc32c(crc, raw.data(), raw.size());
+                bytes_received += raw.size();
+            } else {
+                size_t to_read = std::min<long>(remaining, data_buffer.size());
+                
+                ssize_t received;
+                {
+                    TraceSpan span(trace.get(), "socket read");
+                    received = read(sock, data_buffer.data(), to_read);
+                }
+                
+                if (received <= 0) {
+                    std::cout << "\n✗ Error receiving file data" << std::endl;
+                    outfile.close();
+                    return;
+                }
+                
+                {
+                    TraceSpan span(trace.get(), "disk write");
+                    outfile.write(data_buffer.data(), received);
+                }
+                TraceSpan span(trace.get(), "checksum");
+                crc = crc32c(crc, data_buffer.data(), received);
+                bytes_received += received;
             }
             
-            outfile.write(data_buffer, received);
-            bytes_received += received;
-            
-            int progress = (bytes_received * 50) / filesize;
+            int progress = ((offset + bytes_received) * 50) / filesize;
             if (progress != last_progress) {
                 for (int i = last_progress + 1; i <= progress; i++) {
                     std::cout << "=" << std::flush;
@@ -302,12 +1275,48 @@ private:
         }
         
         std::cout << "] 100%" << std::endl;
+        tracePhase(trace.get(), "flush");
         outfile.close();
         
+        if (binary) {
+            tracePhase(trace.get(), "await END");
+            FrameHeader end_header;
+            std::string payload;
+            if (!readFrame(end_header, payload) || end_header.type != FRAME_END) {
+                std::cout << "✗ Transfer did not finish cleanly" << std::endl;
+                return;
+            }
+            if (!trailerMatches(payload, crc)) {
+                // The bad bytes could be anywhere, so nothing is kept to resume from
+                unlink((filepath + PARTIAL_SUFFIX).c_str());
+                std::cout << "✗ Checksum mismatch - download discarded, please retry" << std::endl;
+                if (trace) {
+                    trace->setOutcome("checksum mismatch");
+                }
+                return;
+            }
+        }
+        
+        tracePhase(trace.get(), "rename");
+        if (!commitPartial(filepath)) {
+            std::cout << "✗ Cannot rename " << filepath << PARTIAL_SUFFIX << std::endl;
+            return;
+        }
+        if (trace) {
+            trace->arg("bytes", bytes_received);
+            trace->setOutcome("complete");
+        }
+        
         std::cout << "\n✓ Download complete!" << std::endl;
         std::cout << "  File saved: " << filepath << std::endl;
-        std::cout << "  Size: " << formatFileSize(bytes_received) 
-                  << " (" << bytes_received << " bytes)" << std::endl;
+        std::cout << "  Size: " << formatFileSize(offset + bytes_received) 
+                  << " (" << offset + bytes_received << " bytes)" << std::endl;
+        if (encoding != CODEC_NONE) {
+            std::cout << "  Compressed: " << compressionSummary(encoding, wire_bytes, bytes_received) << std::endl;
+        }
+        if (binary) {
+            std::cout << "  CRC32C: " << crc32cHex(crc) << " verified" << std::endl;
+        }
     }
 
     void listLocalFiles() {
@@ -348,12 +1357,330 @@ private:
         std::cout << "Total: " << count << " file(s)" << std::endl;
     }
 
+    // Asks how much of an interrupted upload the server kept; 0 if none
+    long committedOnServer(const std::string& filename) {
+        sendCommand("RESUME " + filename + "\n");
+        std::string response = receiveResponse();
+        size_t pos = response.find("OFFSET:");
+        if (response.compare(0, 2, "OK") != 0 || pos == std::string::npos) {
+            return 0;
+        }
+        return strtol(response.c_str() + pos + 7, nullptr, 10);
+    }
+
+    // Sends only what changed against the server's current version of the
+    // file. Returns false if there is nothing to compare against, in which
+    // case the caller uploads the whole file.
+    bool uploadDelta(const std::string& filename, const std::string& filepath, long filesize) {
+        sendCommand("SIGNATURES " + filename + "\n");
+        FrameHeader header;
+        std::string payload;
+        if (!readFrame(header, payload)) {
+            return true;
+        }
+        if (header.type != FRAME_METADATA) {
+            return false; // Not on the server yet
+        }
+        
+        long basis_size = 0;
+        size_t block_size = 0;
+        std::string basis;
+        std::istringstream metadata(payload);
+        std::string line;
+        while (std::getline(metadata, line)) {
+            if (line.compare(0, 9, "FILESIZE:") == 0) {
+                basis_size = strtol(line.c_str() + 9, nullptr, 10);
+            } else if (line.compare(0, 10, "BLOCKSIZE:") == 0) {
+                block_size = strtoul(line.c_str() + 10, nullptr, 10);
+            } else if (line.compare(0, 6, "BASIS:") == 0) {
+                basis = line.substr(6);
+            }
+        }
+        
+        std::cout << "🔍 Comparing with the server's copy (" << formatFileSize(basis_size) << ")..." << std::endl;
+        std::string signatures;
+        while (true) {
+            if (!readFrame(header, payload)) {
+                return true;
+            }
+            if (header.type == FRAME_DATA) {
+                size_t have = signatures.size();
+                signatures.resize(have + header.length);
+                if (!recvAll(&signatures[have], header.length)) {
+                    return true;
+                }
+                continue;
+            }
+            if (header.type != FRAME_END || payload.compare(0, 2, "OK") != 0 || block_size == 0) {
+                return false;
+            }
+            break;
+        }
+        
+        int fd = open(filepath.c_str(), O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        DeltaEncoder encoder(block_size, basis_size, signatures);
+        signatures.clear();
+        signatures.shrink_to_fit();
+        
+        // Like a pipelined UPLOAD: the delta follows the command at once
+        std::string command = "PATCH " + filename + " " + std::to_string(filesize) + " " + basis;
+        if (!sendFrame(FRAME_COMMAND, command, ++next_request_id, FLAG_PIPELINED | FLAG_CHECKSUM)) {
+            close(fd);
+            return true;
+        }
+        uint32_t request_id = next_request_id;
+        
+        std::cout << "\n🔄 Uploading changes..." << std::endl;
+        std::cout << "Progress: [" << std::flush;
+        int last_progress = -1;
+        
+        bool sent = encoder.encode(fd, [&](const std::string& ops, uint64_t scanned) {
+            if (!ops.empty() && (!sendFrameHeader(FRAME_DATA, request_id, ops.size()) ||
+                                 !sendAll(ops.data(), ops.size()))) {
+                return false;
+            }
+            int progress = (scanned * 50) / filesize;
+            for (int i = last_progress + 1; i <= progress; i++) {
+                std::cout << "=" << std::flush;
+            }
+            last_progress = std::max(last_progress, progress);
+            return true;
+        });
+        close(fd);
+        
+        if (!sent || !sendFrame(FRAME_END, checksumTrailer(encoder.checksum()), request_id)) {
+            std::cout << "\n✗ Error sending file data" << std::endl;
+            return true;
+        }
+        std::cout << "] 100%" << std::endl;
+        
+        std::string response = receiveResponse();
+        if (response.find("OK") != std::string::npos) {
+            std::cout << "\n✓ Upload complete!" << std::endl;
+            std::cout << "  File: " << filename << std::endl;
+            std::cout << "  Size: " << formatFileSize(filesize) << " (" << filesize << " bytes)" << std::endl;
+            std::cout << "  Sent: " << formatFileSize(encoder.literalBytes()) << " changed, "
+                      << formatFileSize(encoder.copiedBytes()) << " reused from the server's copy" << std::endl;
+        } else {
+            std::cout << "\n✗ Upload failed" << std::endl;
+            std::cout << response << std::endl;
+        }
+        return true;
+    }
+
+    // Compresses an upload only if the server agreed to a codec and the
+    // data at offset looks like it will shrink
+    Codec uploadEncoding(std::ifstream& file, long offset, long filesize) {
+        if (codec == CODEC_NONE || offset >= filesize) {
+            return CODEC_NONE;
+        }
+        std::vector<char> sample(std::min<long>(filesize - offset, COMPRESS_PROBE));
+        file.seekg(offset, std::ios::beg);
+        file.read(sample.data(), sample.size());
+        std::streamsize n = file.gcount();
+        file.clear();
+        file.seekg(0, std::ios::beg);
+        return (n > 0 && looksCompressible(sample.data(), n)) ? codec : CODEC_NONE;
+    }
+
+    // Local files an MPUT covers: the matches of a glob in UPLOAD_DIR, or every
+    // regular file in a directory under it ("." for UPLOAD_DIR itself)
+    std::vector<std::string> batchFiles(const std::string& target, std::string& dirpath) {
+        std::string pattern = "*";
+        dirpath = std::string(UPLOAD_DIR) + "/" + target;
+        struct stat st;
+        if (stat(dirpath.c_str(), &st) != 0 || !S_ISDIR(st.st_mode)) {
+            dirpath = UPLOAD_DIR;
+            pattern = target;
+        }
+
+        std::vector<std::string> names;
+        DIR* dir = opendir(dirpath.c_str());
+        if (!dir) {
+            return names;
+        }
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            std::string name = entry->d_name;
+            if (archiveNameSafe(name) && fnmatch(pattern.c_str(), name.c_str(), 0) == 0 &&
+                stat((dirpath + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+                names.push_back(name);
+            }
+        }
+        closedir(dir);
+        std::sort(names.begin(), names.end());
+        return names;
+    }
+
+    // Uploads many files as one archive stream (see archive.h). A reader
+    // thread packs the next blocks from disk while the current one is on the
+    // wire, so small files cost neither a round trip nor a disk stall each.
+    void uploadBatch(const std::string& target) {
+        if (!binary) {
+            std::cout << "Error: Batch upload needs the binary protocol" << std::endl;
+            return;
+        }
+        std::string dirpath;
+        std::vector<std::string> names = batchFiles(target, dirpath);
+        if (names.empty()) {
+            std::cout << "Error: No files match " << target << " in " << UPLOAD_DIR << std::endl;
+            return;
+        }
+        long total = 0;
+        for (const auto& name : names) {
+            total += getFileSize(dirpath + "/" + name);
+        }
+        std::cout << "\n📦 Uploading " << names.size() << " file(s), " << formatFileSize(total)
+                  << " as one stream" << std::endl;
+
+        uint32_t request_id = ++next_request_id;
+        if (!sendFrame(FRAME_COMMAND, "MPUT " + std::to_string(names.size()), request_id, FLAG_PIPELINED)) {
+            return;
+        }
+
+        std::mutex lock;
+        std::condition_variable changed;
+        std::deque<std::string> blocks;
+        bool packed = false, abandoned = false;
+        std::vector<std::string> skipped;
+
+        std::thread packer([&]() {
+            std::string block;
+            // Hands the block to the sender, waiting while the read-ahead is full
+            auto ship = [&]() {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return blocks.size() < ARCHIVE_READ_AHEAD || abandoned; });
+                if (abandoned) {
+                    return false;
+                }
+                blocks.push_back(std::move(block));
+                block.clear();
+                changed.notify_all();
+                return true;
+            };
+
+            bool running = true;
+            for (size_t i = 0; running && i < names.size(); i++) {
+                int fd = open((dirpath + "/" + names[i]).c_str(), O_RDONLY);
+                struct stat st;
+                if (fd < 0 || fstat(fd, &st) != 0) {
+                    if (fd >= 0) {
+                        close(fd);
+                    }
+                    std::lock_guard<std::mutex> guard(lock);
+                    skipped.push_back(names[i]);
+                    continue;
+                }
+
+                appendArchiveHeader(block, names[i], st.st_size);
+                uint32_t crc = 0;
+                bool shrank = false;
+                for (long left = st.st_size; running && left > 0;) {
+                    if (block.size() >= ARCHIVE_BLOCK) {
+                        running = ship();
+                        continue;
+                    }
+                    size_t take = std::min<long>(left, ARCHIVE_BLOCK - block.size());
+                    size_t start = block.size();
+                    block.resize(start + take);
+                    ssize_t n = shrank ? 0 : read(fd, &block[start], take);
+                    if (n <= 0) {
+                        // The file shrank while being sent: pad it out, and
+                        // spoil its checksum below so the server drops it
+                        shrank = true;
+                        n = take;
+                    }
+                    block.resize(start + n);
+                    crc = crc32c(crc, block.data() + start, n);
+                    left -= n;
+                }
+                close(fd);
+                block += checksumTrailer(shrank ? ~crc : crc);
+                if (running && block.size() >= ARCHIVE_BLOCK) {
+                    running = ship();
+                }
+            }
+            if (running && !block.empty()) {
+                ship();
+            }
+            std::lock_guard<std::mutex> guard(lock);
+            packed = true;
+            changed.notify_all();
+        });
+
+        long sent = 0;
+        bool failed = false;
+        while (true) {
+            std::string block;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                changed.wait(guard, [&]() { return !blocks.empty() || packed; });
+                if (blocks.empty()) {
+                    break;
+                }
+                block = std::move(blocks.front());
+                blocks.pop_front();
+                changed.notify_all();
+            }
+            if (!sendFrameHeader(FRAME_DATA, request_id, block.size()) || !sendAll(block.data(), block.size())) {
+                failed = true;
+                break;
+            }
+            sent += block.size();
+            std::cout << "\r  " << formatFileSize(sent) << " sent" << std::flush;
+        }
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            abandoned = true;
+            changed.notify_all();
+        }
+        packer.join();
+        if (failed || !sendFrame(FRAME_END, "", request_id)) {
+            std::cout << "\n✗ Error sending files" << std::endl;
+            return;
+        }
+
+        std::string response = receiveResponse();
+        if (response.find("COMMITTED:") == std::string::npos) {
+            std::cout << "\n✗ Upload failed" << std::endl;
+            std::cout << response << std::endl;
+            return;
+        }
+        std::istringstream iss(response);
+        std::string line;
+        long committed = 0, rejected = 0, bytes = 0;
+        while (std::getline(iss, line)) {
+            size_t tab = line.find('\t');
+            if (line.compare(0, 10, "COMMITTED:") == 0) {
+                committed = std::stol(line.substr(10));
+            } else if (line.compare(0, 7, "FAILED:") == 0) {
+                rejected = std::stol(line.substr(7));
+            } else if (tab != std::string::npos && line.compare(tab + 1, 3, "OK ") == 0) {
+                bytes += strtol(line.c_str() + tab + 4, nullptr, 10);
+            } else if (tab != std::string::npos) {
+                std::cout << "\n  ✗ " << std::left << std::setw(30) << line.substr(0, tab) << line.substr(tab + 1);
+            }
+        }
+        for (const auto& name : skipped) {
+            std::cout << "\n  ✗ " << std::left << std::setw(30) << name << "Cannot read file";
+        }
+
+        std::cout << "\n✓ Uploaded " << committed << " file(s), " << formatFileSize(bytes) << " total";
+        if (rejected + static_cast<long>(skipped.size()) > 0) {
+            std::cout << " (" << rejected + skipped.size() << " failed)";
+        }
+        std::cout << std::endl;
+    }
+
     void handleUploadCommand() {
         system(("mkdir -p " + std::string(UPLOAD_DIR)).c_str());
         
         listLocalFiles();
         
-        std::cout << "\nEnter filename to upload (from " << UPLOAD_DIR << "): ";
+        std::cout << "\nEnter filename, pattern or directory to upload (from " << UPLOAD_DIR << "): ";
         std::string filename;
         std::getline(std::cin, filename);
         
@@ -363,6 +1690,12 @@ private:
         }
         
         std::string filepath = std::string(UPLOAD_DIR) + "/" + filename;
+        struct stat st;
+        if (filename.find_first_of("*?[") != std::string::npos ||
+            (stat(filepath.c_str(), &st) == 0 && S_ISDIR(st.st_mode))) {
+            uploadBatch(filename);
+            return;
+        }
         
         std::ifstream file(filepath, std::ios::binary);
         if (!file.is_open()) {
@@ -378,14 +1711,50 @@ private:
         std::cout << "\n📤 Uploading: " << filename 
                   << " (" << formatFileSize(filesize) << ")" << std::endl;
         
-        std::string command = "UPLOAD " + filename + "\n";
-        sendCommand(command);
+        std::unique_ptr<RequestTrace> trace = tracer.start("UPLOAD", filename);
+        tracePhase(trace.get(), "resume check");
+        long offset = committedOnServer(filename);
+        if (offset > filesize) {
+            offset = 0; // Local file shrank; start over
+        }
+        if (offset > 0) {
+            std::cout << "↻ Resuming: " << formatFileSize(offset) << " already on server" << std::endl;
+        } else if (binary && filesize >= DELTA_THRESHOLD) {
+            tracePhase(trace.get(), "delta");
+            if (uploadDelta(filename, filepath, filesize)) {
+                if (trace) {
+                    trace->setOutcome("delta");
+                }
+                file.close();
+                return;
+            }
+        }
         
-        char buffer[BUFFER_SIZE] = {0};
-        int bytes_read = read(sock, buffer, BUFFER_SIZE);
+        std::string response;
+        tracePhase(trace.get(), "encoding probe");
+        Codec encoding = uploadEncoding(file, offset, filesize);
+        tracePhase(trace.get(), "send command");
+        if (binary) {
+            // Command, size and payload go out back to back; no READY round trips
+            std::string command = "UPLOAD " + filename + " " + std::to_string(filesize) +
+                                  " " + std::to_string(offset);
+            if (encoding != CODEC_NONE) {
+                command += std::string(" ") + codecName(encoding);
+            }
+            if (!sendFrame(FRAME_COMMAND, command, ++next_request_id, FLAG_PIPELINED | FLAG_CHECKSUM) ||
+                (filesize > offset && encoding == CODEC_NONE &&
+                 !sendFrameHeader(FRAME_DATA, next_request_id, filesize - offset))) {
+                file.close();
+                return;
+            }
+        } else {
+            std::string command = "UPLOAD " + filename + "\n";
+            sendCommand(command);
+            tracePhase(trace.get(), "await READY");
+            response = receiveResponse();
+        }
         
-        if (bytes_read <= 0 || strncmp(buffer, "READY", 5) != 0) {
-            std::string response(buffer);
+        if (!binary && response.compare(0, 5, "READY") != 0) {
             if (response.find("ERROR") != std::string::npos) {
                 std::cout << response << std::endl;
             } else {
@@ -395,40 +1764,81 @@ private:
             return;
         }
         
-        std::ostringstream metadata;
-        metadata << "FILESIZE:" << filesize << "\n";
-        metadata << "FILENAME:" << filename << "\n";
-        metadata << "START\n";
-        sendCommand(metadata.str());
-        
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_read = read(sock, buffer, BUFFER_SIZE);
-        
-        if (bytes_read <= 0 || strncmp(buffer, "READY", 5) != 0) {
-            std::cout << "Error: Server not ready to receive file" << std::endl;
-            file.close();
-            return;
+        if (!binary) {
+            tracePhase(trace.get(), "metadata");
+            std::ostringstream metadata;
+            metadata << "FILESIZE:" << filesize << "\n";
+            metadata << "FILENAME:" << filename << "\n";
+            if (offset > 0) {
+                metadata << "OFFSET:" << offset << "\n";
+            }
+            metadata << "START\n";
+            sendCommand(metadata.str());
+            
+            response = receiveResponse();
+            
+            if (response.compare(0, 2, "OK") == 0) {
+                std::cout << "\n✓ Upload complete!" << std::endl;
+                if (trace) {
+                    trace->setOutcome("complete");
+                }
+                file.close();
+                return; // Server already had every byte
+            }
+            if (response.compare(0, 5, "READY") != 0) {
+                std::cout << "Error: Server not ready to receive file" << std::endl;
+                file.close();
+                return;
+            }
         }
         
-        char data_buffer[BUFFER_SIZE];
-        long bytes_sent = 0;
+        // Compressed uploads go out one block per DATA frame
+        std::vector<char> data_buffer(encoding != CODEC_NONE ? COMPRESS_BLOCK : BUFFER_SIZE);
+        uint32_t request_id = next_request_id;
+        long bytes_sent = offset;
+        long wire_bytes = 0;
+        uint32_t crc = 0;
+        file.seekg(offset, std::ios::beg);
         
         std::cout << "\n🔄 Uploading..." << std::endl;
         std::cout << "Progress: [" << std::flush;
         
         int last_progress = -1;
         
+        tracePhase(trace.get(), "send");
         while (!file.eof() && bytes_sent < filesize) {
-            file.read(data_buffer, BUFFER_SIZE);
-            std::streamsize bytes_read_chunk = file.gcount();
+            std::streamsize bytes_read_chunk;
+            {
+                TraceSpan span(trace.get(), "disk read");
+                file.read(data_buffer.data(), data_buffer.size());
+                bytes_read_chunk = file.gcount();
+            }
             
             if (bytes_read_chunk > 0) {
-                ssize_t sent = send(sock, data_buffer, bytes_read_chunk, 0);
+                ssize_t sent;
+                if (encoding != CODEC_NONE) {
+                    std::string block;
+                    {
+                        TraceSpan span(trace.get(), "compress");
+                        encodeBlock(encoding, data_buffer.data(), bytes_read_chunk, block);
+                    }
+                    TraceSpan span(trace.get(), "socket send");
+                    sent = (sendFrameHeader(FRAME_DATA, request_id, block.size()) &&
+                            sendAll(block.data(), block.size())) ? bytes_read_chunk : -1;
+                    wire_bytes += FRAME_HEADER_SIZE + block.size();
+                } else {
+                    TraceSpan span(trace.get(), "socket send");
+                    sent = sendAll(data_buffer.data(), bytes_read_chunk) ? bytes_read_chunk : -1;
+                }
                 if (sent < 0) {
                     std::cout << "\n✗ Error sending file data" << std::endl;
                     file.close();
                     return;
                 }
+                {
+                    TraceSpan span(trace.get(), "checksum");
+                    crc = crc32c(crc, data_buffer.data(), sent);
+                }
                 bytes_sent += sent;
                 
                 int progress = (bytes_sent * 50) / filesize;
@@ -444,16 +1854,29 @@ private:
         std::cout << "] 100%" << std::endl;
         file.close();
         
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_read = read(sock, buffer, BUFFER_SIZE);
-        
-        std::string response(buffer);
+        // The server verifies and commits the file meanwhile
+        tracePhase(trace.get(), "await result");
+        if (binary && !sendFrame(FRAME_END, checksumTrailer(crc), request_id)) {
+            return;
+        }
+        response = receiveResponse();
+        if (trace) {
+            trace->arg("bytes", bytes_sent - offset);
+            trace->setOutcome(response.find("OK") != std::string::npos ? "complete" : "failed");
+        }
         
         if (response.find("OK") != std::string::npos) {
             std::cout << "\n✓ Upload complete!" << std::endl;
             std::cout << "  File: " << filename << std::endl;
             std::cout << "  Size: " << formatFileSize(bytes_sent) 
                       << " (" << bytes_sent << " bytes)" << std::endl;
+            if (encoding != CODEC_NONE) {
+                std::cout << "  Compressed: " << compressionSummary(encoding, wire_bytes, bytes_sent - offset)
+                          << std::endl;
+            }
+            if (binary) {
+                std::cout << "  CRC32C: " << crc32cHex(crc) << " verified by server" << std::endl;
+            }
         } else {
             std::cout << "\n✗ Upload failed" << std::endl;
             std::cout << response << std::endl;
@@ -493,10 +1916,22 @@ private:
     }
 
 public:
-    FileClient() : sock(0), connected(false), authenticated(false), username("") {
+    FileClient(int segment_count = DEFAULT_SEGMENTS, Codec compression = CODEC_LZ4)
+        : sock(0), connected(false), authenticated(false), username(""),
+          binary(false), next_request_id(0), segments(segment_count),
+          wanted_codec(compression), codec(CODEC_NONE) {
         serv_addr = {};
     }
 
+    // Traces one single-file download or upload in every sample_every
+    void enableTracing(unsigned sample_every) {
+        if (tracer.open(TRACE_FILE, sample_every, "client")) {
+            std::cout << "✓ Tracing 1 in " << sample_every << " transfers to " << TRACE_FILE << std::endl;
+        } else {
+            std::cout << "✗ Cannot open " << TRACE_FILE << " (" << strerror(errno) << "), tracing off" << std::endl;
+        }
+    }
+
     bool connectToServer(const char* server_ip = "127.0.0.1") {
         if ((sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
             std::cerr << "✗ Socket creation error" << std::endl;
@@ -511,23 +1946,43 @@ public:
             return false;
         }
 
-        if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
-            std::cerr << "✗ Connection failed" << std::endl;
-            std::cerr << "  Make sure the server is running on " << server_ip 
-                      << ":" << PORT << std::endl;
-            return false;
+        for (int attempt = 1; ; attempt++) {
+            if (connect(sock, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0) {
+                std::cerr << "✗ Connection failed" << std::endl;
+                std::cerr << "  Make sure the server is running on " << server_ip 
+                          << ":" << PORT << std::endl;
+                return false;
+            }
+
+            connected = true;
+            welcome = receiveResponse();
+            long retry_ms = busyRetryMs(welcome);
+            if (retry_ms < 0) {
+                break;
+            }
+
+            // The server is at capacity and says when to come back
+            size_t message = welcome.find(' ', sizeof(BUSY_REPLY));
+            std::cout << "⏳ " << (message == std::string::npos ? welcome : welcome.substr(message + 1));
+            close(sock);
+            connected = false;
+            if (attempt == CONNECT_ATTEMPTS || (sock = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+                std::cerr << "✗ Server still busy after " << attempt << " attempts" << std::endl;
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(retry_ms));
         }
 
-        connected = true;
         std::cout << "✓ Connected to server at " << server_ip 
                   << ":" << PORT << std::endl;
-        return true;
+        return connected;
     }
 
     void run() {
-        std::string welcome = receiveResponse();
         if (!welcome.empty()) {
             std::cout << "\n" << welcome;
+            negotiateProtocol();
+            negotiateCompression();
         }
 
         while (connected) {
@@ -596,12 +2051,36 @@ int main(int argc, char const *argv[]) {
     std::cout << "╚════════════════════════════════════════╝" << std::endl;
     
     const char* server_ip = "127.0.0.1";
+    int segments = DEFAULT_SEGMENTS;
+    Codec compression = CODEC_LZ4;
+    unsigned trace_sample = 0;
     
-    if (argc > 1) {
-        server_ip = argv[1];
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--segments" && i + 1 < argc) {
+            segments = atoi(argv[++i]);
+            if (segments < 1 || segments > MAX_SEGMENTS) {
+                std::cerr << "✗ --segments must be between 1 and " << MAX_SEGMENTS << std::endl;
+                return 1;
+            }
+        } else if (arg == "--compress" && i + 1 < argc) {
+            std::string name = argv[++i];
+            compression = codecByName(name);
+            if (compression == CODEC_NONE && name != "off") {
+                std::cerr << "✗ --compress must be lz4, zstd (if built with it) or off" << std::endl;
+                return 1;
+            }
+        } else if (arg == "--trace-sample" && i + 1 < argc) {
+            trace_sample = std::stoul(argv[++i]);
+        } else {
+            server_ip = argv[i];
+        }
     }
 
-    FileClient client;
+    FileClient client(segments, compression);
+    if (trace_sample > 0) {
+        client.enableTracing(trace_sample);
+    }
     
     if (client.connectToServer(server_ip)) {
         client.run();
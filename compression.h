@@ -0,0 +1,324 @@
+// compression.h - Per-block transfer compression (built-in LZ4, optional zstd)
+//
+// A compressed transfer sends each DATA frame as one self-contained block:
+//
+//   +-------+----------------+------------------------
+//   | codec | raw length u32 | codec-specific payload
+//   +-------+----------------+------------------------
+//
+// A block that would not shrink is sent with codec CODEC_NONE, so the
+// worst case costs five bytes per block. LZ4 is implemented here; zstd is
+// available when the build has libzstd (make WITH_ZSTD=1).
+#ifndef COMPRESSION_H
+#define COMPRESSION_H
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+
+#define COMPRESS_BLOCK (256 * 1024)         // Raw bytes per compressed DATA frame
+#define COMPRESS_BLOCK_HEADER 5
+#define COMPRESS_FRAME_MAX (COMPRESS_BLOCK_HEADER + COMPRESS_BLOCK)   // Stored is the worst case
+#define COMPRESS_PROBE (64 * 1024)          // Sample the entropy probe looks at
+#define COMPRESS_MAX_ENTROPY 7.5            // Bits per byte; above this, data is already packed
+#define COMPRESS_MIN_SAVING 0.10            // The probe wants at least 10% off the sample
+#define ZSTD_LEVEL 3
+
+enum Codec : uint8_t {
+    CODEC_NONE = 0,
+    CODEC_LZ4 = 1,
+    CODEC_ZSTD = 2
+};
+
+inline const char* codecName(Codec codec) {
+    switch (codec) {
+        case CODEC_LZ4: return "lz4";
+        case CODEC_ZSTD: return "zstd";
+        default: return "none";
+    }
+}
+
+// Parses a codec this build can use; CODEC_NONE for anything else
+inline Codec codecByName(const std::string& name) {
+    if (name == "lz4") {
+        return CODEC_LZ4;
+    }
+#ifdef WITH_ZSTD
+    if (name == "zstd") {
+        return CODEC_ZSTD;
+    }
+#endif
+    return CODEC_NONE;
+}
+
+// LZ4 block format: sequences of (token, literals, 16-bit offset, match).
+// Greedy single-probe hash matcher: not the best ratio, but it runs at
+// memory speed and skips ahead quickly through data that doesn't match.
+class Lz4 {
+private:
+    static const int HASH_LOG = 14;
+    static const size_t MIN_MATCH = 4;
+    static const size_t LAST_LITERALS = 5;  // The format requires these at the end
+    static const size_t MF_LIMIT = 12;      // No match may start this close to the end
+
+    static uint32_t read32(const unsigned char* p) {
+        uint32_t value;
+        memcpy(&value, p, sizeof(value));
+        return value;
+    }
+
+    static uint32_t hash(uint32_t sequence) {
+        return (sequence * 2654435761U) >> (32 - HASH_LOG);
+    }
+
+    static void putLength(unsigned char*& op, size_t length) {
+        for (; length >= 255; length -= 255) {
+            *op++ = 255;
+        }
+        *op++ = static_cast<unsigned char>(length);
+    }
+
+    static unsigned char* putSequence(unsigned char* op, const unsigned char* literals, size_t literal_length,
+                                      size_t offset, size_t match_length) {
+        unsigned char* token = op++;
+        *token = static_cast<unsigned char>((literal_length >= 15 ? 15 : literal_length) << 4);
+        if (literal_length >= 15) {
+            putLength(op, literal_length - 15);
+        }
+        memcpy(op, literals, literal_length);
+        op += literal_length;
+        if (match_length == 0) {
+            return op; // Final literal-only sequence
+        }
+        *op++ = offset & 0xFF;
+        *op++ = offset >> 8;
+        size_t extra = match_length - MIN_MATCH;
+        *token |= (extra >= 15) ? 15 : extra;
+        if (extra >= 15) {
+            putLength(op, extra - 15);
+        }
+        return op;
+    }
+
+public:
+    static size_t bound(size_t length) {
+        return length + length / 255 + 16;
+    }
+
+    // Compresses into dst, which must hold bound(length); returns the size written
+    static size_t compress(const unsigned char* src, size_t length, unsigned char* dst) {
+        unsigned char* op = dst;
+        size_t anchor = 0;
+
+        if (length > MF_LIMIT) {
+            // Reused per thread and never cleared: a stale entry fails the
+            // bounds or byte checks below, so it costs a probe, never a bad match
+            static thread_local std::vector<uint32_t> table(1 << HASH_LOG, 0);
+            size_t limit = length - MF_LIMIT;
+            size_t ip = 1;
+            table[hash(read32(src))] = 0;
+
+            while (ip < limit) {
+                uint32_t sequence = read32(src + ip);
+                uint32_t& slot = table[hash(sequence)];
+                size_t candidate = slot;
+                slot = ip;
+
+                if (candidate >= ip || ip - candidate > 65535 || read32(src + candidate) != sequence) {
+                    ip += 1 + ((ip - anchor) >> 6); // Step up through literal-only stretches
+                    continue;
+                }
+
+                size_t match_length = MIN_MATCH;
+                while (ip + match_length < length - LAST_LITERALS &&
+                       src[candidate + match_length] == src[ip + match_length]) {
+                    match_length++;
+                }
+                op = putSequence(op, src + anchor, ip - anchor, ip - candidate, match_length);
+                ip += match_length;
+                anchor = ip;
+                if (ip < limit) {
+                    table[hash(read32(src + ip - 2))] = ip - 2;
+                }
+            }
+        }
+        return putSequence(op, src + anchor, length - anchor, 0, 0) - dst;
+    }
+
+    // Decodes exactly raw_length bytes into dst; false on any malformed input
+    static bool decompress(const unsigned char* src, size_t length, unsigned char* dst, size_t raw_length) {
+        const unsigned char* ip = src;
+        const unsigned char* end = src + length;
+        size_t op = 0;
+
+        while (ip < end) {
+            unsigned char token = *ip++;
+            size_t literal_length = token >> 4;
+            if (literal_length == 15) {
+                unsigned char more;
+                do {
+                    if (ip >= end) {
+                        return false;
+                    }
+                    more = *ip++;
+                    literal_length += more;
+                } while (more == 255);
+            }
+            if (literal_length > static_cast<size_t>(end - ip) || literal_length > raw_length - op) {
+                return false;
+            }
+            memcpy(dst + op, ip, literal_length);
+            ip += literal_length;
+            op += literal_length;
+            if (ip == end) {
+                break; // The last sequence has no match
+            }
+
+            if (end - ip < 2) {
+                return false;
+            }
+            size_t offset = ip[0] | (ip[1] << 8);
+            ip += 2;
+            if (offset == 0 || offset > op) {
+                return false;
+            }
+            size_t match_length = token & 15;
+            if (match_length == 15) {
+                unsigned char more;
+                do {
+                    if (ip >= end) {
+                        return false;
+                    }
+                    more = *ip++;
+                    match_length += more;
+                } while (more == 255);
+            }
+            match_length += MIN_MATCH;
+            if (match_length > raw_length - op) {
+                return false;
+            }
+            if (offset >= match_length) {
+                memcpy(dst + op, dst + op - offset, match_length);
+                op += match_length;
+                continue;
+            }
+            // Byte by byte: the match overlaps the bytes it produces
+            for (size_t i = 0; i < match_length; i++, op++) {
+                dst[op] = dst[op - offset];
+            }
+        }
+        return op == raw_length;
+    }
+};
+
+// Appends one framed block holding data, compressed with codec if that helps
+inline void encodeBlock(Codec codec, const char* data, size_t length, std::string& out) {
+    size_t header_at = out.size();
+    out.resize(header_at + COMPRESS_BLOCK_HEADER);
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(data);
+    size_t packed = 0;
+
+    if (codec == CODEC_LZ4) {
+        out.resize(header_at + COMPRESS_BLOCK_HEADER + Lz4::bound(length));
+        packed = Lz4::compress(src, length, reinterpret_cast<unsigned char*>(&out[header_at + COMPRESS_BLOCK_HEADER]));
+    }
+#ifdef WITH_ZSTD
+    if (codec == CODEC_ZSTD) {
+        out.resize(header_at + COMPRESS_BLOCK_HEADER + ZSTD_compressBound(length));
+        size_t result = ZSTD_compress(&out[header_at + COMPRESS_BLOCK_HEADER], ZSTD_compressBound(length),
+                                      data, length, ZSTD_LEVEL);
+        packed = ZSTD_isError(result) ? 0 : result;
+    }
+#endif
+
+    if (packed == 0 || packed >= length) {
+        codec = CODEC_NONE; // Stored as is
+        out.resize(header_at + COMPRESS_BLOCK_HEADER);
+        out.append(data, length);
+    } else {
+        out.resize(header_at + COMPRESS_BLOCK_HEADER + packed);
+    }
+    out[header_at] = static_cast<char>(codec);
+    for (int i = 0; i < 4; i++) {
+        out[header_at + 1 + i] = static_cast<char>((length >> (24 - 8 * i)) & 0xFF);
+    }
+}
+
+// Decodes one framed block into out, which must hold COMPRESS_BLOCK bytes;
+// raw_length is set to the number of bytes produced
+inline bool decodeBlock(const char* data, size_t length, char* out, size_t& raw_length) {
+    if (length < COMPRESS_BLOCK_HEADER) {
+        return false;
+    }
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    raw_length = (size_t(p[1]) << 24) | (size_t(p[2]) << 16) | (size_t(p[3]) << 8) | p[4];
+    const char* body = data + COMPRESS_BLOCK_HEADER;
+    size_t body_length = length - COMPRESS_BLOCK_HEADER;
+    if (raw_length > COMPRESS_BLOCK) {
+        return false;
+    }
+
+    switch (p[0]) {
+        case CODEC_NONE:
+            if (body_length != raw_length) {
+                return false;
+            }
+            memcpy(out, body, body_length);
+            return true;
+        case CODEC_LZ4:
+            return Lz4::decompress(reinterpret_cast<const unsigned char*>(body), body_length,
+                                   reinterpret_cast<unsigned char*>(out), raw_length);
+#ifdef WITH_ZSTD
+        case CODEC_ZSTD: {
+            size_t result = ZSTD_decompress(out, raw_length, body, body_length);
+            return !ZSTD_isError(result) && result == raw_length;
+        }
+#endif
+        default:
+            return false;
+    }
+}
+
+// Same, appending the raw bytes to out
+inline bool decodeBlock(const char* data, size_t length, std::string& out) {
+    size_t at = out.size();
+    size_t raw_length = 0;
+    out.resize(at + COMPRESS_BLOCK);
+    bool decoded = decodeBlock(data, length, &out[at], raw_length);
+    out.resize(decoded ? at + raw_length : at);
+    return decoded;
+}
+
+// Decides up front whether a transfer is worth compressing, from a sample
+// of its first bytes. Byte entropy rules out media, archives and encrypted
+// data almost for free; a trial LZ4 pass settles the rest.
+inline bool looksCompressible(const char* data, size_t length) {
+    if (length < 1024) {
+        return false; // Too small for the saving to matter
+    }
+    size_t counts[256] = {0};
+    for (size_t i = 0; i < length; i++) {
+        counts[static_cast<unsigned char>(data[i])]++;
+    }
+    double entropy = 0;
+    for (size_t count : counts) {
+        if (count > 0) {
+            double p = static_cast<double>(count) / length;
+            entropy -= p * std::log2(p);
+        }
+    }
+    if (entropy > COMPRESS_MAX_ENTROPY) {
+        return false;
+    }
+
+    std::vector<unsigned char> trial(Lz4::bound(length));
+    size_t packed = Lz4::compress(reinterpret_cast<const unsigned char*>(data), length, trial.data());
+    return packed < length * (1.0 - COMPRESS_MIN_SAVING);
+}
+
+#endif
@@ -0,0 +1,356 @@
+// delta.h - rsync-style block signatures and delta encoding for uploads
+//
+// The server describes its current version of a file (the basis) as one
+// signature per fixed-size block: a weak rolling checksum and a truncated
+// SHA-256. The client slides a window over its new version one byte at a
+// time; wherever the weak checksum and then the strong hash match a block,
+// it sends a reference to that block instead of the bytes. The delta is a
+// stream of two operations, all integers big-endian:
+//
+//   'L' <u32 length> <length bytes>     literal data
+//   'C' <u64 block> <u32 count>         count consecutive basis blocks
+//
+// The last basis block may be short; copies of it stop at the basis end.
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <unistd.h>
+#include "sha256.h"
+#include "checksum.h"
+
+#define DELTA_MIN_BLOCK 2048
+#define DELTA_MAX_BLOCK (128 * 1024)
+#define DELTA_STRONG_SIZE 16
+#define DELTA_SIGNATURE_SIZE (4 + DELTA_STRONG_SIZE)
+#define DELTA_OP_LITERAL 'L'
+#define DELTA_OP_COPY 'C'
+#define DELTA_LITERAL_RUN (64 * 1024)   // Longest literal op the encoder emits
+#define DELTA_BATCH (256 * 1024)        // Encoder output handed to the sink at once
+
+// Block size for a basis: about sqrt(size), so signatures and the
+// per-block overhead both stay small (10 GB -> ~100 KB blocks)
+inline size_t deltaBlockSize(uint64_t basis_size) {
+    size_t block = static_cast<size_t>(std::sqrt(static_cast<double>(basis_size)));
+    block = (block + 1023) & ~static_cast<size_t>(1023);
+    if (block < DELTA_MIN_BLOCK) {
+        return DELTA_MIN_BLOCK;
+    }
+    return (block > DELTA_MAX_BLOCK) ? DELTA_MAX_BLOCK : block;
+}
+
+inline void deltaStrongHash(const unsigned char* data, size_t length, unsigned char out[DELTA_STRONG_SIZE]) {
+    unsigned char digest[SHA256_DIGEST_SIZE];
+    Sha256::hash(data, length, digest);
+    memcpy(out, digest, DELTA_STRONG_SIZE);
+}
+
+inline void putBigEndian(std::string& out, uint64_t value, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) {
+        out += static_cast<char>((value >> (8 * i)) & 0xFF);
+    }
+}
+
+inline uint64_t getBigEndian(const unsigned char* in, int bytes) {
+    uint64_t value = 0;
+    for (int i = 0; i < bytes; i++) {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// The rsync checksum: a is the byte sum, b the sum of the running a values,
+// 16 bits each. Moving the window by one byte is O(1).
+class RollingChecksum {
+private:
+    uint32_t a;
+    uint32_t b;
+    size_t length;
+
+public:
+    RollingChecksum() : a(0), b(0), length(0) {}
+
+    void reset(const unsigned char* data, size_t n) {
+        a = b = 0;
+        length = n;
+        for (size_t i = 0; i < n; i++) {
+            a += data[i];
+            b += a;
+        }
+    }
+
+    void roll(unsigned char out, unsigned char in) {
+        a += in - out;
+        b += a - length * out;
+    }
+
+    uint32_t value() const {
+        return ((b & 0xFFFF) << 16) | (a & 0xFFFF);
+    }
+};
+
+// Appends the signature record of one basis block
+inline void appendSignature(std::string& out, const unsigned char* block, size_t length) {
+    RollingChecksum weak;
+    weak.reset(block, length);
+    unsigned char strong[DELTA_STRONG_SIZE];
+    deltaStrongHash(block, length, strong);
+    putBigEndian(out, weak.value(), 4);
+    out.append(reinterpret_cast<const char*>(strong), DELTA_STRONG_SIZE);
+}
+
+// Incremental parser for the receiving side. Op headers may be split across
+// reads; literal bytes are handed on as they arrive, never buffered whole.
+class DeltaDecoder {
+private:
+    unsigned char op[13];
+    size_t op_have;
+    uint32_t literal_left;
+
+    static size_t opSize(unsigned char code) {
+        return (code == DELTA_OP_LITERAL) ? 5 : 13;
+    }
+
+public:
+    DeltaDecoder() : op_have(0), literal_left(0) {}
+
+    // Consumes all of data; false on a malformed op or a failed callback
+    bool feed(const char* data, size_t length,
+              const std::function<bool(const char*, size_t)>& literal,
+              const std::function<bool(uint64_t, uint32_t)>& copy) {
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+        const unsigned char* end = p + length;
+
+        while (p < end) {
+            if (literal_left > 0) {
+                size_t take = std::min<size_t>(literal_left, end - p);
+                if (!literal(reinterpret_cast<const char*>(p), take)) {
+                    return false;
+                }
+                literal_left -= take;
+                p += take;
+                continue;
+            }
+
+            if (op_have == 0 && *p != DELTA_OP_LITERAL && *p != DELTA_OP_COPY) {
+                return false;
+            }
+            size_t need = opSize(op_have ? op[0] : *p);
+            size_t take = std::min<size_t>(need - op_have, end - p);
+            memcpy(op + op_have, p, take);
+            op_have += take;
+            p += take;
+            if (op_have < need) {
+                break;
+            }
+
+            op_have = 0;
+            if (op[0] == DELTA_OP_LITERAL) {
+                literal_left = getBigEndian(op + 1, 4);
+            } else if (!copy(getBigEndian(op + 1, 8), getBigEndian(op + 9, 4))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // True between ops, i.e. the stream could legitimately end here
+    bool idle() const {
+        return op_have == 0 && literal_left == 0;
+    }
+};
+
+// Sending side: matches a local file against the basis signatures and
+// streams the resulting ops to a sink in DELTA_BATCH pieces
+class DeltaEncoder {
+private:
+    size_t block_size;
+    std::vector<unsigned char> strong;           // DELTA_STRONG_SIZE bytes per block
+    std::unordered_multimap<uint32_t, uint32_t> blocks;   // weak -> block index
+    std::vector<uint64_t> filter;                // Bitmap of weak values, rejects most misses cheaply
+    uint64_t filter_mask;
+
+    std::string out;
+    bool copy_pending;
+    uint64_t copy_start;
+    uint32_t copy_count;
+    uint64_t literal_bytes;
+    uint64_t copied_bytes;
+    uint32_t crc;                                // CRC32C of the whole new file
+
+    static uint64_t mix(uint32_t weak) {
+        return (weak * 0x9E3779B97F4A7C15ULL) >> 20;
+    }
+
+    void flushCopy() {
+        if (copy_pending) {
+            out += DELTA_OP_COPY;
+            putBigEndian(out, copy_start, 8);
+            putBigEndian(out, copy_count, 4);
+            copy_pending = false;
+        }
+    }
+
+    void emitLiteral(const unsigned char* data, size_t length) {
+        if (length == 0) {
+            return;
+        }
+        flushCopy();
+        out += DELTA_OP_LITERAL;
+        putBigEndian(out, length, 4);
+        out.append(reinterpret_cast<const char*>(data), length);
+        literal_bytes += length;
+    }
+
+    void emitCopy(uint32_t block) {
+        if (copy_pending && copy_start + copy_count == block) {
+            copy_count++;
+        } else {
+            flushCopy();
+            copy_pending = true;
+            copy_start = block;
+            copy_count = 1;
+        }
+        copied_bytes += block_size;
+    }
+
+    // Index of a basis block holding exactly this window, or -1
+    long findBlock(uint32_t weak, const unsigned char* window) const {
+        uint64_t bit = mix(weak) & filter_mask;
+        if (!(filter[bit >> 6] & (1ULL << (bit & 63)))) {
+            return -1;
+        }
+        auto range = blocks.equal_range(weak);
+        if (range.first == range.second) {
+            return -1;
+        }
+        unsigned char hash[DELTA_STRONG_SIZE];
+        deltaStrongHash(window, block_size, hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (memcmp(&strong[it->second * DELTA_STRONG_SIZE], hash, DELTA_STRONG_SIZE) == 0) {
+                return it->second;
+            }
+        }
+        return -1;
+    }
+
+public:
+    // signatures holds DELTA_SIGNATURE_SIZE bytes per basis block. Only full
+    // blocks are indexed; a short final block is cheaper to resend.
+    DeltaEncoder(size_t block, uint64_t basis_size, const std::string& signatures)
+        : block_size(block), copy_pending(false), copy_start(0), copy_count(0),
+          literal_bytes(0), copied_bytes(0), crc(0) {
+        size_t count = signatures.size() / DELTA_SIGNATURE_SIZE;
+        size_t full = std::min<uint64_t>(count, basis_size / block_size);
+
+        size_t bits = 1 << 16;
+        while (bits < full * 64) {
+            bits <<= 1;
+        }
+        filter.assign(bits / 64, 0);
+        filter_mask = bits - 1;
+        strong.resize(full * DELTA_STRONG_SIZE);
+        blocks.reserve(full);
+
+        const unsigned char* p = reinterpret_cast<const unsigned char*>(signatures.data());
+        for (size_t i = 0; i < full; i++, p += DELTA_SIGNATURE_SIZE) {
+            uint32_t weak = getBigEndian(p, 4);
+            memcpy(&strong[i * DELTA_STRONG_SIZE], p + 4, DELTA_STRONG_SIZE);
+            blocks.emplace(weak, i);
+            uint64_t bit = mix(weak) & filter_mask;
+            filter[bit >> 6] |= 1ULL << (bit & 63);
+        }
+    }
+
+    // Reads fd to its end; sink gets each batch of ops and the bytes scanned so far
+    bool encode(int fd, const std::function<bool(const std::string&, uint64_t)>& sink) {
+        std::vector<unsigned char> buffer;
+        size_t pos = 0;             // Window start within buffer
+        size_t literal_start = 0;   // First byte not yet sent or matched
+        uint64_t consumed = 0;      // File offset of buffer[0]
+        bool eof = false;
+        bool rolling = false;
+        RollingChecksum weak;
+
+        while (true) {
+            // Keep one byte beyond the window so it can roll
+            if (!eof && buffer.size() < pos + block_size + 1) {
+                buffer.erase(buffer.begin(), buffer.begin() + literal_start);
+                consumed += literal_start;
+                pos -= literal_start;
+                literal_start = 0;
+
+                size_t have = buffer.size();
+                buffer.resize(have + DELTA_BATCH + block_size);
+                ssize_t n = read(fd, buffer.data() + have, buffer.size() - have);
+                if (n < 0) {
+                    return false;
+                }
+                buffer.resize(have + n);
+                crc = crc32c(crc, buffer.data() + have, n);
+                eof = (n == 0);
+                continue;
+            }
+            if (buffer.size() < pos + block_size) {
+                break; // Less than a block left: the rest is literal
+            }
+
+            if (!rolling) {
+                weak.reset(buffer.data() + pos, block_size);
+                rolling = true;
+            }
+            long block = findBlock(weak.value(), buffer.data() + pos);
+            if (block >= 0) {
+                emitLiteral(buffer.data() + literal_start, pos - literal_start);
+                emitCopy(block);
+                pos += block_size;
+                literal_start = pos;
+                rolling = false;
+            } else {
+                if (pos + block_size < buffer.size()) {
+                    weak.roll(buffer[pos], buffer[pos + block_size]);
+                } else {
+                    rolling = false;
+                }
+                pos++;
+                if (pos - literal_start >= DELTA_LITERAL_RUN) {
+                    emitLiteral(buffer.data() + literal_start, pos - literal_start);
+                    literal_start = pos;
+                }
+            }
+
+            if (out.size() >= DELTA_BATCH) {
+                if (!sink(out, consumed + pos)) {
+                    return false;
+                }
+                out.clear();
+            }
+        }
+
+        emitLiteral(buffer.data() + literal_start, buffer.size() - literal_start);
+        flushCopy();
+        return sink(out, consumed + buffer.size());
+    }
+
+    uint64_t literalBytes() const {
+        return literal_bytes;
+    }
+
+    uint64_t copiedBytes() const {
+        return copied_bytes;
+    }
+
+    // Checksum of everything encode() read, for the PATCH trailer
+    uint32_t checksum() const {
+        return crc;
+    }
+};
+
+#endif
@@ -0,0 +1,438 @@
+// dir_cache.h - In-memory snapshot of the shared directory, kept current by inotify
+#ifndef DIR_CACHE_H
+#define DIR_CACHE_H
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <shared_mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "chunk_store.h"
+
+#define INOTIFY_BUFFER (64 * 1024)
+
+struct FileInfo {
+    std::string name;
+    long size;
+    bool is_directory;
+    std::string permissions;
+    time_t modified;
+};
+
+enum class SortKey { NAME, SIZE, MTIME };
+
+// One page of a sorted, filtered walk over the cache. The cursor is the
+// sort value and name of the last entry already returned, so paging stays
+// correct while entries come and go between requests.
+struct PageQuery {
+    SortKey sort;
+    bool descending;
+    std::string prefix;     // Names must start with this (narrows name-sorted walks)
+    std::function<bool(const FileInfo&)> filter;
+    bool has_cursor;
+    int64_t cursor_key;
+    std::string cursor_name;
+};
+
+// A rendered LIST reply and the number of files it shows
+struct Listing {
+    std::string text;
+    size_t count;
+};
+
+// The directory is read once, with a single fstatat() per entry. After that
+// an inotify watch applies each create/delete/rename/close-after-write to
+// the map, so lookups and listings never touch the disk. Every change bumps
+// version, which lets callers cache whatever they render from the entries
+// until the directory actually changes. If inotify is unavailable the cache
+// falls back to rescanning whenever it is asked for a listing.
+//
+// Deduplicated files are stored as <name>.chunks manifests; the cache shows
+// them under <name> with the logical size from the manifest header. If a
+// plain file of the same name exists as well, the plain file wins.
+class DirectoryCache {
+private:
+    std::string path;
+    int dir_fd;
+    int inotify_fd;
+    int wake_fd;            // eventfd that stops the watcher thread
+    std::thread watcher;
+
+    // Secondary orderings by (size, name) and (mtime, name). They point at
+    // the keys of entries, whose nodes never move while they exist.
+    struct IndexOrder {
+        bool operator()(const std::pair<int64_t, const std::string*>& a,
+                        const std::pair<int64_t, const std::string*>& b) const {
+            if (a.first != b.first) {
+                return a.first < b.first;
+            }
+            return *a.second < *b.second;
+        }
+    };
+    typedef std::set<std::pair<int64_t, const std::string*>, IndexOrder> SortIndex;
+
+    mutable std::shared_mutex lock;
+    std::map<std::string, FileInfo> entries;
+    SortIndex by_size;
+    SortIndex by_mtime;
+    uint64_t version;
+
+    std::mutex listing_lock;
+    std::shared_ptr<const Listing> listing;
+    uint64_t listing_version;
+
+    std::function<void(const std::string&)> on_change;
+
+    static std::string permissionString(mode_t mode) {
+        std::string perms = "";
+        perms += (S_ISDIR(mode)) ? 'd' : '-';
+        perms += (mode & S_IRUSR) ? 'r' : '-';
+        perms += (mode & S_IWUSR) ? 'w' : '-';
+        perms += (mode & S_IXUSR) ? 'x' : '-';
+        perms += (mode & S_IRGRP) ? 'r' : '-';
+        perms += (mode & S_IWGRP) ? 'w' : '-';
+        perms += (mode & S_IXGRP) ? 'x' : '-';
+        perms += (mode & S_IROTH) ? 'r' : '-';
+        perms += (mode & S_IWOTH) ? 'w' : '-';
+        perms += (mode & S_IXOTH) ? 'x' : '-';
+        return perms;
+    }
+
+    // Name an on-disk entry is listed under
+    static std::string logicalName(const std::string& name) {
+        return isManifestName(name) ? name.substr(0, name.size() - strlen(MANIFEST_SUFFIX)) : name;
+    }
+
+    bool statEntry(const std::string& name, FileInfo& info) const {
+        struct stat st;
+        long size;
+        if (fstatat(dir_fd, name.c_str(), &st, 0) == 0) {
+            size = st.st_size;
+        } else {
+            // Only a finished manifest counts; partial ones stay invisible
+            int fd = openat(dir_fd, (name + MANIFEST_SUFFIX).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0) {
+                return false;
+            }
+            ManifestHeader header;
+            bool valid = fstat(fd, &st) == 0 && readManifestHeader(fd, header);
+            close(fd);
+            if (!valid) {
+                return false;
+            }
+            size = header.size;
+        }
+        info.name = name;
+        info.size = size;
+        info.is_directory = S_ISDIR(st.st_mode);
+        info.permissions = permissionString(st.st_mode);
+        info.modified = st.st_mtime;
+        return true;
+    }
+
+    static void indexEntry(SortIndex& size_index, SortIndex& mtime_index,
+                           const std::string& key, const FileInfo& info) {
+        size_index.insert({info.size, &key});
+        mtime_index.insert({info.modified, &key});
+    }
+
+    void unindexEntry(const std::string& key, const FileInfo& info) {
+        by_size.erase({info.size, &key});
+        by_mtime.erase({info.modified, &key});
+    }
+
+    // Collects matching entries from it onwards; returns true if at least
+    // one more match lies beyond the page
+    template <typename Iterator, typename InfoOf>
+    static bool walk(Iterator it, Iterator end, InfoOf info_of, const PageQuery& query,
+                     bool prefix_ordered, size_t limit, std::vector<FileInfo>& out) {
+        for (; it != end; ++it) {
+            const FileInfo& info = info_of(*it);
+            if (info.name.compare(0, query.prefix.size(), query.prefix) != 0) {
+                if (prefix_ordered) {
+                    return false; // Walked past every name with the prefix
+                }
+                continue;
+            }
+            if (query.filter && !query.filter(info)) {
+                continue;
+            }
+            if (out.size() == limit) {
+                return true;
+            }
+            out.push_back(info);
+        }
+        return false;
+    }
+
+    bool walkIndex(const SortIndex& index, const PageQuery& query, size_t limit,
+                   std::vector<FileInfo>& out) const {
+        auto info_of = [this](const std::pair<int64_t, const std::string*>& item) -> const FileInfo& {
+            return entries.find(*item.second)->second;
+        };
+        std::pair<int64_t, const std::string*> cursor = {query.cursor_key, &query.cursor_name};
+
+        if (query.descending) {
+            auto start = query.has_cursor ? SortIndex::const_reverse_iterator(index.lower_bound(cursor))
+                                          : index.rbegin();
+            return walk(start, index.rend(), info_of, query, false, limit, out);
+        }
+        auto start = query.has_cursor ? index.upper_bound(cursor) : index.begin();
+        return walk(start, index.end(), info_of, query, false, limit, out);
+    }
+
+    // Reads the whole directory into a fresh map and swaps it in
+    void rescan() {
+        std::map<std::string, FileInfo> fresh;
+        SortIndex fresh_size, fresh_mtime;
+        int fd = dup(dir_fd);
+        DIR* dir = (fd >= 0) ? fdopendir(fd) : nullptr;
+        if (!dir) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return;
+        }
+        rewinddir(dir);
+
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != nullptr) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+            std::string name = logicalName(entry->d_name);
+            FileInfo info;
+            if (fresh.find(name) == fresh.end() && statEntry(name, info)) {
+                fresh.emplace(info.name, std::move(info));
+            }
+        }
+        closedir(dir);
+        for (const auto& entry : fresh) {
+            indexEntry(fresh_size, fresh_mtime, entry.first, entry.second);
+        }
+
+        // Swapping keeps the map nodes in place, so index pointers stay valid
+        std::unique_lock<std::shared_mutex> guard(lock);
+        entries.swap(fresh);
+        by_size.swap(fresh_size);
+        by_mtime.swap(fresh_mtime);
+        version++;
+    }
+
+    void applyEvents(const char* buffer, ssize_t length) {
+        for (const char* p = buffer; p < buffer + length;) {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            p += sizeof(struct inotify_event) + event->len;
+
+            if (event->mask & IN_Q_OVERFLOW) {
+                rescan(); // Events were lost; start from the directory itself
+                if (on_change) {
+                    on_change("");
+                }
+                continue;
+            }
+            if (event->len > 0) {
+                std::string name = logicalName(event->name);
+                refresh(name);
+                if (on_change) {
+                    on_change(name);
+                }
+            }
+        }
+    }
+
+    void watchLoop() {
+        alignas(struct inotify_event) char buffer[INOTIFY_BUFFER];
+        struct pollfd fds[2] = {{inotify_fd, POLLIN, 0}, {wake_fd, POLLIN, 0}};
+
+        while (true) {
+            if (poll(fds, 2, -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            if (fds[1].revents) {
+                return;
+            }
+            ssize_t length = read(inotify_fd, buffer, sizeof(buffer));
+            if (length > 0) {
+                applyEvents(buffer, length);
+            }
+        }
+    }
+
+public:
+    DirectoryCache()
+        : dir_fd(-1), inotify_fd(-1), wake_fd(-1), version(0), listing_version(0) {}
+
+    // Takes the first snapshot and starts watching; returns false if the
+    // directory can't be opened. Watching is best effort.
+    bool load(const std::string& dir_path) {
+        path = dir_path;
+        dir_fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd < 0) {
+            return false;
+        }
+
+        inotify_fd = inotify_init1(IN_CLOEXEC);
+        wake_fd = eventfd(0, EFD_CLOEXEC);
+        uint32_t mask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO |
+                        IN_CLOSE_WRITE | IN_ATTRIB | IN_ONLYDIR;
+        if (inotify_fd < 0 || wake_fd < 0 || inotify_add_watch(inotify_fd, path.c_str(), mask) < 0) {
+            if (inotify_fd >= 0) {
+                close(inotify_fd);
+                inotify_fd = -1;
+            }
+        }
+
+        // Watch before scanning so nothing changes unseen in between
+        rescan();
+        if (inotify_fd >= 0) {
+            watcher = std::thread(&DirectoryCache::watchLoop, this);
+        }
+        return true;
+    }
+
+    // Called from the watcher thread with the name of every file inotify
+    // reports as changed, or an empty name if events were lost. Set it
+    // before load().
+    void onChange(std::function<void(const std::string&)> callback) {
+        on_change = std::move(callback);
+    }
+
+    bool watching() const {
+        return inotify_fd >= 0;
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> guard(lock);
+        return entries.size();
+    }
+
+    // Re-reads one entry, dropping it if it no longer exists. The server
+    // calls this for its own changes so they show up without waiting for
+    // the inotify event.
+    void refresh(const std::string& name) {
+        FileInfo info;
+        bool exists = statEntry(name, info);
+
+        std::unique_lock<std::shared_mutex> guard(lock);
+        auto it = entries.find(name);
+        if (exists) {
+            if (it != entries.end()) {
+                const FileInfo& current = it->second;
+                if (current.size == info.size && current.modified == info.modified &&
+                    current.permissions == info.permissions) {
+                    return; // e.g. a file closed without being changed
+                }
+                unindexEntry(it->first, current);
+                it->second = std::move(info);
+            } else {
+                it = entries.emplace(name, std::move(info)).first;
+            }
+            indexEntry(by_size, by_mtime, it->first, it->second);
+        } else {
+            if (it == entries.end()) {
+                return;
+            }
+            unindexEntry(it->first, it->second);
+            entries.erase(it);
+        }
+        version++;
+    }
+
+    bool lookup(const std::string& name, FileInfo& info) {
+        if (!watching()) {
+            refresh(name);
+        }
+        std::shared_lock<std::shared_mutex> guard(lock);
+        auto it = entries.find(name);
+        if (it == entries.end()) {
+            return false;
+        }
+        info = it->second;
+        return true;
+    }
+
+    // Appends up to limit entries that sort after the query's cursor; returns
+    // true if more remain. Only the page itself is copied.
+    bool page(const PageQuery& query, size_t limit, std::vector<FileInfo>& out) {
+        if (!watching() && !query.has_cursor) {
+            rescan();
+        }
+        std::shared_lock<std::shared_mutex> guard(lock);
+        auto info_of = [](const std::pair<const std::string, FileInfo>& entry) -> const FileInfo& {
+            return entry.second;
+        };
+
+        switch (query.sort) {
+            case SortKey::SIZE:
+                return walkIndex(by_size, query, limit, out);
+            case SortKey::MTIME:
+                return walkIndex(by_mtime, query, limit, out);
+            case SortKey::NAME:
+                break;
+        }
+
+        if (query.descending) {
+            auto start = query.has_cursor
+                ? std::map<std::string, FileInfo>::const_reverse_iterator(entries.lower_bound(query.cursor_name))
+                : entries.crbegin();
+            return walk(start, entries.crend(), info_of, query, false, limit, out);
+        }
+
+        // Name order keeps a prefix contiguous: jump to it, stop after it
+        auto start = query.has_cursor ? entries.upper_bound(query.cursor_name) : entries.cbegin();
+        if (!query.prefix.empty() && (!query.has_cursor || query.cursor_name < query.prefix)) {
+            start = entries.lower_bound(query.prefix);
+        }
+        return walk(start, entries.cend(), info_of, query, true, limit, out);
+    }
+
+    // Returns the listing rendered from the current entries, re-rendering
+    // only if the directory changed since the last call
+    std::shared_ptr<const Listing> cachedListing(
+        const std::function<Listing(const std::map<std::string, FileInfo>&)>& render) {
+        if (!watching()) {
+            rescan();
+        }
+        std::lock_guard<std::mutex> render_guard(listing_lock);
+        std::shared_lock<std::shared_mutex> guard(lock);
+        if (!listing || listing_version != version) {
+            listing = std::make_shared<const Listing>(render(entries));
+            listing_version = version;
+        }
+        return listing;
+    }
+
+    ~DirectoryCache() {
+        if (watcher.joinable()) {
+            uint64_t one = 1;
+            ssize_t ignored = write(wake_fd, &one, sizeof(one));
+            (void)ignored;
+            watcher.join();
+        }
+        for (int fd : {inotify_fd, wake_fd, dir_fd}) {
+            if (fd >= 0) {
+                close(fd);
+            }
+        }
+    }
+};
+
+#endif
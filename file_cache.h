@@ -0,0 +1,177 @@
+// file_cache.h - Popular shared files kept whole in memory
+//
+// A download served from here costs no open(), read() or disk seek: the
+// bytes go from memory straight to the socket, so the tail latency of the
+// files everyone fetches no longer depends on the disk. A file is admitted
+// on its second download (a one-off download of a big file would only churn
+// the cache) and the least recently used entries are evicted once the byte
+// budget is exceeded. Each entry remembers the inode, size, mtime and ctime
+// it was read with and is only served while a stat() of the file still
+// matches, so a rewritten or replaced file is never served stale. The
+// directory watcher additionally drops entries as soon as inotify reports a
+// change, which frees their memory without waiting for the next request.
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <sys/stat.h>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "checksum.h"
+
+#define CACHE_ADMIT_DOWNLOADS 2       // Downloads of an uncached file before it is cached
+#define CACHE_MISS_TRACKING 4096      // Uncached names counted before the counts restart
+
+struct CachedFile {
+    std::string data;       // Logical file contents (reassembled if deduplicated)
+    uint32_t crc;           // CRC32C of all of data
+    std::string source;     // Path stat()ed to validate the entry (the manifest if deduplicated)
+    struct stat identity;   // What source looked like when data was read
+
+    // CRC32C of bytes [offset, offset + length), without a second pass for the whole file
+    uint32_t rangeCrc(long offset, long length) const {
+        if (offset == 0 && static_cast<size_t>(length) == data.size()) {
+            return crc;
+        }
+        return crc32c(0, data.data() + offset, length);
+    }
+
+    // True if st still describes the file the data was read from
+    bool matches(const struct stat& st) const {
+        return st.st_ino == identity.st_ino && st.st_dev == identity.st_dev &&
+               st.st_size == identity.st_size &&
+               st.st_mtim.tv_sec == identity.st_mtim.tv_sec &&
+               st.st_mtim.tv_nsec == identity.st_mtim.tv_nsec &&
+               st.st_ctim.tv_sec == identity.st_ctim.tv_sec &&
+               st.st_ctim.tv_nsec == identity.st_ctim.tv_nsec;
+    }
+};
+
+// Entries are handed out as shared pointers: a download in flight keeps
+// its bytes alive even if the entry is evicted or invalidated meanwhile.
+class FileCache {
+private:
+    typedef std::list<std::pair<std::string, std::shared_ptr<const CachedFile>>> LruList;
+
+    mutable std::mutex lock;
+    size_t capacity;        // Byte budget; 0 = cache disabled
+    size_t used;
+    LruList lru;            // Most recently used first
+    std::unordered_map<std::string, LruList::iterator> index;
+    std::unordered_map<std::string, unsigned> downloads;   // Uncached names seen so far
+
+    void evict(LruList::iterator it) {
+        used -= it->second->data.size();
+        index.erase(it->first);
+        lru.erase(it);
+    }
+
+public:
+    FileCache() : capacity(0), used(0) {}
+
+    FileCache(const FileCache&) = delete;
+    FileCache& operator=(const FileCache&) = delete;
+
+    void setCapacity(size_t bytes) {
+        std::lock_guard<std::mutex> guard(lock);
+        capacity = bytes;
+        while (used > capacity) {
+            evict(std::prev(lru.end()));
+        }
+    }
+
+    bool enabled() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return capacity > 0;
+    }
+
+    // Largest file worth caching: a quarter of the budget, so one big file
+    // can't flush everything else
+    size_t maxFileSize() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return capacity / 4;
+    }
+
+    size_t usedBytes() const {
+        std::lock_guard<std::mutex> guard(lock);
+        return used;
+    }
+
+    // The cached file under name, or null if there is none or the file on
+    // disk has changed since it was read. Costs one stat(), never a read.
+    std::shared_ptr<const CachedFile> lookup(const std::string& name) {
+        std::shared_ptr<const CachedFile> file;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            auto it = index.find(name);
+            if (it == index.end()) {
+                return nullptr;
+            }
+            lru.splice(lru.begin(), lru, it->second);
+            file = it->second->second;
+        }
+
+        struct stat st;
+        if (stat(file->source.c_str(), &st) == 0 && file->matches(st)) {
+            return file;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(name);
+        if (it != index.end() && it->second->second == file) {
+            evict(it->second);
+        }
+        return nullptr;
+    }
+
+    // Counts a download that missed the cache; true once the file has been
+    // asked for often enough, and is small enough, to be worth caching
+    bool admit(const std::string& name, long size) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (capacity == 0 || size <= 0 || static_cast<size_t>(size) > capacity / 4) {
+            return false;
+        }
+        if (downloads.size() >= CACHE_MISS_TRACKING) {
+            downloads.clear(); // Forget the long tail rather than grow without bound
+        }
+        unsigned& count = downloads[name];
+        if (++count < CACHE_ADMIT_DOWNLOADS) {
+            return false;
+        }
+        downloads.erase(name);
+        return true;
+    }
+
+    void insert(const std::string& name, std::shared_ptr<const CachedFile> file) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = index.find(name);
+        if (it != index.end()) {
+            evict(it->second);
+        }
+        used += file->data.size();
+        lru.emplace_front(name, std::move(file));
+        index[name] = lru.begin();
+        while (used > capacity) {
+            evict(std::prev(lru.end()));
+        }
+    }
+
+    // Drops name, or every entry if name is empty
+    void invalidate(const std::string& name) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (name.empty()) {
+            lru.clear();
+            index.clear();
+            used = 0;
+            return;
+        }
+        auto it = index.find(name);
+        if (it != index.end()) {
+            evict(it->second);
+        }
+    }
+};
+
+#endif
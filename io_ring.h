@@ -0,0 +1,273 @@
+// io_ring.h - Minimal io_uring wrapper on the raw system calls (no liburing)
+//
+// Requests are queued with the prep*() calls and go to the kernel together
+// in one io_uring_enter(). A request flagged IOSQE_IO_LINK only starts once
+// the one before it has fully succeeded, so "read a file range into a
+// buffer, then send that buffer" is a single submission. Buffers are
+// registered with the kernel up front so reads and writes into them skip
+// the per-call page pinning; if registration is refused (RLIMIT_MEMLOCK),
+// the same buffers are used with the unregistered opcodes.
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <vector>
+
+class IoRing {
+private:
+    int ring_fd;
+    void* sq_map;
+    size_t sq_map_size;
+    void* cq_map;
+    size_t cq_map_size;
+    io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_entries;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    io_uring_cqe* cqes;
+
+    unsigned queued_tail;       // Our SQ tail; published to the kernel on submit()
+    unsigned unsubmitted;
+
+    std::vector<char> memory;   // Buffers, back to back
+    size_t buffer_size;
+    bool registered;            // Buffers are known to the kernel (READ_FIXED/WRITE_FIXED)
+
+    template <typename T>
+    static T* at(void* base, unsigned offset) {
+        return reinterpret_cast<T*>(static_cast<char*>(base) + offset);
+    }
+
+    io_uring_sqe* next(uint8_t opcode, int fd, uint64_t user_data) {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (queued_tail - head >= *sq_entries) {
+            return nullptr; // Full; callers never queue more than they reap
+        }
+        unsigned index = queued_tail & *sq_mask;
+        io_uring_sqe* sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->user_data = user_data;
+        sq_array[index] = index;
+        queued_tail++;
+        unsubmitted++;
+        return sqe;
+    }
+
+public:
+    IoRing()
+        : ring_fd(-1), sq_map(MAP_FAILED), sq_map_size(0), cq_map(MAP_FAILED), cq_map_size(0),
+          sqes(static_cast<io_uring_sqe*>(MAP_FAILED)), sqes_size(0), queued_tail(0), unsubmitted(0),
+          buffer_size(0), registered(false) {}
+
+    IoRing(const IoRing&) = delete;
+    IoRing& operator=(const IoRing&) = delete;
+
+    ~IoRing() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_map != MAP_FAILED && cq_map != sq_map) {
+            munmap(cq_map, cq_map_size);
+        }
+        if (sq_map != MAP_FAILED) {
+            munmap(sq_map, sq_map_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    // Creates the ring; false with errno set if the kernel (or a seccomp
+    // policy, as in default container profiles) does not allow io_uring
+    bool setup(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = syscall(__NR_io_uring_setup, entries, &params);
+        if (ring_fd < 0) {
+            return false;
+        }
+
+        sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_map_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_map = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_map) {
+            sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+        }
+        sq_map = mmap(nullptr, sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring_fd, IORING_OFF_SQ_RING);
+        if (sq_map == MAP_FAILED) {
+            return false;
+        }
+        cq_map = single_map ? sq_map
+                            : mmap(nullptr, cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                   ring_fd, IORING_OFF_CQ_RING);
+        if (cq_map == MAP_FAILED) {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe*>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE,
+                                               MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED) {
+            return false;
+        }
+
+        sq_head = at<unsigned>(sq_map, params.sq_off.head);
+        sq_tail = at<unsigned>(sq_map, params.sq_off.tail);
+        sq_mask = at<unsigned>(sq_map, params.sq_off.ring_mask);
+        sq_entries = at<unsigned>(sq_map, params.sq_off.ring_entries);
+        sq_array = at<unsigned>(sq_map, params.sq_off.array);
+        cq_head = at<unsigned>(cq_map, params.cq_off.head);
+        cq_tail = at<unsigned>(cq_map, params.cq_off.tail);
+        cq_mask = at<unsigned>(cq_map, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+        queued_tail = *sq_tail;
+        return true;
+    }
+
+    // Allocates count buffers of size bytes and registers them if allowed
+    void addBuffers(size_t count, size_t size) {
+        memory.assign(count * size, 0);
+        buffer_size = size;
+        std::vector<iovec> iovecs(count);
+        for (size_t i = 0; i < count; i++) {
+            iovecs[i] = {memory.data() + i * size, size};
+        }
+        registered = syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_BUFFERS,
+                             iovecs.data(), count) == 0;
+    }
+
+    int fd() const { return ring_fd; }
+    char* buffer(unsigned index) { return memory.data() + index * buffer_size; }
+    size_t bufferSize() const { return buffer_size; }
+    bool buffersRegistered() const { return registered; }
+
+    // File read into buffer index at offset
+    io_uring_sqe* prepRead(int fd, unsigned index, size_t length, long offset, uint64_t user_data) {
+        io_uring_sqe* sqe = next(registered ? IORING_OP_READ_FIXED : IORING_OP_READ, fd, user_data);
+        if (sqe) {
+            sqe->addr = reinterpret_cast<uint64_t>(buffer(index));
+            sqe->len = length;
+            sqe->off = offset;
+            sqe->buf_index = index;
+        }
+        return sqe;
+    }
+
+    // File write out of buffer index at offset
+    io_uring_sqe* prepWrite(int fd, unsigned index, size_t length, long offset, uint64_t user_data) {
+        io_uring_sqe* sqe = next(registered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, fd, user_data);
+        if (sqe) {
+            sqe->addr = reinterpret_cast<uint64_t>(buffer(index));
+            sqe->len = length;
+            sqe->off = offset;
+            sqe->buf_index = index;
+        }
+        return sqe;
+    }
+
+    io_uring_sqe* prepSend(int fd, const void* data, size_t length, int flags, uint64_t user_data) {
+        io_uring_sqe* sqe = next(IORING_OP_SEND, fd, user_data);
+        if (sqe) {
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = length;
+            sqe->msg_flags = flags;
+        }
+        return sqe;
+    }
+
+    io_uring_sqe* prepRecv(int fd, void* data, size_t length, int flags, uint64_t user_data) {
+        io_uring_sqe* sqe = next(IORING_OP_RECV, fd, user_data);
+        if (sqe) {
+            sqe->addr = reinterpret_cast<uint64_t>(data);
+            sqe->len = length;
+            sqe->msg_flags = flags;
+        }
+        return sqe;
+    }
+
+    io_uring_sqe* prepAccept(int fd, sockaddr* addr, socklen_t* addr_len, int flags, uint64_t user_data) {
+        io_uring_sqe* sqe = next(IORING_OP_ACCEPT, fd, user_data);
+        if (sqe) {
+            sqe->addr = reinterpret_cast<uint64_t>(addr);
+            sqe->addr2 = reinterpret_cast<uint64_t>(addr_len);
+            sqe->accept_flags = flags;
+        }
+        return sqe;
+    }
+
+    // Completes after delay; the timespec is read when the request is submitted
+    io_uring_sqe* prepTimeout(const __kernel_timespec* delay, uint64_t user_data) {
+        io_uring_sqe* sqe = next(IORING_OP_TIMEOUT, -1, user_data);
+        if (sqe) {
+            sqe->addr = reinterpret_cast<uint64_t>(delay);
+            sqe->len = 1;
+        }
+        return sqe;
+    }
+
+    // Hands every queued request to the kernel and waits until at least
+    // wait_for completions are available, all in one system call
+    bool submit(unsigned wait_for = 0) {
+        __atomic_store_n(sq_tail, queued_tail, __ATOMIC_RELEASE);
+        while (true) {
+            unsigned flags = wait_for > 0 ? IORING_ENTER_GETEVENTS : 0;
+            int submitted = syscall(__NR_io_uring_enter, ring_fd, unsubmitted, wait_for, flags, nullptr, 0);
+            if (submitted < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            if (submitted == 0 && unsubmitted > 0) {
+                errno = EBUSY;
+                return false;
+            }
+            unsubmitted -= submitted;
+            if (unsubmitted == 0) {
+                return true;
+            }
+            // The kernel took part of the batch (completion queue pressure); go again
+        }
+    }
+
+    // Takes the next completion, if one is ready
+    bool pop(io_uring_cqe& cqe) {
+        unsigned head = *cq_head;
+        if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+        cqe = cqes[head & *cq_mask];
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Takes the next completion, waiting for it if none is ready yet
+    bool wait(io_uring_cqe& cqe) {
+        while (!pop(cqe)) {
+            if (!submit(1)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+#endif
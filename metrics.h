@@ -0,0 +1,404 @@
+// metrics.h - Counters and latency histograms, served in Prometheus text format
+//
+// Hot paths only touch the calling thread's own shard: a relaxed atomic add
+// to memory no other thread writes, so counting takes no lock and bounces
+// no cache lines between cores. A scrape sums the shards.
+//
+// Command latencies go into log-linear (HDR-style) histograms. Each power
+// of two of microseconds is split into HIST_SUB_BUCKETS equal buckets, so
+// any value from 1 µs to hours is placed within 1/HIST_SUB_BUCKETS of its
+// size in a fixed array, with no allocation. A scrape reports cumulative
+// counts at every octave and half-octave from 8 µs to 50 s, from which
+// histogram_quantile() computes p50/p99 over any window.
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <thread>
+
+#define METRICS_SHARDS 64           // Threads beyond this share shards (still exact, just contended)
+#define HIST_SUB_BITS 3
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+#define HIST_OCTAVES 36             // Largest bucket ends at 2^36 µs, about 19 hours
+#define HIST_BUCKETS ((HIST_OCTAVES - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+#define HIST_EXPORT_MIN_OCTAVE 3    // First reported bucket edge: 2^3 µs
+#define HIST_EXPORT_MAX_OCTAVE 25   // Last: 1.5 × 2^25 µs, about 50 s
+#define METRICS_REQUEST_MAX 8192    // Longest HTTP request header read
+#define METRICS_TIMEOUT_MS 2000     // A scraper that stalls longer is dropped
+
+// Commands timed separately; the rest are counted as "OTHER"
+enum MetricCommand {
+    CMD_LOGIN,
+    CMD_AUTH,
+    CMD_LIST,
+    CMD_INFO,
+    CMD_DOWNLOAD,
+    CMD_UPLOAD,
+    CMD_RESUME,
+    CMD_SIGNATURES,
+    CMD_PATCH,
+    CMD_MGET,
+    CMD_MPUT,
+    CMD_OTHER,
+    METRIC_COMMANDS
+};
+
+enum MetricCounter {
+    NET_BYTES_IN,           // Read from client sockets
+    NET_BYTES_OUT,          // Written to client sockets
+    DOWNLOAD_BYTES,         // File data sent (before compression)
+    UPLOAD_BYTES,           // File data received
+    CONNECTIONS_ACCEPTED,
+    TRANSFERS_INTERRUPTED,  // Connection lost with a transfer in progress
+    CHECKSUM_FAILURES,
+    PROTOCOL_ERRORS,
+    METRIC_COUNTERS
+};
+
+class Metrics {
+private:
+    struct Shard {
+        std::atomic<uint64_t> counters[METRIC_COUNTERS];
+        std::atomic<uint64_t> errors[METRIC_COMMANDS];
+        std::atomic<uint64_t> latency_sum[METRIC_COMMANDS];         // Microseconds
+        std::atomic<uint64_t> latency[METRIC_COMMANDS][HIST_BUCKETS];
+
+        Shard() : counters(), errors(), latency_sum(), latency() {}
+    };
+
+    std::atomic<Shard*> shards[METRICS_SHARDS];
+    std::chrono::system_clock::time_point started;
+
+    // Each thread keeps one slot for its lifetime
+    static size_t threadSlot() {
+        static std::atomic<size_t> next_slot(0);
+        thread_local size_t slot = next_slot++ % METRICS_SHARDS;
+        return slot;
+    }
+
+    Shard& local() {
+        std::atomic<Shard*>& entry = shards[threadSlot()];
+        Shard* shard = entry.load(std::memory_order_acquire);
+        if (!shard) {
+            Shard* fresh = new Shard();
+            if (entry.compare_exchange_strong(shard, fresh, std::memory_order_acq_rel)) {
+                shard = fresh;
+            } else {
+                delete fresh; // Another thread with the same slot got there first
+            }
+        }
+        return *shard;
+    }
+
+    static size_t bucketOf(uint64_t micros) {
+        if (micros < HIST_SUB_BUCKETS) {
+            return micros;
+        }
+        unsigned octave = 63 - __builtin_clzll(micros);
+        if (octave >= HIST_OCTAVES) {
+            return HIST_BUCKETS - 1;
+        }
+        unsigned sub = (micros >> (octave - HIST_SUB_BITS)) & (HIST_SUB_BUCKETS - 1);
+        return (octave - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS + sub;
+    }
+
+    // First value (in µs) above bucket index
+    static uint64_t bucketEnd(size_t index) {
+        if (index < HIST_SUB_BUCKETS) {
+            return index + 1;
+        }
+        unsigned octave = index / HIST_SUB_BUCKETS + HIST_SUB_BITS - 1;
+        uint64_t sub = index % HIST_SUB_BUCKETS;
+        return (HIST_SUB_BUCKETS + sub + 1) << (octave - HIST_SUB_BITS);
+    }
+
+    template <typename Read>
+    uint64_t total(Read read) const {
+        uint64_t sum = 0;
+        for (const auto& entry : shards) {
+            const Shard* shard = entry.load(std::memory_order_acquire);
+            if (shard) {
+                sum += read(*shard).load(std::memory_order_relaxed);
+            }
+        }
+        return sum;
+    }
+
+    static void appendValue(std::string& out, const std::string& name, const std::string& labels, double value) {
+        char number[32];
+        snprintf(number, sizeof(number), "%.17g", value);
+        out.append(name);
+        if (!labels.empty()) {
+            out.append("{").append(labels).append("}");
+        }
+        out.append(" ").append(number).append("\n");
+    }
+
+public:
+    static const char* commandName(MetricCommand command) {
+        static const char* names[METRIC_COMMANDS] = {
+            "LOGIN", "AUTH", "LIST", "INFO", "DOWNLOAD", "UPLOAD", "RESUME", "SIGNATURES", "PATCH", "MGET",
+            "MPUT", "OTHER"
+        };
+        return names[command];
+    }
+
+    static MetricCommand commandByName(const std::string& name) {
+        for (int i = 0; i < CMD_OTHER; i++) {
+            if (name == commandName(static_cast<MetricCommand>(i))) {
+                return static_cast<MetricCommand>(i);
+            }
+        }
+        return CMD_OTHER;
+    }
+
+    Metrics() : shards(), started(std::chrono::system_clock::now()) {}
+
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    ~Metrics() {
+        for (auto& entry : shards) {
+            delete entry.load();
+        }
+    }
+
+    void add(MetricCounter counter, uint64_t n = 1) {
+        local().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+
+    // One handled command: how long it took and whether it was answered with an error
+    void observe(MetricCommand command, std::chrono::steady_clock::duration elapsed, bool failed) {
+        uint64_t micros = std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+        Shard& shard = local();
+        shard.latency[command][bucketOf(micros)].fetch_add(1, std::memory_order_relaxed);
+        shard.latency_sum[command].fetch_add(micros, std::memory_order_relaxed);
+        if (failed) {
+            shard.errors[command].fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    uint64_t count(MetricCounter counter) const {
+        return total([counter](const Shard& shard) -> const std::atomic<uint64_t>& {
+            return shard.counters[counter];
+        });
+    }
+
+    // Appends a metric's HELP and TYPE lines
+    static void describe(std::string& out, const std::string& name, const char* type, const char* help) {
+        out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+        out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+    }
+
+    static void sample(std::string& out, const std::string& name, double value, const std::string& labels = "") {
+        appendValue(out, name, labels, value);
+    }
+
+    // Everything recorded so far, in the Prometheus text exposition format
+    void render(std::string& out) const {
+        const char* histogram = "fileserver_command_duration_seconds";
+        describe(out, histogram, "histogram", "Time to handle a command, until its reply is queued.");
+        for (int c = 0; c < METRIC_COMMANDS; c++) {
+            std::string label = std::string("command=\"") + commandName(static_cast<MetricCommand>(c)) + "\"";
+            uint64_t buckets[HIST_BUCKETS] = {};
+            for (const auto& entry : shards) {
+                const Shard* shard = entry.load(std::memory_order_acquire);
+                for (size_t b = 0; shard && b < HIST_BUCKETS; b++) {
+                    buckets[b] += shard->latency[c][b].load(std::memory_order_relaxed);
+                }
+            }
+
+            uint64_t cumulative = 0;
+            size_t b = 0;
+            for (unsigned octave = HIST_EXPORT_MIN_OCTAVE; octave <= HIST_EXPORT_MAX_OCTAVE; octave++) {
+                for (uint64_t edge : {1ULL << octave, 3ULL << (octave - 1)}) {
+                    for (; b < HIST_BUCKETS && bucketEnd(b) <= edge; b++) {
+                        cumulative += buckets[b];
+                    }
+                    char le[32];
+                    snprintf(le, sizeof(le), "%g", edge / 1e6);
+                    appendValue(out, std::string(histogram) + "_bucket", label + ",le=\"" + le + "\"", cumulative);
+                }
+            }
+            for (; b < HIST_BUCKETS; b++) {
+                cumulative += buckets[b];
+            }
+            appendValue(out, std::string(histogram) + "_bucket", label + ",le=\"+Inf\"", cumulative);
+            double sum = total([c](const Shard& shard) -> const std::atomic<uint64_t>& {
+                return shard.latency_sum[c];
+            }) / 1e6;
+            appendValue(out, std::string(histogram) + "_sum", label, sum);
+            appendValue(out, std::string(histogram) + "_count", label, cumulative);
+        }
+
+        describe(out, "fileserver_command_errors_total", "counter", "Commands answered with an ERROR reply.");
+        for (int c = 0; c < METRIC_COMMANDS; c++) {
+            uint64_t errors = total([c](const Shard& shard) -> const std::atomic<uint64_t>& {
+                return shard.errors[c];
+            });
+            appendValue(out, "fileserver_command_errors_total",
+                        std::string("command=\"") + commandName(static_cast<MetricCommand>(c)) + "\"", errors);
+        }
+
+        describe(out, "fileserver_network_bytes_total", "counter", "Bytes read from and written to client sockets.");
+        appendValue(out, "fileserver_network_bytes_total", "direction=\"in\"", count(NET_BYTES_IN));
+        appendValue(out, "fileserver_network_bytes_total", "direction=\"out\"", count(NET_BYTES_OUT));
+        describe(out, "fileserver_transfer_bytes_total", "counter",
+                 "File data moved; rate() of this is transfer throughput.");
+        appendValue(out, "fileserver_transfer_bytes_total", "direction=\"download\"", count(DOWNLOAD_BYTES));
+        appendValue(out, "fileserver_transfer_bytes_total", "direction=\"upload\"", count(UPLOAD_BYTES));
+        describe(out, "fileserver_connections_total", "counter", "Connections accepted as sessions.");
+        sample(out, "fileserver_connections_total", count(CONNECTIONS_ACCEPTED));
+        describe(out, "fileserver_transfers_interrupted_total", "counter",
+                 "Connections lost while a transfer was in progress.");
+        sample(out, "fileserver_transfers_interrupted_total", count(TRANSFERS_INTERRUPTED));
+        describe(out, "fileserver_checksum_failures_total", "counter", "Uploads rejected for a CRC32C mismatch.");
+        sample(out, "fileserver_checksum_failures_total", count(CHECKSUM_FAILURES));
+        describe(out, "fileserver_protocol_errors_total", "counter", "Connections dropped for a framing violation.");
+        sample(out, "fileserver_protocol_errors_total", count(PROTOCOL_ERRORS));
+        describe(out, "fileserver_start_time_seconds", "gauge", "When the server started, in Unix time.");
+        sample(out, "fileserver_start_time_seconds",
+               std::chrono::duration<double>(started.time_since_epoch()).count());
+    }
+};
+
+// A minimal HTTP/1.0 server on a loopback port answering GET /metrics from
+// a thread of its own. Scrapes are rare, so each is served in turn.
+class MetricsEndpoint {
+private:
+    int listen_fd;
+    std::thread thread;
+    std::atomic<bool> stopping;
+    std::function<void(std::string&)> render;
+
+    static bool sendAll(int fd, const std::string& data) {
+        size_t sent = 0;
+        while (sent < data.size()) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return false;
+            }
+            sent += n;
+        }
+        return true;
+    }
+
+    void answer(int fd) {
+        struct timeval timeout = {METRICS_TIMEOUT_MS / 1000, (METRICS_TIMEOUT_MS % 1000) * 1000};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+        std::string request;
+        char buffer[1024];
+        while (request.find("\r\n\r\n") == std::string::npos && request.find("\n\n") == std::string::npos &&
+               request.size() < METRICS_REQUEST_MAX) {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n <= 0) {
+                return;
+            }
+            request.append(buffer, n);
+        }
+
+        std::string line = request.substr(0, request.find_first_of("\r\n"));
+        std::string status = "200 OK";
+        std::string body;
+        if (line.compare(0, 4, "GET ") != 0) {
+            status = "405 Method Not Allowed";
+            body = "Only GET is supported\n";
+        } else if (line.compare(4, 9, "/metrics ") == 0 || line.compare(4, 9, "/metrics?") == 0) {
+            render(body);
+        } else {
+            status = "404 Not Found";
+            body = "Metrics are at /metrics\n";
+        }
+
+        std::string reply = "HTTP/1.0 " + status + "\r\n"
+                            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                            "Content-Length: " + std::to_string(body.size()) + "\r\n"
+                            "Connection: close\r\n\r\n";
+        sendAll(fd, reply + body);
+    }
+
+    void serve() {
+        while (!stopping) {
+            int fd = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (stopping || errno == EINVAL) {
+                    return; // Listener shut down
+                }
+                if (errno != EINTR && errno != ECONNABORTED) {
+                    perror("Metrics accept failed");
+                    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+                }
+                continue;
+            }
+            answer(fd);
+            close(fd);
+        }
+    }
+
+public:
+    MetricsEndpoint() : listen_fd(-1), stopping(false) {}
+
+    MetricsEndpoint(const MetricsEndpoint&) = delete;
+    MetricsEndpoint& operator=(const MetricsEndpoint&) = delete;
+
+    ~MetricsEndpoint() {
+        stop();
+    }
+
+    // Listens on 127.0.0.1:port; page fills in the response body per scrape
+    bool start(uint16_t port, std::function<void(std::string&)> page) {
+        listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_fd < 0) {
+            return false;
+        }
+        int opt = 1;
+        setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+
+        struct sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+        if (bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0 || listen(listen_fd, 16) < 0) {
+            close(listen_fd);
+            listen_fd = -1;
+            return false;
+        }
+
+        render = std::move(page);
+        thread = std::thread(&MetricsEndpoint::serve, this);
+        return true;
+    }
+
+    void stop() {
+        stopping = true;
+        if (thread.joinable()) {
+            shutdown(listen_fd, SHUT_RDWR);
+            thread.join();
+        }
+        if (listen_fd >= 0) {
+            close(listen_fd);
+            listen_fd = -1;
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,185 @@
+// protocol.h - Length-prefixed binary framing shared by client and server
+//
+// After the text welcome banner a client may send "PROTO BINARY <version>".
+// If the server answers "OK PROTO <version>", everything that follows on the
+// connection in both directions is a sequence of frames:
+//
+//   0      1        2     3      4            8                   16
+//   +------+--------+-----+------+------------+-------------------+---------
+//   | 0xF5 | version| type| flags| request id |  payload length   | payload
+//   +------+--------+-----+------+------------+-------------------+---------
+//
+// All integers are big-endian. Control frames carry the same text the text
+// protocol uses (commands, replies, FILESIZE/FILENAME metadata); DATA frames
+// carry raw file bytes and may be arbitrarily large.
+//
+// Every reply carries the request id of the command it answers. A COMMAND
+// with FLAG_PIPELINED skips the READY handshakes, so a client can keep many
+// requests in flight and match completions by id:
+//   DOWNLOAD <file>         -> METADATA, DATA..., END   (or an error RESPONSE)
+//   UPLOAD <file> <size>    <- followed at once by DATA frames, then RESPONSE
+// Pipelined downloads are interleaved in slices, so small files finish
+// first and INFO/LIST replies are not stuck behind a large transfer.
+//
+// The END frame of a download carries "CRC32C:<hex>" over the bytes sent
+// (see checksum.h). An upload COMMAND flagged FLAG_CHECKSUM promises the same
+// trailer in an END frame after its data; the server verifies it before the
+// file is published.
+//
+// A server that can't take another connection sends "BUSY <ms> <reason>"
+// in place of the welcome banner and closes; the client should wait <ms>
+// milliseconds before connecting again.
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#define FRAME_MAGIC 0xF5
+#define PROTOCOL_VERSION 1
+#define FRAME_HEADER_SIZE 16
+#define MAX_CONTROL_PAYLOAD (1024 * 1024)
+#define PROTO_REQUEST "PROTO BINARY"
+#define PROTO_ACCEPTED "OK PROTO"
+#define BUSY_REPLY "BUSY"
+
+enum FrameType : uint8_t {
+    FRAME_COMMAND = 1,   // client -> server: one text command
+    FRAME_RESPONSE = 2,  // server -> client: complete text reply
+    FRAME_METADATA = 3,  // FILESIZE/FILENAME/START block for a transfer
+    FRAME_READY = 4,     // Transfer acknowledgement, either direction
+    FRAME_DATA = 5,      // Raw file bytes
+    FRAME_END = 6,       // End of a transfer, with its checksum trailer
+    FRAME_ERROR = 7,     // Protocol violation; the sender closes afterwards
+    FRAME_TYPE_MAX = FRAME_ERROR
+};
+
+enum FrameFlags : uint8_t {
+    FLAG_PIPELINED = 0x01,  // COMMAND: no READY round trips for this request
+    FLAG_CHECKSUM = 0x02    // COMMAND: an upload whose data is followed by a checksum trailer
+};
+
+struct FrameHeader {
+    uint8_t type;
+    uint8_t flags;
+    uint32_t request_id;
+    uint64_t length;
+};
+
+inline void encodeFrameHeader(char* out, const FrameHeader& header) {
+    unsigned char* p = reinterpret_cast<unsigned char*>(out);
+    p[0] = FRAME_MAGIC;
+    p[1] = PROTOCOL_VERSION;
+    p[2] = header.type;
+    p[3] = header.flags;
+    for (int i = 0; i < 4; i++) {
+        p[4 + i] = (header.request_id >> (24 - 8 * i)) & 0xFF;
+    }
+    for (int i = 0; i < 8; i++) {
+        p[8 + i] = (header.length >> (56 - 8 * i)) & 0xFF;
+    }
+}
+
+// Returns false if the bytes are not a frame header this build understands
+inline bool decodeFrameHeader(const char* in, FrameHeader& header) {
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(in);
+    if (p[0] != FRAME_MAGIC || p[1] != PROTOCOL_VERSION ||
+        p[2] == 0 || p[2] > FRAME_TYPE_MAX) {
+        return false;
+    }
+    header.type = p[2];
+    header.flags = p[3];
+    header.request_id = 0;
+    for (int i = 0; i < 4; i++) {
+        header.request_id = (header.request_id << 8) | p[4 + i];
+    }
+    header.length = 0;
+    for (int i = 0; i < 8; i++) {
+        header.length = (header.length << 8) | p[8 + i];
+    }
+    return true;
+}
+
+// Appends a complete frame to an output buffer
+inline void appendFrame(std::string& out, uint8_t type, uint8_t flags, uint32_t request_id,
+                        const char* payload, size_t length) {
+    char header_bytes[FRAME_HEADER_SIZE];
+    encodeFrameHeader(header_bytes, {type, flags, request_id, length});
+    out.append(header_bytes, FRAME_HEADER_SIZE);
+    out.append(payload, length);
+}
+
+inline void appendFrame(std::string& out, uint8_t type, uint8_t flags, uint32_t request_id,
+                        const std::string& payload) {
+    appendFrame(out, type, flags, request_id, payload.data(), payload.size());
+}
+
+// Incremental frame parser. It never owns or copies bytes: the caller keeps
+// its own receive buffer, hands the front of it to readHeader(), and then
+// reports how much payload it consumed, either from that buffer or straight
+// off the socket (e.g. via splice()). Large DATA payloads can therefore be
+// streamed without ever being buffered whole.
+class FrameParser {
+private:
+    FrameHeader header;
+    uint64_t payload_left;
+    bool in_frame;
+
+public:
+    enum class Status { NEED_MORE, HEADER, INVALID };
+
+    FrameParser() : header{0, 0, 0, 0}, payload_left(0), in_frame(false) {}
+
+    // Decodes a header from the front of data; consumed is set on HEADER
+    Status readHeader(const char* data, size_t len, size_t& consumed) {
+        if (len < FRAME_HEADER_SIZE) {
+            return Status::NEED_MORE;
+        }
+        if (!decodeFrameHeader(data, header)) {
+            return Status::INVALID;
+        }
+        consumed = FRAME_HEADER_SIZE;
+        payload_left = header.length;
+        in_frame = true;
+        return Status::HEADER;
+    }
+
+    bool inFrame() const {
+        return in_frame;
+    }
+
+    const FrameHeader& current() const {
+        return header;
+    }
+
+    uint64_t payloadLeft() const {
+        return payload_left;
+    }
+
+    // Marks payload bytes as handled; the frame ends when none are left
+    void consumePayload(uint64_t n) {
+        payload_left -= (n < payload_left) ? n : payload_left;
+        if (payload_left == 0) {
+            in_frame = false;
+        }
+    }
+
+    void reset() {
+        payload_left = 0;
+        in_frame = false;
+    }
+};
+
+// Milliseconds a BUSY banner asks the client to wait, or -1 if banner is
+// not a BUSY reply
+inline long busyRetryMs(const std::string& banner) {
+    if (banner.compare(0, sizeof(BUSY_REPLY), BUSY_REPLY " ") != 0) {
+        return -1;
+    }
+    long ms = strtol(banner.c_str() + sizeof(BUSY_REPLY), nullptr, 10);
+    return ms > 0 ? ms : 0;
+}
+
+#endif
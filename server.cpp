@@ -7,65 +7,406 @@
 #include <arpa/inet.h>
 #include <dirent.h>
 #include <sys/stat.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <fcntl.h>
+#include <fnmatch.h>
+#include <cerrno>
+#include <csignal>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <sstream>
 #include <iomanip>
 #include <fstream>
 #include <map>
+#include <memory>
+#include <deque>
+#include <unordered_map>
 #include <ctime>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include "worker_pool.h"
+#include "protocol.h"
+#include "activity_log.h"
+#include "dir_cache.h"
+#include "chunk_store.h"
+#include "delta.h"
+#include "compression.h"
+#include "checksum.h"
+#include "io_ring.h"
+#include "buffer_pool.h"
+#include "file_cache.h"
+#include "archive.h"
+#include "user_store.h"
+#include "shaper.h"
+#include "admission.h"
+#include "metrics.h"
+#include "trace.h"
 
 #define PORT 8080
 #define BUFFER_SIZE 4096
 #define SHARED_DIR "./shared_files"
-#define CHUNK_SIZE 4096
+#define CHUNK_STORE_DIR "./chunk_store"
 #define LOG_FILE "./server.log"
+#define TRACE_FILE "./trace.json"
+#define DEFAULT_LOG_MAX_MB 64
+#define DEFAULT_CACHE_MB 64
 #define USERS_FILE "./users.txt"
+#define TOKEN_KEY_FILE "./session.key"
+#define MAX_EVENTS 256
+#define MAX_INPUT_BUFFER (1024 * 1024)
+#define SENDFILE_BATCH (4 * 1024 * 1024)
+#define SPLICE_PIPE_SIZE (1024 * 1024)
+#define PIPELINE_SLICE (256 * 1024)
+#define MAX_PIPELINE_DEPTH 64
+#define PARTIAL_SUFFIX ".part"
+#define LIST_CHUNK 512              // Entries per streamed LIST frame
+#define SIGNATURE_STEP (4 * 1024 * 1024)  // Basis bytes hashed per SIGNATURES frame
+#define ARCHIVE_BATCH (256 * 1024)        // MGET archive bytes packed per DATA frame
+#define OUTBUF_RETAIN (1024 * 1024)       // Larger output buffers are freed once flushed
+#define RING_ENTRIES 8                 // Per-worker io_uring: a transfer has at most two requests queued
+#define RING_BUFFER (256 * 1024)       // Each of a worker's two registered transfer buffers
+#define ACCEPT_BATCH 16                // Accept requests kept posted on the io_uring listener
+#define ACCEPT_BACKOFF_MS 100          // Pause after accept() fails for want of descriptors or memory
+#define LISTEN_BACKLOG 65535           // Per acceptor; the kernel caps it at net.core.somaxconn
+#define MAX_DEFAULT_ACCEPTORS 4        // Default acceptor threads: one per core up to this
+#define DEFAULT_MAX_SESSIONS 4096
+#define DEFAULT_MAX_PER_IP 512
+#define FD_RESERVE 64                  // Descriptors kept back from sessions for logs, caches and rings
+#define DEFAULT_METRICS_PORT 9180      // Prometheus scrape port on 127.0.0.1
 
-struct FileInfo {
+struct ServerConfig {
+    size_t workers;
+    bool use_sendfile;
+    bool use_splice;
+    size_t log_max_bytes;   // Rotate server.log past this size; 0 = never
+    bool log_fsync;         // fdatasync() the log after every batch
+    bool dedup;             // Store uploads as deduplicated chunks
+    bool compress;          // Accept COMPRESS from clients
+    bool io_uring;          // Accept and move transfer data through io_uring
+    size_t cache_bytes;     // Memory for hot files served without disk I/O; 0 = no cache
+    double rate_limit;      // Bytes per second for all transfers together; 0 = unlimited
+    double user_rate;       // Bytes per second per user, times the user's weight; 0 = unlimited
+    double conn_rate;       // Bytes per second per connection; 0 = unlimited
+    size_t acceptors;       // Threads accepting connections, each on its own SO_REUSEPORT listener
+    size_t max_sessions;    // Connections beyond this are refused with BUSY; 0 = unlimited
+    size_t max_per_ip;      // Same, per client address
+    int metrics_port;       // Loopback port serving /metrics; 0 = off
+    unsigned trace_sample;  // Trace one DOWNLOAD/UPLOAD in this many; 0 = off
+    std::string trace_file;
+
+    ServerConfig()
+        : workers(std::thread::hardware_concurrency()), use_sendfile(true), use_splice(true),
+          log_max_bytes(static_cast<size_t>(DEFAULT_LOG_MAX_MB) * 1024 * 1024), log_fsync(false),
+          dedup(false), compress(true), io_uring(false),
+          cache_bytes(static_cast<size_t>(DEFAULT_CACHE_MB) * 1024 * 1024), rate_limit(0), user_rate(0),
+          conn_rate(0),
+          acceptors(std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), MAX_DEFAULT_ACCEPTORS)),
+          max_sessions(DEFAULT_MAX_SESSIONS), max_per_ip(DEFAULT_MAX_PER_IP), metrics_port(DEFAULT_METRICS_PORT),
+          trace_sample(0), trace_file(TRACE_FILE) {}
+};
+
+// Outcome of moving a slice of a transfer between the socket and the file
+enum class PumpStatus {
+    DONE,         // Whole file sent
+    BLOCKED,      // Socket buffer full; resume on EPOLLOUT
+    FAILED,       // Connection error
+    UNSUPPORTED   // sendfile()/splice()/io_uring not available for this file/socket pair
+};
+
+// What a completion on a worker's io_uring belongs to
+enum RingRequest : uint64_t {
+    RING_READ = 1,
+    RING_SEND,
+    RING_RECV,
+    RING_WRITE
+};
+
+#define ACCEPT_RETRY (1ULL << 32)      // Accept ring user_data: back-off timer of a slot
+
+// Where a connection currently is in the LOGIN/LIST/INFO/DOWNLOAD/UPLOAD flow
+enum class SessionState {
+    AWAIT_COMMAND,          // Waiting for a newline-terminated command
+    AWAIT_DOWNLOAD_READY,   // Metadata sent, waiting for the client's READY
+    SENDING_FILE,           // Streaming file data as the socket drains
+    AWAIT_UPLOAD_METADATA,  // Waiting for FILESIZE/FILENAME/START
+    RECEIVING_FILE,         // Writing incoming bytes to the target file
+    AWAIT_UPLOAD_TRAILER,   // All bytes written, waiting for the END frame with their checksum
+    RECEIVING_ARCHIVE,      // Unpacking an MPUT archive into the shared directory
+    CLOSING                 // Flushing the last reply before closing
+};
+
+// A pipelined download, streamed as a series of DATA frames
+struct Transfer {
+    uint32_t request_id;
+    int file_fd;
+    long file_end;          // End of the requested byte range
+    long file_offset;
     std::string name;
-    long size;
-    bool is_directory;
-    std::string permissions;
+    std::unique_ptr<ChunkedFile> chunked;   // Set when file_fd is a chunk manifest
+    Codec encoding;                         // Slices go out as compressed blocks
+    uint32_t crc;                           // CRC32C of the bytes sent so far
+    std::shared_ptr<const CachedFile> cached;   // Sent from memory; file_fd is -1 and crc is preset
+    std::unique_ptr<RequestTrace> trace;        // Set when this download is sampled (see trace.h)
 };
 
-struct User {
-    std::string username;
-    std::string password;
-    bool can_upload;
-    bool can_download;
+// SIGNATURES reply being produced: the basis is hashed a step at a time as
+// the socket drains, so a large file never stalls the worker for long
+struct SignatureJob {
+    uint32_t request_id;
+    int file_fd;
+    std::unique_ptr<ChunkedFile> chunked;
+    long file_size;
+    size_t block_size;
+    long file_offset;
+    std::string name;
+
+    ~SignatureJob() {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+    }
 };
 
-class FileServer {
-private:
-    int server_fd;
-    int client_socket;
-    struct sockaddr_in address;
-    int addrlen;
-    std::map<std::string, User> users;
+// MGET reply being produced: the matching files are packed one after the
+// other into DATA frames (see archive.h), a batch at a time as the socket
+// drains, so thousands of small files go out as one continuous stream
+struct ArchiveJob {
+    uint32_t request_id;
+    std::vector<std::string> names;     // Matches, in name order
+    size_t next;                        // Next name to open
+    size_t packed;                      // Entries sent whole
+    long bytes;                         // File bytes packed so far
+
+    bool in_entry;                      // An entry's header is out, its trailer is not
+    std::string name;
+    int file_fd;
+    std::unique_ptr<ChunkedFile> chunked;
+    std::shared_ptr<const CachedFile> cached;   // Packed from memory instead of file_fd
+    long file_size;
+    long file_offset;
+    uint32_t crc;
+
+    ArchiveJob()
+        : request_id(0), next(0), packed(0), bytes(0), in_entry(false), file_fd(-1),
+          file_size(0), file_offset(0), crc(0) {}
+
+    ~ArchiveJob() {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+    }
+};
+
+// An MPUT upload: an archive (see archive.h) unpacked as its DATA frames
+// arrive. Each entry goes to its own partial file and is committed on its
+// own once its checksum matches, so one bad file doesn't sink the batch.
+struct UploadBatch {
+    uint32_t request_id;
+    ArchiveReader reader;
+
+    std::string name;                   // Entry being received, or the last one if in_entry is clear
+    bool in_entry;                      // Between an entry's header and its end
+    int file_fd;
+    std::unique_ptr<ChunkWriter> chunk_writer;
+    long file_size;
+    long file_offset;
+    std::string error;                  // Why the entry can't be kept; its bytes are dropped
+
+    std::string results;                // One summary line per entry
+    size_t committed;
+    size_t failed;
+    long bytes;                         // Bytes of committed entries
+
+    UploadBatch()
+        : request_id(0), in_entry(false), file_fd(-1), file_size(0), file_offset(0), committed(0), failed(0),
+          bytes(0) {}
+
+    ~UploadBatch() {
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+    }
+};
+
+// A PATCH upload: the new file is rebuilt from literal bytes in the delta
+// stream and block copies out of the current version (the basis)
+struct DeltaPatch {
+    int basis_fd;
+    std::unique_ptr<ChunkedFile> basis_chunked;
+    long basis_size;
+    size_t block_size;
+    DeltaDecoder decoder;
+    long copied;            // Bytes taken from the basis
+
+    ~DeltaPatch() {
+        if (basis_fd >= 0) {
+            close(basis_fd);
+        }
+    }
+};
+
+// Per-connection state; every socket registered with epoll owns one.
+// Sockets are armed EPOLLONESHOT, so at most one worker touches a session
+// at any time and its fields need no locking.
+struct Session {
+    int socket_fd;
+    std::string client_ip;
     bool is_authenticated;
     std::string current_user;
-    std::string client_ip;
+    SessionState state;
 
-    void logActivity(const std::string& activity) {
-        std::ofstream logfile(LOG_FILE, std::ios::app);
-        if (logfile.is_open()) {
-            time_t now = time(0);
-            char* dt = ctime(&now);
-            std::string timestamp(dt);
-            timestamp.pop_back(); // Remove newline
-            
-            logfile << "[" << timestamp << "] "
-                   << "[" << client_ip << "] "
-                   << "[" << (is_authenticated ? current_user : "ANONYMOUS") << "] "
-                   << activity << std::endl;
-            logfile.close();
+    bool binary;            // Negotiated framed protocol instead of text lines
+    FrameParser parser;     // Framing state when binary is set
+    uint32_t request_id;    // Request replies are tagged with
+    bool reply_failed;      // An ERROR reply was queued for the current command
+    bool pipelined;         // Current request carries FLAG_PIPELINED
+    bool checksummed;       // Current request carries FLAG_CHECKSUM
+    bool discarding;        // Skip DATA frames of a rejected pipelined upload
+    uint32_t discard_id;
+    Codec codec;            // Negotiated with COMPRESS; CODEC_NONE = never compress
+
+    std::deque<Transfer> pipeline;   // Pipelined downloads, served round-robin
+    char slice_header[FRAME_HEADER_SIZE];
+    size_t slice_header_sent;
+    long slice_left;                 // Payload still owed for the front transfer
+    bool slice_active;               // A DATA frame is partly on the wire
+
+    bool listing;                    // A paged LIST is being streamed
+    uint32_t listing_id;
+    PageQuery listing_query;         // Its cursor advances chunk by chunk
+    size_t listing_left;             // Entries still allowed by the page size
+    size_t listing_sent;
+
+    std::unique_ptr<SignatureJob> signing;      // SIGNATURES being streamed
+    std::unique_ptr<ArchiveJob> archive;        // MGET being streamed
+    std::unique_ptr<UploadBatch> batch;         // MPUT being unpacked
+
+    std::string inbuf;      // Bytes received but not yet consumed
+    std::string outbuf;     // Bytes queued for the client
+    size_t out_offset;      // How much of outbuf has been sent
+
+    int file_fd;            // File being downloaded or uploaded
+    long file_size;         // Where the transfer ends: upload size, end of a download range
+    long file_offset;
+    std::string transfer_name;
+    std::unique_ptr<ChunkedFile> chunked;       // Download of a deduplicated file
+    std::unique_ptr<ChunkWriter> chunk_writer;  // Upload being split into chunks
+    std::unique_ptr<DeltaPatch> delta;          // Upload rebuilt from a delta
+    std::shared_ptr<const CachedFile> cached;   // Download sent from memory; crc is preset
+    Codec encoding;         // Transfer's DATA frames are compressed blocks
+    uint32_t crc;           // CRC32C of the transfer's bytes so far
+    bool use_sendfile;      // Cleared if the kernel refuses sendfile()
+    bool use_splice;        // Cleared if the kernel refuses splice()
+    bool use_ring;          // Cleared if io_uring refuses the transfer
+    IoRing* ring;           // Ring of the worker servicing the session (io_uring engine)
+    size_t worker;          // Worker servicing the session right now
+    BufferPool::Lease buffer;    // Pool buffer lent for the current service call
+    std::string reply;      // Replies are composed here; keeps its capacity between requests
+    int pipe_fds[2];        // socket -> pipe -> file staging for splice()
+    size_t pipe_capacity;
+
+    size_t home_worker;     // Worker whose queue receives this session's events
+    ShapedFlow flow;        // Bandwidth accounting (see shaper.h)
+    long parked_ms;         // Set when the shaper held a transfer back; wake up after this long
+    std::unique_ptr<RequestTrace> trace;    // DOWNLOAD/UPLOAD being traced (see trace.h)
+    RequestTrace* tracing;  // Trace of the transfer being moved right now; null if untraced
+
+    Session(int fd, const std::string& ip)
+        : socket_fd(fd), client_ip(ip), is_authenticated(false), current_user(""),
+          state(SessionState::AWAIT_COMMAND), binary(false), request_id(0), reply_failed(false),
+          pipelined(false), checksummed(false), discarding(false), discard_id(0), codec(CODEC_NONE),
+          slice_header_sent(0), slice_left(0), slice_active(false),
+          listing(false), listing_id(0), listing_query(), listing_left(0), listing_sent(0), out_offset(0),
+          file_fd(-1), file_size(0), file_offset(0), encoding(CODEC_NONE), crc(0), use_sendfile(false),
+          use_splice(false), use_ring(false), ring(nullptr), worker(0), pipe_fds{-1, -1},
+          pipe_capacity(0), home_worker(0), parked_ms(0), tracing(nullptr) {}
+
+    ~Session() {
+        if (file_fd >= 0) {
+            close(file_fd);
         }
+        for (const auto& transfer : pipeline) {
+            if (transfer.file_fd >= 0) {
+                close(transfer.file_fd);
+            }
+        }
+        if (pipe_fds[0] >= 0) {
+            close(pipe_fds[0]);
+            close(pipe_fds[1]);
+        }
+        if (socket_fd >= 0) {
+            close(socket_fd);
+        }
+    }
+};
+
+// One epoll notification handed from the event loop to a worker
+struct SessionEvent {
+    Session* session;
+    uint32_t events;
+};
+
+// Where a posted io_uring accept writes the peer's address
+struct AcceptSlot {
+    struct sockaddr_in addr;
+    socklen_t addr_len;
+};
+
+// A thread accepting connections on a listening socket of its own. All
+// acceptors bind the same port with SO_REUSEPORT, and the kernel spreads
+// incoming connections over their backlogs.
+struct Acceptor {
+    int listen_fd;
+    std::vector<AcceptSlot> slots;
+    std::unique_ptr<IoRing> ring;       // io_uring engine; declared after its slots so it is closed first
+    std::thread thread;
+
+    Acceptor() : listen_fd(-1) {}
+
+    ~Acceptor() {
+        if (listen_fd >= 0) {
+            close(listen_fd);
+        }
+    }
+};
+
+class FileServer {
+private:
+    int epoll_fd;
+    ServerConfig config;
+    UserStore users;
+    DirectoryCache dir_cache;
+    FileCache file_cache;
+    TransferShaper shaper;
+    AdmissionControl admission;
+    Metrics metrics;
+    MetricsEndpoint metrics_endpoint;
+    TraceLog tracer;            // Declared before sessions, whose traces are written as they go
+    ChunkStore chunk_store;
+    ActivityLog activity_log;   // Declared before pool so workers stop first
+    std::unordered_map<int, std::unique_ptr<Session>> sessions;
+    std::mutex sessions_lock;
+    std::unique_ptr<WorkerPool<SessionEvent>> pool;
+    std::unique_ptr<BufferPool> buffer_pool;    // Transfer buffers, recycled per worker
+    std::atomic<size_t> next_worker;
+    std::vector<std::unique_ptr<IoRing>> worker_rings;   // One per pool worker (io_uring engine)
+    std::vector<std::unique_ptr<Acceptor>> acceptors;
+    std::atomic<bool> stopping;
+
+    // Queues a log line; the file is written by the logger's own thread
+    void logActivity(const Session& session, const std::string& activity) {
+        activity_log.append(session.client_ip,
+                            session.is_authenticated ? session.current_user : "ANONYMOUS",
+                            activity);
     }
 
-    void loadUsers() {
-        std::ifstream userfile(USERS_FILE);
-        if (!userfile.is_open()) {
+    bool loadUsers() {
+        struct stat st;
+        if (stat(USERS_FILE, &st) != 0) {
             // Create default users file
             std::ofstream outfile(USERS_FILE);
             if (outfile.is_open()) {
@@ -76,52 +417,31 @@ private:
                 std::cout << "✓ Created default users file" << std::endl;
                 std::cout << "  Default users: admin/admin123, user/user123, uploader/upload123" << std::endl;
             }
-            userfile.open(USERS_FILE);
         }
 
-        if (userfile.is_open()) {
-            std::string line;
-            while (std::getline(userfile, line)) {
-                std::istringstream iss(line);
-                std::string username, password, upload, download;
-                
-                if (std::getline(iss, username, ':') &&
-                    std::getline(iss, password, ':') &&
-                    std::getline(iss, upload, ':') &&
-                    std::getline(iss, download)) {
-                    
-                    User user;
-                    user.username = username;
-                    user.password = password;
-                    user.can_upload = (upload == "1");
-                    user.can_download = (download == "1");
-                    
-                    users[username] = user;
-                }
-            }
-            userfile.close();
-            std::cout << "✓ Loaded " << users.size() << " users" << std::endl;
+        if (!users.open(USERS_FILE, TOKEN_KEY_FILE)) {
+            return false;
         }
+        std::cout << "✓ Loaded " << users.size() << " users (reloaded when " << USERS_FILE << " changes)"
+                  << std::endl;
+        return true;
     }
 
-    bool authenticateUser(const std::string& username, const std::string& password) {
-        auto it = users.find(username);
-        if (it != users.end() && it->second.password == password) {
-            current_user = username;
-            is_authenticated = true;
-            logActivity("LOGIN SUCCESS");
-            return true;
-        }
-        logActivity("LOGIN FAILED - User: " + username);
-        return false;
+    // Copies a user record out of the current table; false if unknown
+    bool lookupUser(const std::string& username, User& user) {
+        return users.lookup(username, user);
     }
 
-    long getFileSize(const std::string& filepath) {
-        struct stat st;
-        if (stat(filepath.c_str(), &st) == 0) {
-            return st.st_size;
+    bool authenticateUser(Session& session, const std::string& username, const std::string& password) {
+        User user;
+        if (lookupUser(username, user) && user.password == password) {
+            session.current_user = username;
+            session.is_authenticated = true;
+            logActivity(session, "LOGIN SUCCESS");
+            return true;
         }
-        return 0;
+        logActivity(session, "LOGIN FAILED - User: " + username);
+        return false;
     }
 
     std::string formatFileSize(long bytes) {
@@ -139,91 +459,113 @@ private:
         return oss.str();
     }
 
-    std::string getPermissions(const std::string& filepath) {
-        struct stat st;
-        if (stat(filepath.c_str(), &st) != 0) {
-            return "?????????";
-        }
-        
-        std::string perms = "";
-        perms += (S_ISDIR(st.st_mode)) ? 'd' : '-';
-        perms += (st.st_mode & S_IRUSR) ? 'r' : '-';
-        perms += (st.st_mode & S_IWUSR) ? 'w' : '-';
-        perms += (st.st_mode & S_IXUSR) ? 'x' : '-';
-        perms += (st.st_mode & S_IRGRP) ? 'r' : '-';
-        perms += (st.st_mode & S_IWGRP) ? 'w' : '-';
-        perms += (st.st_mode & S_IXGRP) ? 'x' : '-';
-        perms += (st.st_mode & S_IROTH) ? 'r' : '-';
-        perms += (st.st_mode & S_IWOTH) ? 'w' : '-';
-        perms += (st.st_mode & S_IXOTH) ? 'x' : '-';
-        
-        return perms;
+    static bool isPartialName(const std::string& name) {
+        size_t suffix = strlen(PARTIAL_SUFFIX);
+        return name.size() > suffix && name.compare(name.size() - suffix, suffix, PARTIAL_SUFFIX) == 0;
     }
 
-    std::vector<FileInfo> listFiles() {
-        std::vector<FileInfo> files;
-        DIR* dir = opendir(SHARED_DIR);
-        
-        if (!dir) {
-            return files;
+    // Parses a non-negative byte count or offset; an empty argument is left alone
+    static bool parseByteCount(const std::string& arg, long& value) {
+        if (arg.empty()) {
+            return true;
         }
-        
-        struct dirent* entry;
-        while ((entry = readdir(dir)) != nullptr) {
-            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
-                continue;
-            }
-            
-            FileInfo info;
-            info.name = entry->d_name;
-            
-            std::string fullpath = std::string(SHARED_DIR) + "/" + entry->d_name;
-            info.size = getFileSize(fullpath);
-            info.is_directory = (entry->d_type == DT_DIR);
-            info.permissions = getPermissions(fullpath);
-            
-            files.push_back(info);
+        char* end = nullptr;
+        errno = 0;
+        long parsed = strtol(arg.c_str(), &end, 10);
+        if (errno != 0 || *end != '\0' || parsed < 0) {
+            return false;
         }
-        
-        closedir(dir);
-        return files;
+        value = parsed;
+        return true;
     }
 
-    void handleLogin(const std::string& credentials) {
+    void handleLogin(Session& session, const std::string& credentials) {
         std::istringstream iss(credentials);
         std::string username, password;
         
         if (std::getline(iss, username, ':') && std::getline(iss, password)) {
-            if (authenticateUser(username, password)) {
-                std::ostringstream response;
-                response << "OK\n";
-                response << "Login successful! Welcome, " << current_user << "\n";
-                response << "Permissions:\n";
-                response << "  - Upload: " << (users[current_user].can_upload ? "YES" : "NO") << "\n";
-                response << "  - Download: " << (users[current_user].can_download ? "YES" : "NO") << "\n";
-                sendMessage(response.str());
-                std::cout << "✓ User authenticated: " << current_user << std::endl;
+            if (authenticateUser(session, username, password)) {
+                User user;
+                lookupUser(session.current_user, user);
+                shaper.bind(session.flow, user.username, user.weight);
+                std::string& response = startReply(session);
+                response += "OK\n";
+                response += "Login successful! Welcome, " + session.current_user + "\n";
+                response += "Permissions:\n";
+                response += std::string("  - Upload: ") + (user.can_upload ? "YES" : "NO") + "\n";
+                response += std::string("  - Download: ") + (user.can_download ? "YES" : "NO") + "\n";
+                response += "TOKEN:" + users.issueToken(user) + "\n";
+                sendMessage(session, response);
+                std::cout << "✓ User authenticated: " << session.current_user << std::endl;
             } else {
-                sendMessage("ERROR: Invalid username or password\n");
+                sendMessage(session, "ERROR: Invalid username or password\n");
                 std::cout << "✗ Authentication failed" << std::endl;
             }
         } else {
-            sendMessage("ERROR: Invalid login format\n");
+            sendMessage(session, "ERROR: Invalid login format\n");
+        }
+    }
+
+    // AUTH <token>: resumes a session on a new connection with a token from
+    // an earlier LOGIN, so short-lived connections skip the password check
+    void handleAuth(Session& session, const std::string& token) {
+        User user;
+        if (!users.verifyToken(token, user)) {
+            sendMessage(session, "ERROR: Invalid or expired token\n");
+            logActivity(session, "TOKEN REJECTED");
+            return;
         }
+        session.current_user = user.username;
+        session.is_authenticated = true;
+        shaper.bind(session.flow, user.username, user.weight);
+        logActivity(session, "TOKEN LOGIN");
+
+        std::string& response = startReply(session);
+        response += "OK\n";
+        response += "Session resumed, welcome back " + user.username + "\n";
+        response += "Permissions:\n";
+        response += std::string("  - Upload: ") + (user.can_upload ? "YES" : "NO") + "\n";
+        response += std::string("  - Download: ") + (user.can_download ? "YES" : "NO") + "\n";
+        sendMessage(session, response);
     }
 
-    void handleList() {
-        if (!is_authenticated) {
-            sendMessage("ERROR: Authentication required\n");
-            logActivity("UNAUTHORIZED ACCESS - LIST");
+    // LIST with no options returns the whole cached table. Any option
+    // switches to a paged stream of one tab-separated line per entry:
+    //   LIST [sort=name|size|mtime] [desc] [match=<glob>] [limit=<n>] [after=<cursor>]
+    void handleList(Session& session, const std::string& args) {
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - LIST");
+            return;
+        }
+
+        std::istringstream iss(args);
+        std::string option;
+        if (iss >> option) {
+            startListing(session, args);
             return;
         }
 
-        std::vector<FileInfo> files = listFiles();
+        std::shared_ptr<const Listing> listing = dir_cache.cachedListing(
+            [this](const std::map<std::string, FileInfo>& entries) { return renderListing(entries); });
+        
+        sendMessage(session, listing->text);
+        if (listing->count > 0) {
+            logActivity(session, "LIST - " + std::to_string(listing->count) + " items");
+        }
+    }
+
+    // Builds the LIST reply; only re-run when the directory has changed
+    Listing renderListing(const std::map<std::string, FileInfo>& entries) {
+        std::vector<const FileInfo*> files;
+        for (const auto& entry : entries) {
+            if (!isPartialName(entry.first)) {
+                files.push_back(&entry.second); // Unfinished uploads stay hidden
+            }
+        }
         
         if (files.empty()) {
-            sendMessage("ERROR: No files in shared directory\n");
-            return;
+            return {"ERROR: No files in shared directory\n", 0};
         }
         
         std::ostringstream response;
@@ -236,407 +578,3224 @@ private:
                  << "Permissions\n";
         response << std::string(70, '-') << "\n";
         
-        for (const auto& file : files) {
-            response << std::left << std::setw(30) << file.name
-                     << std::setw(15) << formatFileSize(file.size)
-                     << std::setw(12) << (file.is_directory ? "[DIR]" : "[FILE]")
-                     << file.permissions << "\n";
+        for (const FileInfo* file : files) {
+            response << std::left << std::setw(30) << file->name
+                     << std::setw(15) << formatFileSize(file->size)
+                     << std::setw(12) << (file->is_directory ? "[DIR]" : "[FILE]")
+                     << file->permissions << "\n";
         }
         
         response << std::string(70, '-') << "\n";
         response << "Total: " << files.size() << " items\n";
         
-        sendMessage(response.str());
-        logActivity("LIST - " + std::to_string(files.size()) + " items");
+        return {response.str(), files.size()};
     }
 
-    void handleInfo(const std::string& filename) {
-        if (!is_authenticated) {
-            sendMessage("ERROR: Authentication required\n");
-            logActivity("UNAUTHORIZED ACCESS - INFO");
-            return;
+    static int64_t sortValue(const FileInfo& info, SortKey sort) {
+        switch (sort) {
+            case SortKey::SIZE:
+                return info.size;
+            case SortKey::MTIME:
+                return info.modified;
+            default:
+                return 0;
         }
+    }
 
-        if (filename.empty()) {
-            sendMessage("ERROR: Filename required\n");
-            return;
+    // Cursor: sort letter, sort value, '/', name of the last entry sent.
+    // '/' can't appear in a file name, so the name is everything after it.
+    static std::string encodeCursor(const PageQuery& query) {
+        const char* letters = "nsm";
+        return letters[static_cast<int>(query.sort)] + std::to_string(query.cursor_key) +
+               "/" + query.cursor_name;
+    }
+
+    static bool decodeCursor(const std::string& cursor, PageQuery& query) {
+        const char* letters = "nsm";
+        size_t slash = cursor.find('/');
+        if (cursor.empty() || slash == std::string::npos ||
+            cursor[0] != letters[static_cast<int>(query.sort)]) {
+            return false;
         }
-        
-        std::string filepath = std::string(SHARED_DIR) + "/" + filename;
-        struct stat st;
-        
-        if (stat(filepath.c_str(), &st) != 0) {
-            sendMessage("ERROR: File not found\n");
+        char* end = nullptr;
+        query.cursor_key = strtoll(cursor.c_str() + 1, &end, 10);
+        if (end != cursor.c_str() + slash) {
+            return false;
+        }
+        query.cursor_name = cursor.substr(slash + 1);
+        query.has_cursor = true;
+        return true;
+    }
+
+    // Parses LIST options and queues the stream; chunks are produced by
+    // continueListing() as the socket drains, so only one is ever buffered
+    void startListing(Session& session, const std::string& args) {
+        PageQuery query;
+        query.sort = SortKey::NAME;
+        query.descending = false;
+        query.has_cursor = false;
+        query.cursor_key = 0;
+        std::string pattern, cursor;
+        long limit = 0;
+
+        std::istringstream iss(args);
+        std::string option;
+        while (iss >> option) {
+            size_t eq = option.find('=');
+            std::string key = option.substr(0, eq);
+            std::string value = (eq == std::string::npos) ? "" : option.substr(eq + 1);
+
+            bool valid = true;
+            if (key == "sort" && value == "name") {
+                query.sort = SortKey::NAME;
+            } else if (key == "sort" && value == "size") {
+                query.sort = SortKey::SIZE;
+            } else if (key == "sort" && value == "mtime") {
+                query.sort = SortKey::MTIME;
+            } else if (key == "desc" && eq == std::string::npos) {
+                query.descending = true;
+            } else if (key == "match" && !value.empty()) {
+                pattern = value;
+            } else if (key == "limit") {
+                valid = parseByteCount(value, limit) && !value.empty();
+            } else if (key == "after" && !value.empty()) {
+                cursor = value;
+            } else {
+                valid = false;
+            }
+            if (!valid) {
+                sendMessage(session, "ERROR: Invalid LIST option: " + option + "\n");
+                return;
+            }
+        }
+        if (!cursor.empty() && !decodeCursor(cursor, query)) {
+            sendMessage(session, "ERROR: Cursor does not match sort order\n");
             return;
         }
-        
-        std::ostringstream response;
-        response << "OK\n";
-        response << "File Information:\n";
-        response << std::string(40, '-') << "\n";
-        response << "Name:        " << filename << "\n";
-        response << "Size:        " << formatFileSize(st.st_size) << " (" << st.st_size << " bytes)\n";
-        response << "Type:        " << (S_ISDIR(st.st_mode) ? "Directory" : "Regular File") << "\n";
-        response << "Permissions: " << getPermissions(filepath) << "\n";
-        response << std::string(40, '-') << "\n";
-        
-        sendMessage(response.str());
-        logActivity("INFO - " + filename);
+
+        // The literal start of the pattern lets a name-sorted walk skip ahead
+        query.prefix = pattern.substr(0, pattern.find_first_of("*?[\\"));
+        query.filter = [pattern](const FileInfo& info) {
+            return !isPartialName(info.name) &&
+                   (pattern.empty() || fnmatch(pattern.c_str(), info.name.c_str(), 0) == 0);
+        };
+
+        session.listing = true;
+        session.listing_id = session.request_id;
+        session.listing_query = std::move(query);
+        session.listing_left = (limit > 0) ? static_cast<size_t>(limit) : SIZE_MAX;
+        session.listing_sent = 0;
     }
 
-    void handleDownload(const std::string& filename) {
-        if (!is_authenticated) {
-            sendMessage("ERROR: Authentication required\n");
-            logActivity("UNAUTHORIZED ACCESS - DOWNLOAD");
+    // Queues the next chunk of a paged LIST, or its summary once done
+    void continueListing(Session& session) {
+        PageQuery& query = session.listing_query;
+        std::vector<FileInfo> entries;
+        bool more = dir_cache.page(query, std::min<size_t>(LIST_CHUNK, session.listing_left), entries);
+
+        if (!entries.empty()) {
+            std::string chunk;
+            for (const FileInfo& info : entries) {
+                chunk += info.name + "\t" + std::to_string(info.size) + "\t" +
+                         (info.is_directory ? "DIR" : "FILE") + "\t" + info.permissions + "\t" +
+                         std::to_string(info.modified) + "\n";
+            }
+            if (session.binary) {
+                appendFrame(session.outbuf, FRAME_DATA, 0, session.listing_id, chunk);
+            } else {
+                session.outbuf += chunk;
+            }
+
+            query.has_cursor = true;
+            query.cursor_key = sortValue(entries.back(), query.sort);
+            query.cursor_name = entries.back().name;
+            session.listing_sent += entries.size();
+            session.listing_left -= entries.size();
+        }
+        if (more && session.listing_left > 0) {
             return;
         }
 
-        if (!users[current_user].can_download) {
-            sendMessage("ERROR: Permission denied - You cannot download files\n");
-            logActivity("PERMISSION DENIED - DOWNLOAD - " + filename);
+        std::string next = more ? encodeCursor(query) : "";
+        if (session.binary) {
+            std::string summary = "OK\nCOUNT:" + std::to_string(session.listing_sent) + "\n";
+            if (more) {
+                summary += "NEXT:" + next + "\n";
+            }
+            appendFrame(session.outbuf, FRAME_END, 0, session.listing_id, summary);
+        } else {
+            session.outbuf += "END COUNT:" + std::to_string(session.listing_sent) +
+                              (more ? " NEXT:" + next : "") + "\n";
+        }
+        session.listing = false;
+        logActivity(session, "LIST - " + std::to_string(session.listing_sent) + " items (paged)");
+
+        // Commands held back while the stream was running
+        processInput(session);
+    }
+
+    void handleInfo(Session& session, const std::string& filename) {
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - INFO");
             return;
         }
-        
+
         if (filename.empty()) {
-            sendMessage("ERROR: Filename required\n");
+            sendMessage(session, "ERROR: Filename required\n");
             return;
         }
-        
-        std::string filepath = std::string(SHARED_DIR) + "/" + filename;
-        
-        std::ifstream file(filepath, std::ios::binary);
-        if (!file.is_open()) {
-            sendMessage("ERROR: File not found or cannot be opened\n");
+        // Partial uploads are hidden from LIST and never served half-written
+        if (isPartialName(filename)) {
+            sendMessage(session, "ERROR: Reserved file name\n");
             return;
         }
         
-        file.seekg(0, std::ios::end);
-        long filesize = file.tellg();
-        file.seekg(0, std::ios::beg);
-        
-        struct stat st;
-        if (stat(filepath.c_str(), &st) == 0 && S_ISDIR(st.st_mode)) {
-            sendMessage("ERROR: Cannot download directories\n");
-            file.close();
+        FileInfo info;
+        if (!dir_cache.lookup(filename, info)) {
+            sendMessage(session, "ERROR: File not found\n");
             return;
         }
         
-        std::cout << "📤 " << current_user << " downloading: " << filename 
-                  << " (" << formatFileSize(filesize) << ")" << std::endl;
-        
-        std::ostringstream metadata;
-        metadata << "OK\n";
-        metadata << "FILESIZE:" << filesize << "\n";
-        metadata << "FILENAME:" << filename << "\n";
-        metadata << "START\n";
-        sendMessage(metadata.str());
+        std::string& response = startReply(session);
+        response += "OK\n";
+        response += "File Information:\n";
+        response.append(40, '-') += "\n";
+        response += "Name:        " + filename + "\n";
+        response += "Size:        " + formatFileSize(info.size) + " (" + std::to_string(info.size) + " bytes)\n";
+        response += std::string("Type:        ") + (info.is_directory ? "Directory" : "Regular File") + "\n";
+        response += "Permissions: " + info.permissions + "\n";
+        response.append(40, '-') += "\n";
         
-        char ack[10] = {0};
-        read(client_socket, ack, sizeof(ack));
+        sendMessage(session, response);
+        logActivity(session, "INFO - " + filename);
+    }
+
+    // Opens a shared file for reading, through its manifest if it was
+    // deduplicated. Returns the error reply, or an empty string on success.
+    std::string openShared(const std::string& filename, int& fd, std::unique_ptr<ChunkedFile>& chunked,
+                           long& filesize, struct stat& st, RequestTrace* trace = nullptr) {
+        std::string filepath = std::string(SHARED_DIR) + "/" + filename;
         
-        if (strncmp(ack, "READY", 5) != 0) {
-            file.close();
-            return;
+        fd = open(filepath.c_str(), O_RDONLY);
+        if (fd < 0 && errno == ENOENT) {
+            // Deduplicated files are reassembled from their manifest
+            fd = open((filepath + MANIFEST_SUFFIX).c_str(), O_RDONLY);
+            if (fd >= 0) {
+                chunked = std::make_unique<ChunkedFile>(chunk_store, fd);
+                if (!chunked->open()) {
+                    chunked.reset();
+                    close(fd);
+                    fd = -1;
+                }
+            }
+        }
+        if (fd < 0) {
+            return "ERROR: File not found or cannot be opened\n";
         }
         
-        char buffer[CHUNK_SIZE];
-        long bytes_sent = 0;
-        
-        while (!file.eof() && bytes_sent < filesize) {
-            file.read(buffer, CHUNK_SIZE);
-            std::streamsize bytes_read = file.gcount();
-            
-            if (bytes_read > 0) {
-                ssize_t sent = send(client_socket, buffer, bytes_read, 0);
-                if (sent < 0) break;
-                bytes_sent += sent;
+        if (trace) {
+            trace->phase("stat");
+        }
+        if (fstat(fd, &st) != 0 || S_ISDIR(st.st_mode)) {
+            chunked.reset();
+            close(fd);
+            return "ERROR: Cannot download directories\n";
+        }
+        filesize = chunked ? chunked->size() : st.st_size;
+        return "";
+    }
+
+    // Reads an opened shared file into memory and adds it to the hot-file
+    // cache; null if it could not be read whole
+    std::shared_ptr<const CachedFile> cacheFile(const std::string& filename, int fd, ChunkedFile* chunked,
+                                                long filesize, const struct stat& st) {
+        auto file = std::make_shared<CachedFile>();
+        file->data.resize(filesize);
+        for (long offset = 0; offset < filesize;) {
+            ssize_t n = readSource(fd, chunked, offset, &file->data[offset], filesize - offset);
+            if (n <= 0) {
+                return nullptr; // File shrank underneath us
             }
+            offset += n;
+        }
+        file->crc = crc32c(0, file->data.data(), filesize);
+        file->source = std::string(SHARED_DIR) + "/" + filename + (chunked ? MANIFEST_SUFFIX : "");
+        file->identity = st;
+        file_cache.insert(filename, file);
+        return file;
+    }
+
+    // Starts tracing a DOWNLOAD/UPLOAD if the sampler picks it. A trace left
+    // over from a request that never got going is written out first.
+    void beginTrace(Session& session, const char* request, const std::string& filename) {
+        if (!tracer.enabled()) {
+            return;
+        }
+        endTrace(session, "rejected");
+        session.trace = tracer.start(request, filename);
+        if (session.trace) {
+            session.trace->arg("user", session.current_user);
+            session.trace->arg("client", session.client_ip);
+            session.trace->arg("request id", static_cast<long>(session.request_id));
+            session.trace->phase("authorize");
+        }
+    }
+
+    void tracePhase(Session& session, const char* name) {
+        if (session.trace) {
+            session.trace->phase(name);
         }
-        
-        file.close();
-        std::cout << "✓ Download complete: " << filename << std::endl;
-        logActivity("DOWNLOAD - " + filename + " (" + std::to_string(bytes_sent) + " bytes)");
     }
 
-    void handleUpload(const std::string& filename) {
-        if (!is_authenticated) {
-            sendMessage("ERROR: Authentication required\n");
-            logActivity("UNAUTHORIZED ACCESS - UPLOAD");
+    // Writes out the session's trace, if any, saying how the request ended
+    void endTrace(Session& session, const char* outcome) {
+        if (session.trace) {
+            session.trace->arg("end offset", session.file_offset);
+            session.trace->setOutcome(outcome);
+            session.trace.reset();
+        }
+        session.tracing = nullptr;
+    }
+
+    // DOWNLOAD <file> [offset [length]]: without a range the whole file is sent
+    void handleDownload(Session& session, const std::string& filename,
+                        const std::string& offset_arg, const std::string& length_arg) {
+        beginTrace(session, "DOWNLOAD", filename);
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - DOWNLOAD");
             return;
         }
 
-        if (!users[current_user].can_upload) {
-            sendMessage("ERROR: Permission denied - You cannot upload files\n");
-            logActivity("PERMISSION DENIED - UPLOAD - " + filename);
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_download) {
+            sendMessage(session, "ERROR: Permission denied - You cannot download files\n");
+            logActivity(session, "PERMISSION DENIED - DOWNLOAD - " + filename);
             return;
         }
         
         if (filename.empty()) {
-            sendMessage("ERROR: Filename required\n");
+            sendMessage(session, "ERROR: Filename required\n");
             return;
         }
-        
-        sendMessage("READY\n");
-        
-        char buffer[BUFFER_SIZE] = {0};
-        int bytes_read = read(client_socket, buffer, BUFFER_SIZE);
-        
-        if (bytes_read <= 0) {
+        if (isPartialName(filename)) {
+            sendMessage(session, "ERROR: Reserved file name\n");
             return;
         }
         
-        std::string metadata(buffer);
-        std::istringstream iss(metadata);
-        std::string line;
-        long filesize = 0;
-        std::string recv_filename;
-        bool start_found = false;
-        
-        while (std::getline(iss, line)) {
-            if (line.find("FILESIZE:") != std::string::npos) {
-                filesize = std::stol(line.substr(9));
-            } else if (line.find("FILENAME:") != std::string::npos) {
-                recv_filename = line.substr(9);
-            } else if (line.find("START") != std::string::npos) {
-                start_found = true;
-                break;
+        int fd = -1;
+        std::unique_ptr<ChunkedFile> chunked;
+        long filesize;
+        tracePhase(session, "cache lookup");
+        std::shared_ptr<const CachedFile> cached = file_cache.lookup(filename);
+        if (cached && session.codec != CODEC_NONE &&
+            looksCompressible(cached->data.data(), std::min<size_t>(cached->data.size(), COMPRESS_PROBE))) {
+            cached.reset(); // Compressed downloads are encoded block by block from the file
+        }
+        if (cached) {
+            filesize = cached->data.size();
+        } else {
+            struct stat st;
+            tracePhase(session, "open");
+            std::string error = openShared(filename, fd, chunked, filesize, st, session.trace.get());
+            if (!error.empty()) {
+                sendMessage(session, error);
+                return;
+            }
+            if (file_cache.admit(filename, filesize)) {
+                tracePhase(session, "cache fill");
+                cached = cacheFile(filename, fd, chunked.get(), filesize, st);
             }
         }
         
-        if (!start_found || filesize == 0) {
-            sendMessage("ERROR: Invalid metadata\n");
+        long offset = 0;
+        long length = -1;
+        if (!parseByteCount(offset_arg, offset) || !parseByteCount(length_arg, length) ||
+            offset > filesize) {
+            sendMessage(session, "ERROR: Invalid range\n");
+            if (fd >= 0) {
+                close(fd);
+            }
             return;
         }
+        if (length < 0 || length > filesize - offset) {
+            length = filesize - offset; // Ranges past EOF are clipped
+        }
         
-        std::cout << "📥 " << current_user << " uploading: " << recv_filename 
-                  << " (" << formatFileSize(filesize) << ")" << std::endl;
+        std::cout << "📤 " << session.current_user << " downloading: " << filename
+                  << " (" << formatFileSize(filesize) << ")";
+        if (length != filesize) {
+            std::cout << " bytes " << offset << "-" << offset + length;
+        }
+        std::cout << std::endl;
         
-        std::string filepath = std::string(SHARED_DIR) + "/" + recv_filename;
-        std::ofstream outfile(filepath, std::ios::binary);
+        if (fd >= 0 && session.codec != CODEC_NONE) {
+            tracePhase(session, "encoding probe");
+        }
+        Codec encoding = (fd >= 0) ? downloadEncoding(session, fd, chunked.get(), offset, length) : CODEC_NONE;
+        if (encoding != CODEC_NONE) {
+            cached.reset();
+        } else if (cached && fd >= 0) {
+            // Just cached: this download already goes out of memory
+            chunked.reset();
+            close(fd);
+            fd = -1;
+        }
+        // Appended piece by piece: no temporaries on the way into the arena
+        std::string& metadata = startReply(session);
+        metadata += "OK\n";
+        metadata.append("FILESIZE:").append(std::to_string(filesize)) += '\n';
+        metadata.append("FILENAME:").append(filename) += '\n';
+        metadata.append("OFFSET:").append(std::to_string(offset)) += '\n';
+        metadata.append("LENGTH:").append(std::to_string(length)) += '\n';
+        if (encoding != CODEC_NONE) {
+            metadata.append("ENCODING:").append(codecName(encoding)) += '\n';
+        }
+        metadata += "START\n";
+        sendMessage(session, metadata, FRAME_METADATA);
+        session.use_sendfile = config.use_sendfile;
+        session.use_ring = config.io_uring;
         
-        if (!outfile.is_open()) {
-            sendMessage("ERROR: Cannot create file\n");
+        if (session.pipelined) {
+            // No READY round trip: data follows as soon as the socket has room
+            uint32_t crc = cached ? cached->rangeCrc(offset, length) : 0;
+            // Interleaved with the other pipelined downloads; its slices show up as spans
+            tracePhase(session, "send");
+            session.pipeline.push_back({session.request_id, fd, offset + length, offset, filename,
+                                        std::move(chunked), encoding, crc, std::move(cached),
+                                        std::move(session.trace)});
             return;
         }
         
-        send(client_socket, "READY", 5, 0);
-        
-        long bytes_received = 0;
-        char data_buffer[CHUNK_SIZE];
+        session.file_fd = fd;
+        session.crc = cached ? cached->rangeCrc(offset, length) : 0;
+        session.cached = std::move(cached);
+        session.chunked = std::move(chunked);
+        session.encoding = encoding;
+        session.file_size = offset + length;
+        session.file_offset = offset;
+        session.transfer_name = filename;
+        session.state = SessionState::AWAIT_DOWNLOAD_READY;
+        tracePhase(session, "await READY");
+    }
         
-        while (bytes_received < filesize) {
-            memset(data_buffer, 0, CHUNK_SIZE);
-            
-            long remaining = filesize - bytes_received;
-            int to_read = (remaining < CHUNK_SIZE) ? remaining : CHUNK_SIZE;
-            
-            int received = read(client_socket, data_buffer, to_read);
-            
-            if (received <= 0) {
-                outfile.close();
-                sendMessage("ERROR: Upload failed\n");
-                return;
-            }
-            
-            outfile.write(data_buffer, received);
-            bytes_received += received;
+    // Called once the client has acknowledged the metadata with READY
+    void handleDownloadReady(Session& session) {
+        const char* ready = "READY";
+        size_t have = std::min(session.inbuf.size(), strlen(ready));
+        if (session.inbuf.compare(0, have, ready, have) != 0) {
+            // Client declined the transfer; treat the input as the next command
+            endTrace(session, "declined");
+            finishTransfer(session);
+            return;
         }
-        
-        outfile.close();
-        
-        std::cout << "✓ Upload complete: " << recv_filename << std::endl;
-        logActivity("UPLOAD - " + recv_filename + " (" + std::to_string(bytes_received) + " bytes)");
-        
-        sendMessage("OK: Upload successful\n");
+        if (have < strlen(ready)) {
+            return; // Wait for the rest of the acknowledgement
+        }
+
+        session.inbuf.erase(0, have);
+        beginDownload(session);
     }
 
-    void sendMessage(const std::string& message) {
-        send(client_socket, message.c_str(), message.length(), 0);
+    void beginDownload(Session& session) {
+        if (session.binary && session.encoding == CODEC_NONE) {
+            // One DATA frame spans the whole file so the payload can go out via sendfile()
+            FrameHeader header = {FRAME_DATA, 0, session.request_id,
+                                  static_cast<uint64_t>(session.file_size - session.file_offset)};
+            char header_bytes[FRAME_HEADER_SIZE];
+            encodeFrameHeader(header_bytes, header);
+            session.outbuf.append(header_bytes, FRAME_HEADER_SIZE);
+        }
+        session.state = SessionState::SENDING_FILE;
+        tracePhase(session, "send");
     }
 
-    void processCommand(const std::string& command) {
-        std::istringstream iss(command);
-        std::string cmd;
-        iss >> cmd;
-        
-        std::cout << "Processing command: " << cmd;
-        if (is_authenticated) {
-            std::cout << " [User: " << current_user << "]";
+    // Reads file bytes at offset from a plain file or a chunk manifest
+    ssize_t readSource(int file_fd, ChunkedFile* chunked, long offset, char* buffer, size_t length) {
+        return chunked ? chunked->read(offset, buffer, length) : pread(file_fd, buffer, length, offset);
+    }
+
+    // The session's pool buffer (POOL_BUFFER bytes), borrowed from the
+    // servicing worker on first use and handed back when the call ends.
+    // Null only if the pool could not map more memory.
+    char* transferBuffer(Session& session) {
+        if (!session.buffer) {
+            session.buffer = buffer_pool->acquire(session.worker);
         }
-        std::cout << std::endl;
-        
-        if (cmd == "LOGIN") {
-            std::string credentials;
-            std::getline(iss, credentials);
-            credentials = credentials.substr(1); // Remove leading space
-            handleLogin(credentials);
+        return session.buffer.data();
+    }
+
+    // Clears the session's reply arena for a new reply
+    std::string& startReply(Session& session) {
+        session.reply.clear();
+        return session.reply;
+    }
+
+    // Folds file bytes [from, to) into crc by reading them back. The
+    // zero-copy paths never see the data, but it was just sent from (or
+    // written to) the page cache, so this costs a cached read, not disk I/O.
+    bool checksumSource(Session& session, int file_fd, ChunkedFile* chunked, long from, long to, uint32_t& crc) {
+        TraceSpan span(from < to ? session.tracing : nullptr, "checksum");
+        char* buffer = transferBuffer(session);
+        if (!buffer) {
+            return false;
         }
-        else if (cmd == "LIST") {
-            handleList();
-        } 
-        else if (cmd == "INFO") {
-            std::string filename;
-            iss >> filename;
-            handleInfo(filename);
+        while (from < to) {
+            ssize_t n = readSource(file_fd, chunked, from, buffer, std::min<long>(to - from, POOL_BUFFER));
+            if (n <= 0) {
+                return false;
+            }
+            crc = crc32c(crc, buffer, n);
+            from += n;
         }
-        else if (cmd == "DOWNLOAD") {
-            std::string filename;
-            iss >> filename;
-            handleDownload(filename);
+        return true;
+    }
+
+    // Compression costs the zero-copy path, so a download is only compressed
+    // if the client asked for it and the start of the range looks like it
+    // will shrink. Media, archives and encrypted files go out as they are.
+    Codec downloadEncoding(Session& session, int file_fd, ChunkedFile* chunked, long offset, long length) {
+        if (session.codec == CODEC_NONE || length == 0) {
+            return CODEC_NONE;
         }
-        else if (cmd == "UPLOAD") {
-            std::string filename;
-            iss >> filename;
-            handleUpload(filename);
+        char* sample = transferBuffer(session);
+        if (!sample) {
+            return CODEC_NONE;
         }
-        else if (cmd == "LOGOUT") {
-            if (is_authenticated) {
-                logActivity("LOGOUT");
-                std::cout << "✓ User logged out: " << current_user << std::endl;
-                current_user = "";
-                is_authenticated = false;
-                sendMessage("OK: Logged out successfully\n");
-            } else {
-                sendMessage("ERROR: Not logged in\n");
+        ssize_t n = readSource(file_fd, chunked, offset, sample, std::min<long>(length, COMPRESS_PROBE));
+        return (n > 0 && looksCompressible(sample, n)) ? session.codec : CODEC_NONE;
+    }
+
+    // Appends the next compressed block of [file_offset, end) to outbuf as a
+    // DATA frame, encoding straight behind its header; false if the file
+    // can't be read
+    bool queueCompressedBlock(Session& session, Codec codec, uint32_t request_id, int file_fd,
+                              ChunkedFile* chunked, long& file_offset, long end, uint32_t& crc) {
+        TraceSpan span(session.tracing, "read+compress");
+        char* block = transferBuffer(session);
+        if (!block) {
+            return false;
+        }
+        ssize_t n = readSource(file_fd, chunked, file_offset, block,
+                               std::min<long>(end - file_offset, COMPRESS_BLOCK));
+        if (n <= 0) {
+            return false;
+        }
+        crc = crc32c(crc, block, n);
+        size_t header_at = session.outbuf.size();
+        session.outbuf.resize(header_at + FRAME_HEADER_SIZE);
+        encodeBlock(codec, block, n, session.outbuf);
+        uint64_t length = session.outbuf.size() - header_at - FRAME_HEADER_SIZE;
+        encodeFrameHeader(&session.outbuf[header_at], {FRAME_DATA, 0, request_id, length});
+        file_offset += n;
+        return true;
+    }
+
+    // Compressed counterpart of sendSourceRange: one block at a time through outbuf
+    PumpStatus sendCompressedRange(Session& session, long& file_offset, long end) {
+        while (file_offset < end) {
+            {
+                TraceSpan span(session.out_offset < session.outbuf.size() ? session.tracing : nullptr,
+                               "socket send");
+                if (!flushOutput(session)) {
+                    return PumpStatus::FAILED;
+                }
+            }
+            if (session.out_offset != 0) {
+                return PumpStatus::BLOCKED;
+            }
+            if (!queueCompressedBlock(session, session.encoding, session.request_id, session.file_fd,
+                                      session.chunked.get(), file_offset, end, session.crc)) {
+                break; // File shrank underneath us
+            }
+        }
+        return PumpStatus::DONE;
+    }
+
+    // Zero-copy path: the kernel moves page-cache pages straight to the socket
+    PumpStatus sendFileZeroCopy(int socket_fd, int file_fd, long& file_offset, long end) {
+        while (file_offset < end) {
+            long remaining = end - file_offset;
+            size_t batch = (remaining < SENDFILE_BATCH) ? remaining : SENDFILE_BATCH;
+
+            off_t offset = file_offset;
+            ssize_t sent = sendfile(socket_fd, file_fd, &offset, batch);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return PumpStatus::BLOCKED;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP) {
+                    return PumpStatus::UNSUPPORTED;
+                }
+                return PumpStatus::FAILED;
+            }
+            if (sent == 0) {
+                break; // File shrank underneath us
+            }
+            metrics.add(NET_BYTES_OUT, sent);
+            file_offset = offset;
+        }
+        return PumpStatus::DONE;
+    }
+
+    // Fallback path: read a chunk into the pool buffer and send() it. Disk
+    // reads and socket sends are separate spans of trace, if it is set.
+    PumpStatus sendFileBuffered(int socket_fd, int file_fd, char* buffer, long& file_offset, long end,
+                                RequestTrace* trace) {
+        while (file_offset < end) {
+            long remaining = end - file_offset;
+            size_t to_read = (remaining < POOL_BUFFER) ? remaining : POOL_BUFFER;
+
+            ssize_t bytes_read;
+            {
+                TraceSpan span(trace, "disk read");
+                bytes_read = pread(file_fd, buffer, to_read, file_offset);
+            }
+            if (bytes_read <= 0) {
+                break;
+            }
+
+            ssize_t sent;
+            {
+                TraceSpan span(trace, "socket send");
+                sent = send(socket_fd, buffer, bytes_read, MSG_NOSIGNAL);
+            }
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return PumpStatus::BLOCKED;
+                }
+                return PumpStatus::FAILED;
+            }
+            // A short send just means the rest is re-read on the next pass
+            metrics.add(NET_BYTES_OUT, sent);
+            file_offset += sent;
+        }
+        return PumpStatus::DONE;
+    }
+
+    // io_uring path: a file read into the worker's registered buffer, linked
+    // to a send of that buffer, so each RING_BUFFER bytes cost a single
+    // io_uring_enter(). A short send just means the rest is re-read next time.
+    PumpStatus sendFileRing(IoRing& ring, int socket_fd, int file_fd, long& file_offset, long end) {
+        while (file_offset < end) {
+            size_t batch = std::min<long>(end - file_offset, ring.bufferSize());
+            ring.prepRead(file_fd, 0, batch, file_offset, RING_READ)->flags |= IOSQE_IO_LINK;
+            ring.prepSend(socket_fd, ring.buffer(0), batch, MSG_NOSIGNAL | MSG_DONTWAIT, RING_SEND);
+            if (!ring.submit(2)) {
+                return PumpStatus::UNSUPPORTED;
+            }
+
+            int read_result = 0, send_result = 0;
+            for (int i = 0; i < 2; i++) {
+                io_uring_cqe cqe;
+                if (!ring.wait(cqe)) {
+                    return PumpStatus::FAILED;
+                }
+                (cqe.user_data == RING_READ ? read_result : send_result) = cqe.res;
+            }
+
+            if (read_result < 0) {
+                // Opcodes the kernel doesn't know come back as EINVAL
+                return (read_result == -EINVAL || read_result == -EOPNOTSUPP) ? PumpStatus::UNSUPPORTED
+                                                                               : PumpStatus::FAILED;
+            }
+            if (read_result == 0) {
+                break; // File shrank underneath us
+            }
+            if (send_result == -ECANCELED) {
+                // A short read cuts the link; send what did arrive the plain way
+                send_result = send(socket_fd, ring.buffer(0), read_result, MSG_NOSIGNAL);
+                if (send_result < 0) {
+                    send_result = -errno;
+                }
+            }
+            if (send_result == -EAGAIN || send_result == -EWOULDBLOCK) {
+                return PumpStatus::BLOCKED;
+            }
+            if (send_result < 0) {
+                return (send_result == -EINVAL || send_result == -EOPNOTSUPP) ? PumpStatus::UNSUPPORTED
+                                                                               : PumpStatus::FAILED;
+            }
+            metrics.add(NET_BYTES_OUT, send_result);
+            file_offset += send_result;
+        }
+        return PumpStatus::DONE;
+    }
+
+    // Sends file bytes [file_offset, end), preferring io_uring when it is the
+    // engine, then sendfile() while the kernel allows it. A traced turn of
+    // either is one span: the kernel reads the disk and fills the socket in
+    // the same call, so only the buffered path times the two separately.
+    PumpStatus sendFileRange(Session& session, int file_fd, long& file_offset, long end) {
+        if (session.use_ring && session.ring) {
+            TraceSpan span(session.tracing, "io_uring read+send");
+            PumpStatus status = sendFileRing(*session.ring, session.socket_fd, file_fd, file_offset, end);
+            if (status != PumpStatus::UNSUPPORTED) {
+                return status;
+            }
+            session.use_ring = false;
+        }
+        if (session.use_sendfile) {
+            TraceSpan span(session.tracing, "sendfile");
+            PumpStatus status = sendFileZeroCopy(session.socket_fd, file_fd, file_offset, end);
+            if (status != PumpStatus::UNSUPPORTED) {
+                return status;
+            }
+            session.use_sendfile = false;
+        }
+        char* buffer = transferBuffer(session);
+        if (!buffer) {
+            return PumpStatus::FAILED;
+        }
+        return sendFileBuffered(session.socket_fd, file_fd, buffer, file_offset, end, session.tracing);
+    }
+
+    // Same for a deduplicated file: each piece of the range goes out of the
+    // chunk file that holds it, still via sendfile() where allowed
+    PumpStatus sendChunkedRange(Session& session, ChunkedFile& chunked, long& file_offset, long end) {
+        while (file_offset < end) {
+            if (!chunked.seek(file_offset)) {
+                return PumpStatus::FAILED; // Manifest or chunk missing
+            }
+            long base = chunked.chunkStart();
+            long offset = file_offset - base;
+            long chunk_end = std::min<long>(end, chunked.chunkEnd()) - base;
+
+            PumpStatus status = sendFileRange(session, chunked.chunkFd(), offset, chunk_end);
+            file_offset = base + offset;
+            if (status != PumpStatus::DONE) {
+                return status;
+            }
+            if (offset < chunk_end) {
+                return PumpStatus::FAILED; // Chunk shorter than its manifest entry
+            }
+        }
+        return PumpStatus::DONE;
+    }
+
+    // Memory path for cached files: head[head_sent..], body[offset, end) and
+    // then tail go out together with sendmsg(), so a frame header, its
+    // payload and the frame after it share a system call. The counters
+    // advance past whatever the socket took.
+    PumpStatus sendGathered(int socket_fd, const char* head, size_t head_size, size_t& head_sent,
+                            const char* body, long& offset, long end,
+                            const std::string& tail, size_t& tail_sent) {
+        while (head_sent < head_size || offset < end || tail_sent < tail.size()) {
+            struct iovec iov[3];
+            int count = 0;
+            if (head_sent < head_size) {
+                iov[count++] = {const_cast<char*>(head) + head_sent, head_size - head_sent};
+            }
+            if (offset < end) {
+                iov[count++] = {const_cast<char*>(body) + offset, static_cast<size_t>(end - offset)};
+            }
+            if (tail_sent < tail.size()) {
+                iov[count++] = {const_cast<char*>(tail.data()) + tail_sent, tail.size() - tail_sent};
+            }
+            struct msghdr message = {};
+            message.msg_iov = iov;
+            message.msg_iovlen = count;
+
+            ssize_t sent = sendmsg(socket_fd, &message, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return PumpStatus::BLOCKED;
+                }
+                return PumpStatus::FAILED;
+            }
+            metrics.add(NET_BYTES_OUT, sent);
+            size_t taken = std::min<size_t>(sent, head_size - head_sent);
+            head_sent += taken;
+            sent -= taken;
+            taken = std::min<size_t>(sent, end - offset);
+            offset += taken;
+            tail_sent += sent - taken;
+        }
+        return PumpStatus::DONE;
+    }
+
+    // A cached download in one sendmsg(): the DATA header still queued in
+    // outbuf, the bytes straight from memory and the END frame, whose
+    // checksum is known before the first byte goes out. If the socket
+    // takes only part of the END frame, the rest is left in outbuf.
+    PumpStatus sendCachedDownload(Session& session, long end) {
+        std::string trailer;
+        if (session.binary && end == session.file_size) {
+            appendFrame(trailer, FRAME_END, 0, session.request_id, checksumTrailer(session.crc));
+        }
+        size_t trailer_sent = 0;
+        PumpStatus status;
+        {
+            TraceSpan span(session.tracing, "cached send");
+            status = sendGathered(session.socket_fd, session.outbuf.data(), session.outbuf.size(),
+                                  session.out_offset, session.cached->data.data(),
+                                  session.file_offset, end, trailer, trailer_sent);
+        }
+        if (session.out_offset == session.outbuf.size()) {
+            session.outbuf.clear();
+            session.out_offset = 0;
+        }
+        if (session.file_offset == session.file_size) {
+            session.outbuf.append(trailer, trailer_sent, std::string::npos);
+            return PumpStatus::DONE;
+        }
+        return status;
+    }
+
+    PumpStatus sendSourceRange(Session& session, int file_fd, ChunkedFile* chunked,
+                               long& file_offset, long end) {
+        if (chunked) {
+            return sendChunkedRange(session, *chunked, file_offset, end);
+        }
+        return sendFileRange(session, file_fd, file_offset, end);
+    }
+
+    // Bytes of file data the session may move now, at most wanted. 0 means
+    // the shaper parked it; handleEvent resubmits it once there is credit.
+    size_t shapedGrant(Session& session, size_t wanted) {
+        if (wanted == 0) {
+            return 0;
+        }
+        std::chrono::milliseconds wait(0);
+        size_t granted = shaper.grant(session.flow, wanted, wait);
+        if (granted == 0) {
+            session.parked_ms = wait.count();
+        }
+        return granted;
+    }
+
+    // File data a transfer has moved: paid for to the shaper and counted
+    void chargeTransfer(Session& session, MetricCounter direction, long bytes) {
+        if (bytes > 0) {
+            shaper.charge(session.flow, bytes);
+            metrics.add(direction, bytes);
+        }
+    }
+
+    // Sends the download up to end, which falls short of file_size when the
+    // shaper limited this turn
+    bool pumpDownload(Session& session, long end) {
+        long start = session.file_offset;
+        session.tracing = session.trace.get();
+        if (session.cached) {
+            PumpStatus status = sendCachedDownload(session, end);
+            chargeTransfer(session, DOWNLOAD_BYTES, session.file_offset - start);
+            if (status != PumpStatus::DONE) {
+                return status == PumpStatus::BLOCKED;
+            }
+            if (session.file_offset < session.file_size) {
+                return true; // Rest on a later turn
+            }
+            std::string summary = std::to_string(session.file_offset) + " bytes";
+            if (session.binary) {
+                summary += ", crc32c " + crc32cHex(session.crc);
+            }
+            std::cout << "✓ Download complete: " << session.transfer_name << " (cached)" << std::endl;
+            logActivity(session, "DOWNLOAD - " + session.transfer_name + " (" + summary + ", cached)");
+            finishTransfer(session);
+            return true;
+        }
+
+        PumpStatus status = (session.encoding != CODEC_NONE)
+            ? sendCompressedRange(session, session.file_offset, end)
+            : sendSourceRange(session, session.file_fd, session.chunked.get(),
+                              session.file_offset, end);
+        chargeTransfer(session, DOWNLOAD_BYTES, session.file_offset - start);
+        // Compressed blocks are checksummed as they are read; text mode has no trailer
+        if (session.binary && session.encoding == CODEC_NONE &&
+            !checksumSource(session, session.file_fd, session.chunked.get(), start, session.file_offset,
+                            session.crc)) {
+            return false;
+        }
+
+        if (status == PumpStatus::BLOCKED) {
+            return true; // Resume on the next EPOLLOUT
+        }
+        if (status == PumpStatus::FAILED) {
+            return false;
+        }
+        if (session.file_offset < end) {
+            return false; // File shrank; the promised length can't be honoured
+        }
+        if (session.file_offset < session.file_size) {
+            return true; // Rest on a later turn
+        }
+        std::string summary = std::to_string(session.file_offset) + " bytes";
+        if (session.binary) {
+            appendFrame(session.outbuf, FRAME_END, 0, session.request_id, checksumTrailer(session.crc));
+            summary += ", crc32c " + crc32cHex(session.crc);
+        }
+
+        std::cout << "✓ Download complete: " << session.transfer_name << std::endl;
+        logActivity(session, "DOWNLOAD - " + session.transfer_name + " (" + summary + ")");
+        finishTransfer(session);
+        return true;
+    }
+
+    // Frames the next slice, of at most limit bytes, of the front pipelined
+    // download; false if its file can't be read
+    bool startSlice(Session& session, size_t limit) {
+        Transfer& transfer = session.pipeline.front();
+        session.tracing = transfer.trace.get();
+        long length = std::min<long>({transfer.file_end - transfer.file_offset, PIPELINE_SLICE,
+                                      static_cast<long>(limit)});
+        if (length == 0) {
+            completePipelined(session);
+            return true;
+        }
+
+        if (transfer.encoding != CODEC_NONE) {
+            // A compressed slice is one block, queued whole in outbuf, and
+            // no longer than the shaper granted
+            long start = transfer.file_offset;
+            if (!queueCompressedBlock(session, transfer.encoding, transfer.request_id, transfer.file_fd,
+                                      transfer.chunked.get(), transfer.file_offset, start + length,
+                                      transfer.crc)) {
+                return false;
+            }
+            chargeTransfer(session, DOWNLOAD_BYTES, transfer.file_offset - start);
+            rotatePipeline(session);
+            return true;
+        }
+
+        encodeFrameHeader(session.slice_header,
+                          {FRAME_DATA, 0, transfer.request_id, static_cast<uint64_t>(length)});
+        session.slice_header_sent = 0;
+        session.slice_left = length;
+        session.slice_active = true;
+        chargeTransfer(session, DOWNLOAD_BYTES, length);
+        return true;
+    }
+
+    // Sends the in-flight DATA frame; nothing else may hit the wire until it is done
+    PumpStatus pumpSlice(Session& session) {
+        Transfer& transfer = session.pipeline.front();
+        session.tracing = transfer.trace.get();
+
+        if (transfer.cached) {
+            // Header and payload together, straight from memory; crc was preset
+            static const std::string no_trailer;
+            size_t trailer_sent = 0;
+            long end = transfer.file_offset + session.slice_left;
+            PumpStatus status;
+            {
+                TraceSpan span(session.tracing, "cached send");
+                status = sendGathered(session.socket_fd, session.slice_header, FRAME_HEADER_SIZE,
+                                      session.slice_header_sent, transfer.cached->data.data(),
+                                      transfer.file_offset, end, no_trailer, trailer_sent);
+            }
+            session.slice_left = end - transfer.file_offset;
+            if (status != PumpStatus::DONE) {
+                return status;
+            }
+            session.slice_active = false;
+            rotatePipeline(session);
+            return PumpStatus::DONE;
+        }
+
+        while (session.slice_header_sent < FRAME_HEADER_SIZE) {
+            ssize_t sent = send(session.socket_fd, session.slice_header + session.slice_header_sent,
+                                FRAME_HEADER_SIZE - session.slice_header_sent, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return PumpStatus::BLOCKED;
+                }
+                return PumpStatus::FAILED;
+            }
+            metrics.add(NET_BYTES_OUT, sent);
+            session.slice_header_sent += sent;
+        }
+
+        long start = transfer.file_offset;
+        long end = transfer.file_offset + session.slice_left;
+        PumpStatus status = sendSourceRange(session, transfer.file_fd, transfer.chunked.get(),
+                                            transfer.file_offset, end);
+        session.slice_left = end - transfer.file_offset;
+        if (!checksumSource(session, transfer.file_fd, transfer.chunked.get(), start, transfer.file_offset,
+                            transfer.crc)) {
+            return PumpStatus::FAILED;
+        }
+        if (status != PumpStatus::DONE) {
+            return status;
+        }
+        if (session.slice_left > 0) {
+            return PumpStatus::FAILED; // File shrank; the frame can't be completed
+        }
+
+        session.slice_active = false;
+        rotatePipeline(session);
+        return PumpStatus::DONE;
+    }
+
+    // After a slice: finish the front transfer or move it to the back
+    void rotatePipeline(Session& session) {
+        Transfer& transfer = session.pipeline.front();
+        if (transfer.file_offset == transfer.file_end) {
+            completePipelined(session);
+        } else {
+            // Round-robin so small requests are not stuck behind a large one
+            session.pipeline.push_back(std::move(session.pipeline.front()));
+            session.pipeline.pop_front();
+        }
+    }
+
+    void completePipelined(Session& session) {
+        Transfer& transfer = session.pipeline.front();
+        if (transfer.file_fd >= 0) {
+            close(transfer.file_fd);
+        }
+        appendFrame(session.outbuf, FRAME_END, 0, transfer.request_id, checksumTrailer(transfer.crc));
+
+        std::cout << "✓ Download complete: " << transfer.name << (transfer.cached ? " (cached)" : "") << std::endl;
+        logActivity(session, "DOWNLOAD - " + transfer.name + " (" + std::to_string(transfer.file_offset) +
+                    " bytes, crc32c " + crc32cHex(transfer.crc) + (transfer.cached ? ", cached" : "") + ")");
+        if (transfer.trace) {
+            transfer.trace->arg("end offset", transfer.file_offset);
+            transfer.trace->setOutcome("complete");
+        }
+        session.tracing = nullptr;
+        session.pipeline.pop_front();
+
+        // A slot opened up; resume commands held back by MAX_PIPELINE_DEPTH
+        processInput(session);
+    }
+
+    // Codec named by an upload, if the session negotiated compression; false if unusable
+    bool parseEncoding(Session& session, const std::string& name, Codec& encoding) {
+        encoding = CODEC_NONE;
+        if (name.empty() || name == codecName(CODEC_NONE)) {
+            return true;
+        }
+        encoding = codecByName(name);
+        return encoding != CODEC_NONE && session.codec != CODEC_NONE;
+    }
+
+    // UPLOAD <file> [size [offset [encoding]]]: the sized form is used by pipelined clients
+    void handleUpload(Session& session, const std::string& filename, const std::string& size_arg,
+                      const std::string& offset_arg, const std::string& encoding_arg) {
+        beginTrace(session, "UPLOAD", filename);
+        if (session.pipelined) {
+            // The payload is already on its way; drop it unless the upload starts
+            session.discarding = true;
+            session.discard_id = session.request_id;
+        }
+
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - UPLOAD");
+            return;
+        }
+        
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_upload) {
+            sendMessage(session, "ERROR: Permission denied - You cannot upload files\n");
+            logActivity(session, "PERMISSION DENIED - UPLOAD - " + filename);
+            return;
+        }
+        
+        if (filename.empty()) {
+            sendMessage(session, "ERROR: Filename required\n");
+            return;
+        }
+        
+        if (session.pipelined) {
+            long filesize = 0;
+            long offset = 0;
+            Codec encoding;
+            if (!parseByteCount(size_arg, filesize) || !parseByteCount(offset_arg, offset)) {
+                sendMessage(session, "ERROR: Invalid metadata\n");
+                return;
+            }
+            if (!parseEncoding(session, encoding_arg, encoding)) {
+                sendMessage(session, "ERROR: Unsupported encoding\n");
+                return;
+            }
+            openUpload(session, filename, filesize, offset, encoding);
+            return;
+        }
+        
+        sendMessage(session, "READY\n", FRAME_READY);
+        session.state = SessionState::AWAIT_UPLOAD_METADATA;
+        tracePhase(session, "await metadata");
+    }
+        
+    // Parses FILESIZE/FILENAME once the START line has arrived
+    void handleUploadMetadata(Session& session) {
+        size_t start_pos = session.inbuf.find("START\n");
+        if (start_pos == std::string::npos) {
+            if (session.inbuf.size() > BUFFER_SIZE) {
+                session.inbuf.clear();
+                sendMessage(session, "ERROR: Invalid metadata\n");
+                session.state = SessionState::AWAIT_COMMAND;
+            }
+            return;
+        }
+        
+        std::string metadata = session.inbuf.substr(0, start_pos);
+        session.inbuf.erase(0, start_pos + strlen("START\n"));
+        startUpload(session, metadata);
+    }
+
+    // Opens the target file described by an upload's metadata block
+    void startUpload(Session& session, const std::string& metadata) {
+        std::istringstream iss(metadata);
+        std::string line;
+        long filesize = 0;
+        long offset = 0;
+        std::string recv_filename;
+        std::string encoding_name;
+        
+        while (std::getline(iss, line)) {
+            if (line.find("FILESIZE:") != std::string::npos) {
+                filesize = strtol(line.c_str() + line.find("FILESIZE:") + 9, nullptr, 10);
+            } else if (line.find("FILENAME:") != std::string::npos) {
+                recv_filename = line.substr(9);
+            } else if (line.find("OFFSET:") != std::string::npos) {
+                offset = strtol(line.c_str() + line.find("OFFSET:") + 7, nullptr, 10);
+            } else if (line.compare(0, 9, "ENCODING:") == 0) {
+                encoding_name = line.substr(9);
+            }
+        }
+        
+        session.state = SessionState::AWAIT_COMMAND;
+        Codec encoding;
+        if (!parseEncoding(session, encoding_name, encoding)) {
+            sendMessage(session, "ERROR: Unsupported encoding\n");
+            return;
+        }
+        openUpload(session, recv_filename, filesize, offset, encoding);
+    }
+
+    // Partial file an upload is received into: a manifest when deduplicating
+    std::string partialPath(const std::string& filename) {
+        return std::string(SHARED_DIR) + "/" + filename + (config.dedup ? MANIFEST_SUFFIX : "") + PARTIAL_SUFFIX;
+    }
+
+    // Bytes of an interrupted upload already written to its partial file
+    long committedBytes(const std::string& filename) {
+        std::string partpath = partialPath(filename);
+        if (config.dedup) {
+            int fd = open(partpath.c_str(), O_RDONLY);
+            uint64_t entries = 0, length = 0;
+            bool valid = fd >= 0 && ChunkWriter::partialLength(fd, entries, length);
+            if (fd >= 0) {
+                close(fd);
+            }
+            return valid ? length : 0;
+        }
+        struct stat st;
+        if (stat(partpath.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+            return 0;
+        }
+        return st.st_size;
+    }
+
+    // RESUME <file>: tells the client where to restart an interrupted upload
+    void handleResume(Session& session, const std::string& filename) {
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            return;
+        }
+        
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_upload) {
+            sendMessage(session, "ERROR: Permission denied - You cannot upload files\n");
+            return;
+        }
+        
+        if (filename.empty()) {
+            sendMessage(session, "ERROR: Filename required\n");
+            return;
+        }
+        if (isManifestName(filename) || isPartialName(filename)) {
+            sendMessage(session, "ERROR: Reserved file name\n");
+            return;
+        }
+        
+        sendMessage(session, "OK OFFSET:" + std::to_string(committedBytes(filename)) + "\n");
+    }
+
+    // Identifies one version of a file, so a PATCH is only applied to the
+    // basis its delta was computed against
+    static std::string basisToken(long size, const struct stat& st) {
+        return std::to_string(size) + ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+               std::to_string(st.st_mtim.tv_nsec);
+    }
+
+    // SIGNATURES <file>: block signatures of the current version, the first
+    // step of a delta upload. Sent as METADATA, DATA frames, then END.
+    void handleSignatures(Session& session, const std::string& filename) {
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            return;
+        }
+        
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_upload) {
+            sendMessage(session, "ERROR: Permission denied - You cannot upload files\n");
+            return;
+        }
+        
+        if (!session.binary) {
+            sendMessage(session, "ERROR: SIGNATURES requires the binary protocol\n");
+            return;
+        }
+        
+        if (filename.empty()) {
+            sendMessage(session, "ERROR: Filename required\n");
+            return;
+        }
+        if (isManifestName(filename) || isPartialName(filename)) {
+            sendMessage(session, "ERROR: Reserved file name\n");
+            return;
+        }
+        
+        auto job = std::make_unique<SignatureJob>();
+        struct stat st;
+        std::string error = openShared(filename, job->file_fd, job->chunked, job->file_size, st);
+        if (!error.empty()) {
+            sendMessage(session, error);
+            return;
+        }
+        job->request_id = session.request_id;
+        job->block_size = deltaBlockSize(job->file_size);
+        job->file_offset = 0;
+        job->name = filename;
+        
+        std::string& metadata = startReply(session);
+        metadata += "OK\n";
+        metadata.append("FILESIZE:").append(std::to_string(job->file_size)) += '\n';
+        metadata.append("BLOCKSIZE:").append(std::to_string(job->block_size)) += '\n';
+        metadata.append("BASIS:").append(basisToken(job->file_size, st)) += '\n';
+        metadata += "START\n";
+        sendMessage(session, metadata, FRAME_METADATA);
+        session.signing = std::move(job);
+    }
+
+    // Hashes the next SIGNATURE_STEP of the basis into one DATA frame, or
+    // ends the reply once the whole file is covered
+    void continueSignatures(Session& session) {
+        SignatureJob& job = *session.signing;
+        size_t step = std::max<size_t>(SIGNATURE_STEP / job.block_size, 1) * job.block_size;
+        long length = std::min<long>(step, job.file_size - job.file_offset);
+        bool failed = false;
+
+        if (length > 0) {
+            std::string data(length, '\0');
+            long have = 0;
+            while (have < length) {
+                ssize_t n = job.chunked ? job.chunked->read(job.file_offset + have, &data[have], length - have)
+                                        : pread(job.file_fd, &data[have], length - have, job.file_offset + have);
+                if (n <= 0) {
+                    failed = true;
+                    break;
+                }
+                have += n;
+            }
+
+            if (!failed) {
+                std::string records;
+                records.reserve((length / job.block_size + 1) * DELTA_SIGNATURE_SIZE);
+                const unsigned char* bytes = reinterpret_cast<const unsigned char*>(data.data());
+                for (long offset = 0; offset < length; offset += job.block_size) {
+                    appendSignature(records, bytes + offset, std::min<long>(job.block_size, length - offset));
+                }
+                appendFrame(session.outbuf, FRAME_DATA, 0, job.request_id, records);
+                job.file_offset += length;
+                return;
+            }
+        }
+
+        long blocks = (job.file_offset + job.block_size - 1) / job.block_size;
+        appendFrame(session.outbuf, FRAME_END, 0, job.request_id,
+                    failed ? "ERROR: Cannot read file\n" : "OK\nCOUNT:" + std::to_string(blocks) + "\n");
+        logActivity(session, "SIGNATURES - " + job.name + " (" + std::to_string(blocks) + " blocks)");
+        session.signing.reset();
+
+        // Commands held back while the reply streamed can run now
+        processInput(session);
+    }
+
+    // MGET <file|glob>...: every matching file in one archive stream, packed
+    // by continueArchive() as the socket drains
+    void handleMget(Session& session, const std::string& args) {
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - MGET");
+            return;
+        }
+
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_download) {
+            sendMessage(session, "ERROR: Permission denied - You cannot download files\n");
+            logActivity(session, "PERMISSION DENIED - MGET");
+            return;
+        }
+
+        if (!session.binary) {
+            sendMessage(session, "ERROR: MGET requires the binary protocol\n");
+            return;
+        }
+
+        std::vector<std::string> patterns;
+        std::istringstream iss(args);
+        std::string pattern;
+        while (iss >> pattern) {
+            patterns.push_back(pattern);
+        }
+        if (patterns.empty()) {
+            sendMessage(session, "ERROR: Filename or pattern required\n");
+            return;
+        }
+
+        PageQuery query;
+        query.sort = SortKey::NAME;
+        query.descending = false;
+        query.has_cursor = false;
+        query.cursor_key = 0;
+        query.filter = [&patterns](const FileInfo& info) {
+            if (info.is_directory || isPartialName(info.name)) {
+                return false;
+            }
+            for (const std::string& pattern : patterns) {
+                if (fnmatch(pattern.c_str(), info.name.c_str(), 0) == 0) {
+                    return true;
+                }
+            }
+            return false;
+        };
+        std::vector<FileInfo> matches;
+        dir_cache.page(query, SIZE_MAX, matches);
+        if (matches.empty()) {
+            sendMessage(session, "ERROR: No matching files\n");
+            return;
+        }
+
+        auto job = std::make_unique<ArchiveJob>();
+        job->request_id = session.request_id;
+        long total = 0;
+        for (const FileInfo& info : matches) {
+            job->names.push_back(info.name);
+            total += info.size;
+        }
+
+        std::cout << "📦 " << session.current_user << " fetching " << matches.size() << " files ("
+                  << formatFileSize(total) << ")" << std::endl;
+        std::string& metadata = startReply(session);
+        metadata += "OK\n";
+        metadata.append("COUNT:").append(std::to_string(matches.size())) += '\n';
+        metadata.append("BYTES:").append(std::to_string(total)) += '\n';
+        metadata += "START\n";
+        sendMessage(session, metadata, FRAME_METADATA);
+        session.archive = std::move(job);
+    }
+
+    // Opens the next matched file as the archive's current entry; false if
+    // it has disappeared since it was matched
+    bool openArchiveEntry(ArchiveJob& job) {
+        job.name = job.names[job.next++];
+        job.cached = file_cache.lookup(job.name);
+        if (job.cached) {
+            job.file_size = job.cached->data.size();
+        } else {
+            struct stat st;
+            if (!openShared(job.name, job.file_fd, job.chunked, job.file_size, st).empty()) {
+                job.file_fd = -1;
+                return false;
+            }
+        }
+        job.file_offset = 0;
+        job.crc = 0;
+        job.in_entry = true;
+        return true;
+    }
+
+    void closeArchiveEntry(ArchiveJob& job) {
+        if (job.file_fd >= 0) {
+            close(job.file_fd);
+            job.file_fd = -1;
+        }
+        job.chunked.reset();
+        job.cached.reset();
+        job.in_entry = false;
+    }
+
+    // Packs the next ARCHIVE_BATCH bytes of the archive into one DATA frame,
+    // or ends the stream once every match is out. Small files are read
+    // straight into outbuf, many to a frame, so they share one send().
+    void continueArchive(Session& session, size_t limit) {
+        ArchiveJob& job = *session.archive;
+        long start = job.bytes;
+        std::string& out = session.outbuf;
+        size_t frame_at = out.size();
+        out.resize(frame_at + FRAME_HEADER_SIZE);
+        size_t payload_at = out.size();
+        std::string error;
+
+        while (out.size() - payload_at < limit) {
+            if (job.in_entry && job.file_offset == job.file_size) {
+                out += checksumTrailer(job.crc);
+                closeArchiveEntry(job);
+                job.packed++;
+            }
+            if (!job.in_entry) {
+                if (job.next == job.names.size()) {
+                    break;
+                }
+                if (openArchiveEntry(job)) {
+                    appendArchiveHeader(out, job.name, job.file_size);
+                }
+                continue;
+            }
+
+            size_t room = limit - (out.size() - payload_at);
+            size_t length = std::min<long>(room, job.file_size - job.file_offset);
+            size_t at = out.size();
+            out.resize(at + length);
+            ssize_t n = length;
+            if (job.cached) {
+                memcpy(&out[at], job.cached->data.data() + job.file_offset, length);
+            } else {
+                n = readSource(job.file_fd, job.chunked.get(), job.file_offset, &out[at], length);
+            }
+            if (n <= 0) {
+                // Its header promised more bytes than are left; the stream can't go on
+                out.resize(at);
+                error = "ERROR: " + job.name + " changed while being sent\n";
+                break;
+            }
+            out.resize(at + n);
+            job.crc = crc32c(job.crc, &out[at], n);
+            job.file_offset += n;
+            job.bytes += n;
+        }
+
+        chargeTransfer(session, DOWNLOAD_BYTES, job.bytes - start);
+        uint64_t payload = out.size() - payload_at;
+        if (payload > 0) {
+            encodeFrameHeader(&out[frame_at], {FRAME_DATA, 0, job.request_id, payload});
+        } else {
+            out.resize(frame_at);
+        }
+        if (error.empty() && (job.in_entry || job.next < job.names.size())) {
+            return;
+        }
+
+        appendFrame(out, FRAME_END, 0, job.request_id,
+                    error.empty() ? "OK\nCOUNT:" + std::to_string(job.packed) + "\n" : error);
+        std::cout << (error.empty() ? "✓" : "✗") << " MGET complete: " << job.packed << " files" << std::endl;
+        logActivity(session, "MGET - " + std::to_string(job.packed) + " files (" + std::to_string(job.bytes) +
+                    " bytes)" + (error.empty() ? "" : ", aborted"));
+        session.archive.reset();
+
+        // Commands held back while the archive streamed can run now
+        processInput(session);
+    }
+
+    // MPUT: pipelined upload of many files as one archive stream (see
+    // archive.h), ended by an END frame. Entries are unpacked as they arrive
+    // and a single reply reports what became of each.
+    void handleMput(Session& session) {
+        if (session.pipelined) {
+            // The archive is already on its way; drop it unless the batch starts
+            session.discarding = true;
+            session.discard_id = session.request_id;
+        }
+
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - MPUT");
+            return;
+        }
+
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_upload) {
+            sendMessage(session, "ERROR: Permission denied - You cannot upload files\n");
+            logActivity(session, "PERMISSION DENIED - MPUT");
+            return;
+        }
+
+        if (!session.binary || !session.pipelined) {
+            sendMessage(session, "ERROR: MPUT requires a pipelined binary command\n");
+            return;
+        }
+
+        std::cout << "📥 " << session.current_user << " uploading a batch" << std::endl;
+        session.discarding = false;
+        session.batch = std::make_unique<UploadBatch>();
+        session.batch->request_id = session.request_id;
+        session.state = SessionState::RECEIVING_ARCHIVE;
+    }
+
+    // Opens the partial file for the batch entry that has just begun
+    void beginBatchEntry(UploadBatch& batch, const std::string& name, long size) {
+        batch.name = name;
+        batch.in_entry = true;
+        batch.file_size = size;
+        batch.file_offset = 0;
+        batch.error.clear();
+        if (isManifestName(name) || isPartialName(name)) {
+            batch.error = "ERROR: Reserved file name";
+            return;
+        }
+        batch.file_fd = open(partialPath(name).c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (batch.file_fd < 0) {
+            batch.error = "ERROR: Cannot create file";
+            return;
+        }
+        if (config.dedup) {
+            batch.chunk_writer = std::make_unique<ChunkWriter>(chunk_store, batch.file_fd);
+            if (!batch.chunk_writer->begin(0)) {
+                batch.error = "ERROR: Cannot create file";
+            }
+        }
+    }
+
+    void writeBatchEntry(UploadBatch& batch, const char* data, size_t length) {
+        if (!batch.error.empty()) {
+            return;
+        }
+        bool written = true;
+        if (batch.chunk_writer) {
+            written = batch.chunk_writer->write(data, length);
+        } else {
+            for (size_t done = 0; written && done < length;) {
+                ssize_t n = pwrite(batch.file_fd, data + done, length - done, batch.file_offset + done);
+                written = n > 0;
+                done += written ? n : 0;
+            }
+        }
+        if (!written) {
+            batch.error = "ERROR: Upload failed";
+            return;
+        }
+        batch.file_offset += length;
+    }
+
+    // Commits the finished entry, or drops its partial file, and records the outcome
+    void endBatchEntry(Session& session, UploadBatch& batch, bool intact) {
+        batch.in_entry = false;
+        if (batch.error.empty() && !intact) {
+            batch.error = "ERROR: Checksum mismatch";
+            metrics.add(CHECKSUM_FAILURES);
+        }
+        if (batch.error.empty() && !commitPartial(batch.name, batch.file_fd, batch.chunk_writer.get())) {
+            batch.error = "ERROR: Upload failed";
+        }
+        if (batch.file_fd >= 0) {
+            close(batch.file_fd);
+            batch.file_fd = -1;
+        }
+        batch.chunk_writer.reset();
+
+        if (batch.error.empty()) {
+            batch.committed++;
+            batch.bytes += batch.file_size;
+            batch.results += batch.name + "\tOK " + std::to_string(batch.file_size) + "\n";
+            logActivity(session, "UPLOAD - " + batch.name + " (" + std::to_string(batch.file_size) +
+                        " bytes, crc32c verified, batch)");
+        } else {
+            if (!isManifestName(batch.name) && !isPartialName(batch.name)) {
+                unlink(partialPath(batch.name).c_str());
+            }
+            batch.failed++;
+            batch.results += batch.name + "\t" + batch.error + "\n";
+            std::cout << "✗ Batch upload of " << batch.name << " failed: " << batch.error << std::endl;
+            logActivity(session, "UPLOAD FAILED - " + batch.name + " (" + batch.error + ", batch)");
+        }
+    }
+
+    // Feeds up to limit buffered archive bytes to the batch's reader
+    bool unpackArchive(Session& session, size_t limit) {
+        UploadBatch& batch = *session.batch;
+        return batch.reader.feed(
+            session.inbuf.data(), limit,
+            [&](const std::string& name, long size) { beginBatchEntry(batch, name, size); },
+            [&](const char* data, size_t length) { writeBatchEntry(batch, data, length); },
+            [&](bool intact) { endBatchEntry(session, batch, intact); });
+    }
+
+    // END of an MPUT archive: one reply with a line per file
+    void finishBatch(Session& session) {
+        UploadBatch& batch = *session.batch;
+        bool incomplete = !batch.reader.idle();
+        if (incomplete && batch.in_entry) {
+            // The archive stopped inside an entry
+            batch.error = "ERROR: Incomplete";
+            endBatchEntry(session, batch, false);
+        } else if (incomplete) {
+            // Stopped inside a header: no entry to drop, the last one was already settled
+            batch.results += "(archive)\tERROR: Incomplete archive\n";
+        }
+
+        std::string& reply = startReply(session);
+        reply += incomplete ? "ERROR: Incomplete archive\n"
+                            : batch.failed == 0 ? "OK\n" : "ERROR: Some files failed\n";
+        reply.append("COMMITTED:").append(std::to_string(batch.committed)) += '\n';
+        reply.append("FAILED:").append(std::to_string(batch.failed)) += '\n';
+        if (reply.size() + batch.results.size() <= MAX_CONTROL_PAYLOAD) {
+            reply += batch.results;
+        }
+        session.request_id = batch.request_id;
+        sendMessage(session, reply);
+
+        std::cout << "✓ Batch upload complete: " << batch.committed << " files (" << formatFileSize(batch.bytes)
+                  << ")" << (batch.failed > 0 ? ", " + std::to_string(batch.failed) + " failed" : "") << std::endl;
+        logActivity(session, "MPUT - " + std::to_string(batch.committed) + " files committed, " +
+                    std::to_string(batch.failed) + " failed");
+        session.batch.reset();
+        session.state = SessionState::AWAIT_COMMAND;
+    }
+
+    // PATCH <file> <size> <basis>: pipelined upload whose DATA frames carry a
+    // delta against the version SIGNATURES described as <basis>
+    void handlePatch(Session& session, const std::string& filename,
+                     const std::string& size_arg, const std::string& basis_arg) {
+        if (session.pipelined) {
+            // The delta is already on its way; drop it unless the patch starts
+            session.discarding = true;
+            session.discard_id = session.request_id;
+        }
+
+        if (!session.is_authenticated) {
+            sendMessage(session, "ERROR: Authentication required\n");
+            logActivity(session, "UNAUTHORIZED ACCESS - PATCH");
+            return;
+        }
+        
+        User user;
+        if (!lookupUser(session.current_user, user) || !user.can_upload) {
+            sendMessage(session, "ERROR: Permission denied - You cannot upload files\n");
+            logActivity(session, "PERMISSION DENIED - PATCH - " + filename);
+            return;
+        }
+        
+        if (!session.binary || !session.pipelined) {
+            sendMessage(session, "ERROR: PATCH requires a pipelined binary command\n");
+            return;
+        }
+        
+        long filesize = 0;
+        if (filename.empty() || size_arg.empty() || !parseByteCount(size_arg, filesize)) {
+            sendMessage(session, "ERROR: Invalid metadata\n");
+            return;
+        }
+        
+        auto delta = std::make_unique<DeltaPatch>();
+        struct stat st;
+        std::string error = openShared(filename, delta->basis_fd, delta->basis_chunked, delta->basis_size, st);
+        if (!error.empty()) {
+            sendMessage(session, error);
+            return;
+        }
+        if (basis_arg != basisToken(delta->basis_size, st)) {
+            sendMessage(session, "ERROR: Basis changed since SIGNATURES\n");
+            return;
+        }
+        delta->block_size = deltaBlockSize(delta->basis_size);
+        delta->copied = 0;
+        
+        openUpload(session, filename, filesize, 0, CODEC_NONE);
+        if (session.state == SessionState::RECEIVING_FILE) {
+            session.delta = std::move(delta);
+            session.use_splice = false; // Ops have to be parsed in user space
+            session.use_ring = false;
+        }
+    }
+
+    // Opens the partial file for an upload, keeping the first offset bytes
+    // of an earlier attempt, and switches the session to receiving the rest.
+    // The file only takes its real name once every byte has arrived.
+    void openUpload(Session& session, const std::string& recv_filename, long filesize, long offset,
+                    Codec encoding) {
+        tracePhase(session, "open");
+        if (filesize <= 0 || recv_filename.empty() || offset < 0 || offset > filesize) {
+            sendMessage(session, "ERROR: Invalid metadata\n");
+            return;
+        }
+        // A .part name would land on another upload's partial file
+        if (isManifestName(recv_filename) || isPartialName(recv_filename)) {
+            sendMessage(session, "ERROR: Reserved file name\n");
+            return;
+        }
+        
+        std::cout << "📥 " << session.current_user << " uploading: " << recv_filename
+                  << " (" << formatFileSize(filesize) << ")";
+        if (offset > 0) {
+            std::cout << " resuming at " << offset;
+        }
+        std::cout << std::endl;
+        
+        std::string partpath = partialPath(recv_filename);
+        // Read access: resuming reads a manifest back, checksums read zero-copy writes back
+        int flags = (offset == 0) ? (O_RDWR | O_CREAT | O_TRUNC) : O_RDWR;
+        int fd = open(partpath.c_str(), flags, 0644);
+        
+        if (fd < 0) {
+            sendMessage(session, offset == 0 ? "ERROR: Cannot create file\n"
+                                             : "ERROR: Resume offset beyond committed data\n");
+            return;
+        }
+        
+        std::unique_ptr<ChunkWriter> chunk_writer;
+        if (config.dedup) {
+            // Chunks are cut at content boundaries, so a resume must land on one
+            chunk_writer = std::make_unique<ChunkWriter>(chunk_store, fd);
+            if (!chunk_writer->begin(offset)) {
+                sendMessage(session, "ERROR: Resume offset beyond committed data\n");
+                close(fd);
+                return;
+            }
+        } else if (offset > 0) {
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size < offset || ftruncate(fd, offset) != 0) {
+                sendMessage(session, "ERROR: Resume offset beyond committed data\n");
+                close(fd);
+                return;
+            }
+        }
+        
+        session.discarding = false;
+        session.file_fd = fd;
+        session.file_size = filesize;
+        session.file_offset = offset;
+        session.transfer_name = recv_filename;
+        session.chunk_writer = std::move(chunk_writer);
+        session.encoding = encoding;
+        session.crc = 0; // Covers the bytes sent this time, from offset on
+        // Chunking and decompression need the bytes in user space, so splice() is of no use
+        session.use_splice = config.use_splice && !session.chunk_writer && encoding == CODEC_NONE;
+        session.use_ring = config.io_uring && !session.chunk_writer && encoding == CODEC_NONE;
+        
+        if (offset == filesize) {
+            uploadReceived(session); // Everything arrived before the interruption
+            return;
+        }
+        
+        if (!session.pipelined) {
+            sendMessage(session, "READY", FRAME_READY);
+        }
+        session.state = SessionState::RECEIVING_FILE;
+        tracePhase(session, "receive");
+    }
+        
+    // Appends upload bytes to the target: the chunker or the partial file
+    bool writeOutput(Session& session, const char* data, size_t length) {
+        if (length > static_cast<size_t>(session.file_size - session.file_offset)) {
+            return false;
+        }
+        if (session.checksummed) {
+            TraceSpan span(session.trace.get(), "checksum");
+            session.crc = crc32c(session.crc, data, length);
+        }
+        TraceSpan span(session.trace.get(), "disk write");
+        if (session.chunk_writer) {
+            if (!session.chunk_writer->write(data, length)) {
+                return false;
+            }
+            session.file_offset += length;
+            return true;
+        }
+            
+        size_t written = 0;
+        while (written < length) {
+            // Positional, since splice() writes do not move the file offset
+            ssize_t n = pwrite(session.file_fd, data + written, length - written,
+                               session.file_offset + written);
+            if (n <= 0) {
+                return false;
+            }
+            written += n;
+        }
+        session.file_offset += written;
+        return true;
+    }
+
+    // Moves up to limit buffered upload bytes into the target file
+    bool writeUploadBytes(Session& session, size_t limit) {
+        long remaining = session.file_size - session.file_offset;
+        size_t to_write = std::min<size_t>(std::min(session.inbuf.size(), limit), remaining);
+        if (!writeOutput(session, session.inbuf.data(), to_write)) {
+            return false;
+        }
+        session.inbuf.erase(0, to_write);
+        return true;
+    }
+
+    // Copies count basis blocks to the end of the file being rebuilt
+    bool copyFromBasis(Session& session, uint64_t block, uint32_t count) {
+        DeltaPatch& delta = *session.delta;
+        uint64_t blocks = (delta.basis_size + delta.block_size - 1) / delta.block_size;
+        if (count == 0 || block >= blocks || count > blocks - block) {
+            return false;
+        }
+        long offset = block * delta.block_size;
+        long length = std::min<long>(static_cast<long>(count) * delta.block_size, delta.basis_size - offset);
+        if (length > session.file_size - session.file_offset) {
+            return false;
+        }
+        delta.copied += length;
+
+        if (!session.chunk_writer && !delta.basis_chunked) {
+            // Plain file to plain file: the kernel copies (or reflinks) the range
+            long copied_from = session.file_offset;
+            while (length > 0) {
+                loff_t in = offset;
+                loff_t out = session.file_offset;
+                ssize_t n = copy_file_range(delta.basis_fd, &in, session.file_fd, &out, length, 0);
+                if (n <= 0) {
+                    break; // Not supported here; copy the rest through user space
+                }
+                offset += n;
+                length -= n;
+                session.file_offset += n;
+            }
+            if (session.checksummed &&
+                !checksumSource(session, session.file_fd, nullptr, copied_from, session.file_offset, session.crc)) {
+                return false;
+            }
+        }
+
+        char* buffer = length > 0 ? transferBuffer(session) : nullptr;
+        if (length > 0 && !buffer) {
+            return false;
+        }
+        while (length > 0) {
+            ssize_t n = readSource(delta.basis_fd, delta.basis_chunked.get(), offset, buffer,
+                                   std::min<long>(length, POOL_BUFFER));
+            if (n <= 0 || !writeOutput(session, buffer, n)) {
+                return false;
+            }
+            offset += n;
+            length -= n;
+        }
+        return true;
+    }
+
+    // Decodes the whole compressed block buffered for the current DATA frame
+    bool writeCompressedBlock(Session& session) {
+        size_t length = session.parser.payloadLeft();
+        char* raw = transferBuffer(session);
+        size_t raw_length = 0;
+        bool written = raw && decodeBlock(session.inbuf.data(), length, raw, raw_length) &&
+                       writeOutput(session, raw, raw_length);
+        session.inbuf.erase(0, length);
+        session.parser.consumePayload(length);
+        return written;
+    }
+
+    // Runs buffered delta bytes through the decoder; false if the delta is malformed
+    bool applyDelta(Session& session, size_t length) {
+        bool applied = session.delta->decoder.feed(session.inbuf.data(), length,
+            [&](const char* data, size_t n) { return writeOutput(session, data, n); },
+            [&](uint64_t block, uint32_t count) { return copyFromBasis(session, block, count); });
+        session.inbuf.erase(0, length);
+        return applied;
+    }
+
+    void handleUploadData(Session& session) {
+        if (!writeUploadBytes(session, session.inbuf.size())) {
+            session.inbuf.clear();
+            endTrace(session, "write failed");
+            finishTransfer(session);
+            sendMessage(session, "ERROR: Upload failed\n");
+            return;
+        }
+            
+        if (session.file_offset < session.file_size) {
+            return;
+        }
+        
+        uploadReceived(session);
+    }
+
+    // Upload bytes that may be pulled straight off the socket right now
+    uint64_t uploadBytesOnWire(const Session& session) {
+        uint64_t remaining = session.file_size - session.file_offset;
+        if (!session.binary) {
+            return remaining;
+        }
+        if (!session.parser.inFrame() || session.parser.current().type != FRAME_DATA) {
+            return 0;
+        }
+        return std::min(remaining, session.parser.payloadLeft());
+    }
+
+    // Zero-copy path: socket -> pipe -> file with splice(), so payload bytes
+    // never enter user space. Moves at most limit bytes and is only called
+    // once inbuf has been drained.
+    PumpStatus receiveFileZeroCopy(Session& session, uint64_t limit) {
+        if (session.pipe_fds[0] < 0) {
+            if (pipe2(session.pipe_fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+                return PumpStatus::UNSUPPORTED;
+            }
+            fcntl(session.pipe_fds[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE); // Best effort
+            int capacity = fcntl(session.pipe_fds[1], F_GETPIPE_SZ);
+            session.pipe_capacity = (capacity > 0) ? capacity : 65536;
+        }
+
+        while (limit > 0) {
+            size_t batch = std::min<uint64_t>(limit, session.pipe_capacity);
+
+            ssize_t moved = splice(session.socket_fd, nullptr, session.pipe_fds[1], nullptr,
+                                   batch, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return PumpStatus::BLOCKED;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EINVAL || errno == ENOSYS) {
+                    return PumpStatus::UNSUPPORTED;
+                }
+                return PumpStatus::FAILED;
+            }
+            if (moved == 0) {
+                return PumpStatus::FAILED; // Client went away mid-upload
+            }
+
+            // Drain the pipe completely so it is empty for the next round
+            while (moved > 0) {
+                loff_t offset = session.file_offset;
+                ssize_t written = splice(session.pipe_fds[0], nullptr, session.file_fd, &offset,
+                                         moved, SPLICE_F_MOVE);
+                if (written <= 0) {
+                    if (written < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    return PumpStatus::FAILED;
+                }
+                session.file_offset = offset;
+                moved -= written;
+                limit -= written;
+                if (session.binary) {
+                    session.parser.consumePayload(written);
+                }
+            }
+        }
+        return PumpStatus::DONE;
+    }
+
+    // io_uring path for uploads: while one of the worker's registered buffers
+    // is written to the file, the next piece is received into the other one,
+    // and both requests go to the kernel in the same io_uring_enter()
+    PumpStatus receiveFileRing(Session& session, uint64_t limit) {
+        IoRing& ring = *session.ring;
+        unsigned slot = 0;      // Buffer the next receive goes into
+        size_t pending = 0;     // Received into the other buffer, not yet written
+        PumpStatus status = PumpStatus::DONE;
+
+        while (true) {
+            size_t want = (status == PumpStatus::DONE) ? std::min<uint64_t>(limit - pending, ring.bufferSize()) : 0;
+            if (pending == 0 && want == 0) {
+                return status;
+            }
+            if (pending > 0) {
+                ring.prepWrite(session.file_fd, slot ^ 1, pending, session.file_offset, RING_WRITE);
+            }
+            if (want > 0) {
+                ring.prepRecv(session.socket_fd, ring.buffer(slot), want, MSG_DONTWAIT, RING_RECV);
+            }
+            unsigned queued = (pending > 0) + (want > 0);
+            if (!ring.submit(queued)) {
+                return pending > 0 ? PumpStatus::FAILED : PumpStatus::UNSUPPORTED;
+            }
+
+            int write_result = 0, recv_result = 0;
+            for (unsigned i = 0; i < queued; i++) {
+                io_uring_cqe cqe;
+                if (!ring.wait(cqe)) {
+                    return PumpStatus::FAILED;
+                }
+                (cqe.user_data == RING_WRITE ? write_result : recv_result) = cqe.res;
+            }
+
+            if (pending > 0) {
+                if (write_result != static_cast<int>(pending)) {
+                    return PumpStatus::FAILED; // Short write: the disk is full
+                }
+                session.file_offset += pending;
+                limit -= pending;
+                if (session.binary) {
+                    session.parser.consumePayload(pending);
+                }
+                pending = 0;
+            }
+            if (want == 0) {
+                continue;
+            }
+            if (recv_result > 0) {
+                if (session.checksummed) {
+                    session.crc = crc32c(session.crc, ring.buffer(slot), recv_result);
+                }
+                pending = recv_result;
+                slot ^= 1;
+            } else if (recv_result == -EAGAIN || recv_result == -EWOULDBLOCK) {
+                status = PumpStatus::BLOCKED;
+            } else if (recv_result == -EINVAL || recv_result == -EOPNOTSUPP) {
+                status = PumpStatus::UNSUPPORTED;
+            } else {
+                status = PumpStatus::FAILED; // Client went away mid-upload
+            }
+        }
+    }
+
+    // Every byte of the upload is in; a checksummed one still owes its trailer
+    void uploadReceived(Session& session) {
+        if (session.checksummed) {
+            session.state = SessionState::AWAIT_UPLOAD_TRAILER;
+            tracePhase(session, "await trailer");
+            return;
+        }
+        completeUpload(session);
+    }
+
+    // Publishes a checksummed upload if its trailer matches what arrived.
+    // On a mismatch the partial file is dropped, since the bad bytes could
+    // be anywhere in it; the client has to send the file again.
+    void verifyUpload(Session& session, const std::string& trailer) {
+        tracePhase(session, "verify");
+        uint32_t expected;
+        if (!parseChecksumTrailer(trailer, expected)) {
+            protocolError(session, "Invalid checksum trailer");
+            return;
+        }
+        if (expected != session.crc) {
+            std::string detail = "crc32c " + crc32cHex(session.crc) + ", expected " + crc32cHex(expected);
+            std::cout << "✗ Checksum mismatch: " << session.transfer_name << " (" << detail << ")" << std::endl;
+            logActivity(session, "UPLOAD CORRUPTED - " + session.transfer_name + " (" + detail + ")");
+            std::string partpath = partialPath(session.transfer_name);
+            endTrace(session, "checksum mismatch");
+            finishTransfer(session);
+            unlink(partpath.c_str());
+            dir_cache.refresh(partpath.substr(strlen(SHARED_DIR) + 1));
+            metrics.add(CHECKSUM_FAILURES);
+            sendMessage(session, "ERROR: Checksum mismatch\n");
+            return;
+        }
+        completeUpload(session);
+    }
+
+    // Renames a fully received partial file to its real name. Whichever of
+    // the plain file and the manifest it replaces is removed afterwards.
+    bool commitPartial(const std::string& filename, int fd, ChunkWriter* chunk_writer) {
+        std::string filepath = std::string(SHARED_DIR) + "/" + filename;
+        std::string manifestpath = filepath + MANIFEST_SUFFIX;
+        std::string partpath = partialPath(filename);
+        bool committed;
+        if (chunk_writer) {
+            committed = chunk_writer->finish() &&
+                        rename(partpath.c_str(), manifestpath.c_str()) == 0;
+            if (committed) {
+                unlink(filepath.c_str());
+            }
+        } else {
+            committed = fdatasync(fd) == 0 &&
+                        rename(partpath.c_str(), filepath.c_str()) == 0;
+            if (committed) {
+                unlink(manifestpath.c_str());
+            }
+        }
+        if (committed) {
+            dir_cache.refresh(partpath.substr(strlen(SHARED_DIR) + 1));
+            dir_cache.refresh(filename);
+        }
+        return committed;
+    }
+
+    // Publishes a fully received upload under its real name
+    void completeUpload(Session& session) {
+        // fdatasync() and rename(), or the chunk store's flush
+        tracePhase(session, "commit");
+        if (!commitPartial(session.transfer_name, session.file_fd, session.chunk_writer.get())) {
+            std::cout << "✗ Upload could not be committed: " << session.transfer_name << std::endl;
+            logActivity(session, "UPLOAD FAILED - " + session.transfer_name);
+            endTrace(session, "commit failed");
+            finishTransfer(session);
+            sendMessage(session, "ERROR: Upload failed\n");
+            return;
+        }
+        
+        std::string summary = std::to_string(session.file_offset) + " bytes";
+        if (session.delta) {
+            summary += ", " + std::to_string(session.delta->copied) + " reused from previous version";
+        }
+        if (session.chunk_writer) {
+            summary += ", " + std::to_string(session.chunk_writer->duplicateBytes()) + " deduplicated";
+        }
+        if (session.checksummed) {
+            summary += ", crc32c " + crc32cHex(session.crc) + " verified";
+        }
+        std::cout << "✓ Upload complete: " << session.transfer_name << " (" << summary << ")" << std::endl;
+        logActivity(session, "UPLOAD - " + session.transfer_name + " (" + summary + ")");
+        finishTransfer(session);
+        
+        sendMessage(session, "OK: Upload successful\n");
+    }
+
+    void finishTransfer(Session& session) {
+        endTrace(session, session.file_offset < session.file_size ? "incomplete" : "complete");
+        session.chunked.reset();
+        session.chunk_writer.reset();
+        session.delta.reset();
+        session.cached.reset();
+        session.encoding = CODEC_NONE;
+        if (session.file_fd >= 0) {
+            close(session.file_fd);
+            session.file_fd = -1;
+        }
+        session.file_size = 0;
+        session.file_offset = 0;
+        session.transfer_name.clear();
+        session.state = SessionState::AWAIT_COMMAND;
+    }
+
+    // Queues a reply; in binary mode it is wrapped in a frame of the given type
+    void sendMessage(Session& session, const std::string& message, uint8_t type = FRAME_RESPONSE) {
+        if (message.compare(0, 5, "ERROR") == 0) {
+            session.reply_failed = true;
+        }
+        if (session.binary) {
+            appendFrame(session.outbuf, type, 0, session.request_id, message);
+        } else {
+            session.outbuf += message;
+        }
+    }
+
+    // Reports a framing violation and drops the connection once it is flushed
+    void protocolError(Session& session, const std::string& reason) {
+        std::cout << "✗ Protocol error: " << reason << std::endl;
+        logActivity(session, "PROTOCOL ERROR - " + reason);
+        metrics.add(PROTOCOL_ERRORS);
+        endTrace(session, "protocol error");
+        finishTransfer(session);
+        sendMessage(session, "ERROR: " + reason + "\n", FRAME_ERROR);
+        session.state = SessionState::CLOSING;
+    }
+
+    // Switches a text session to frames if the client asks for a version we speak
+    void handleProto(Session& session, const std::string& args) {
+        std::istringstream iss(args);
+        std::string mode;
+        int version = 0;
+        iss >> mode >> version;
+
+        if (session.binary) {
+            sendMessage(session, "ERROR: Protocol already negotiated\n");
+        } else if (mode != "BINARY" || version != PROTOCOL_VERSION) {
+            sendMessage(session, "ERROR: Unsupported protocol\n");
+        } else {
+            sendMessage(session, std::string(PROTO_ACCEPTED) + " " + std::to_string(version) + "\n");
+            session.binary = true;
+            session.parser.reset();
+        }
+    }
+
+    // COMPRESS <codec>: transfers on this connection may then be sent as
+    // compressed blocks. Each download still decides for itself (see
+    // downloadEncoding), so asking for compression never costs much.
+    void handleCompress(Session& session, const std::string& name) {
+        Codec codec = codecByName(name);
+        if (!session.binary) {
+            sendMessage(session, "ERROR: Compression requires the binary protocol\n");
+        } else if (name == codecName(CODEC_NONE)) {
+            session.codec = CODEC_NONE;
+            sendMessage(session, "OK COMPRESS none\n");
+        } else if (!config.compress || codec == CODEC_NONE) {
+            sendMessage(session, "ERROR: Unsupported codec\n");
+        } else {
+            session.codec = codec;
+            sendMessage(session, std::string("OK COMPRESS ") + codecName(codec) + "\n");
+        }
+    }
+
+    void processCommand(Session& session, const std::string& command) {
+        std::istringstream iss(command);
+        std::string cmd;
+        iss >> cmd;
+        
+        std::cout << "Processing command: " << cmd;
+        if (session.is_authenticated) {
+            std::cout << " [User: " << session.current_user << "]";
+        }
+        std::cout << std::endl;
+
+        auto started = std::chrono::steady_clock::now();
+        session.reply_failed = false;
+        
+        if (cmd == "PROTO") {
+            std::string args;
+            std::getline(iss, args);
+            handleProto(session, args);
+        }
+        else if (cmd == "LOGIN") {
+            std::string credentials;
+            std::getline(iss, credentials);
+            if (!credentials.empty()) {
+                credentials = credentials.substr(1); // Remove leading space
+            }
+            handleLogin(session, credentials);
+        }
+        else if (cmd == "AUTH") {
+            std::string token;
+            iss >> token;
+            handleAuth(session, token);
+        }
+        else if (cmd == "LIST") {
+            std::string args;
+            std::getline(iss, args);
+            handleList(session, args);
+        } 
+        else if (cmd == "INFO") {
+            std::string filename;
+            iss >> filename;
+            handleInfo(session, filename);
+        }
+        else if (cmd == "DOWNLOAD") {
+            std::string filename, offset_arg, length_arg;
+            iss >> filename >> offset_arg >> length_arg;
+            handleDownload(session, filename, offset_arg, length_arg);
+        }
+        else if (cmd == "UPLOAD") {
+            std::string filename, size_arg, offset_arg, encoding_arg;
+            iss >> filename >> size_arg >> offset_arg >> encoding_arg;
+            handleUpload(session, filename, size_arg, offset_arg, encoding_arg);
+        }
+        else if (cmd == "RESUME") {
+            std::string filename;
+            iss >> filename;
+            handleResume(session, filename);
+        }
+        else if (cmd == "COMPRESS") {
+            std::string codec;
+            iss >> codec;
+            handleCompress(session, codec);
+        }
+        else if (cmd == "SIGNATURES") {
+            std::string filename;
+            iss >> filename;
+            handleSignatures(session, filename);
+        }
+        else if (cmd == "PATCH") {
+            std::string filename, size_arg, basis_arg;
+            iss >> filename >> size_arg >> basis_arg;
+            handlePatch(session, filename, size_arg, basis_arg);
+        }
+        else if (cmd == "MPUT") {
+            handleMput(session);
+        }
+        else if (cmd == "MGET") {
+            std::string args;
+            std::getline(iss, args);
+            handleMget(session, args);
+        }
+        else if (cmd == "LOGOUT") {
+            if (session.is_authenticated) {
+                logActivity(session, "LOGOUT");
+                std::cout << "✓ User logged out: " << session.current_user << std::endl;
+                session.current_user = "";
+                session.is_authenticated = false;
+                sendMessage(session, "OK: Logged out successfully\n");
+            } else {
+                sendMessage(session, "ERROR: Not logged in\n");
+            }
+        }
+        else if (cmd == "HELP") {
+            std::string help;
+            if (!session.is_authenticated) {
+                help = "Available Commands:\n"
+                       "  LOGIN <user>:<pass> - Authenticate with server (reply carries a session TOKEN)\n"
+                       "  AUTH <token>        - Authenticate with a session token from LOGIN\n"
+                       "  HELP                - Show this help message\n"
+                       "  EXIT                - Disconnect from server\n";
+            } else {
+                help = "Available Commands:\n"
+                       "  LIST                - List all files\n"
+                       "  LIST [sort=name|size|mtime] [desc] [match=<glob>] [limit=<n>] [after=<cursor>]\n"
+                       "                      - Stream a filtered, sorted page of files\n"
+                       "  INFO <file>         - Get file information\n"
+                       "  DOWNLOAD <file> [offset [length]] - Download a file or byte range\n"
+                       "  MGET <file|glob>... - Download every match as one archive stream (binary protocol)\n"
+                       "  UPLOAD <file>       - Upload a file\n"
+                       "  RESUME <file>       - Bytes already received of an interrupted upload\n"
+                       "  SIGNATURES <file>   - Block signatures for a delta upload (binary protocol)\n"
+                       "  PATCH <file> <size> <basis> - Upload a delta against the current version\n"
+                       "  MPUT                - Upload many files as one archive stream (pipelined binary)\n"
+                       "  COMPRESS lz4|zstd|none - Compress transfers (binary protocol)\n"
+                       "  LOGOUT              - Logout from server\n"
+                       "  HELP                - Show this help\n"
+                       "  EXIT                - Disconnect\n";
+            }
+            sendMessage(session, help);
+        }
+        else if (cmd == "EXIT") {
+            if (session.is_authenticated) {
+                logActivity(session, "DISCONNECT");
+            }
+            sendMessage(session, "Goodbye!\n");
+        }
+        else {
+            sendMessage(session, "ERROR: Unknown command. Type HELP for available commands.\n");
+        }
+
+        metrics.observe(Metrics::commandByName(cmd), std::chrono::steady_clock::now() - started,
+                        session.reply_failed);
+    }
+
+    // Runs the session's state machine over whatever input is buffered
+    void processInput(Session& session) {
+        if (session.binary) {
+            processFrames(session);
+        } else {
+            processTextInput(session);
+        }
+    }
+
+    void processTextInput(Session& session) {
+        while (true) {
+            if (session.binary) {
+                processFrames(session); // PROTO switched the session mid-buffer
+                return;
+            }
+
+            size_t before = session.inbuf.size();
+            SessionState state = session.state;
+
+            switch (session.state) {
+                case SessionState::AWAIT_COMMAND: {
+                    if (session.listing) {
+                        return; // Resumed by continueListing()
+                    }
+                    size_t newline = session.inbuf.find('\n');
+                    if (newline == std::string::npos) {
+                        if (session.inbuf.size() > BUFFER_SIZE) {
+                            session.inbuf.clear();
+                            sendMessage(session, "ERROR: Command too long\n");
+                        }
+                        return;
+                    }
+
+                    std::string command = session.inbuf.substr(0, newline);
+                    session.inbuf.erase(0, newline + 1);
+                    if (!command.empty() && command.back() == '\r') {
+                        command.pop_back();
+                    }
+
+                    if (command == "EXIT") {
+                        sendMessage(session, "Goodbye!\n");
+                        std::cout << "Client requested disconnection" << std::endl;
+                        session.state = SessionState::CLOSING;
+                        return;
+                    }
+
+                    processCommand(session, command);
+                    break;
+                }
+                case SessionState::AWAIT_DOWNLOAD_READY:
+                    handleDownloadReady(session);
+                    break;
+                case SessionState::AWAIT_UPLOAD_METADATA:
+                    handleUploadMetadata(session);
+                    break;
+                case SessionState::RECEIVING_FILE:
+                    handleUploadData(session);
+                    break;
+                case SessionState::SENDING_FILE:
+                case SessionState::AWAIT_UPLOAD_TRAILER:    // Binary only
+                case SessionState::RECEIVING_ARCHIVE:       // Binary only
+                case SessionState::CLOSING:
+                    return;
+            }
+
+            // Stop once a pass neither consumed input nor changed state
+            if (session.state == state && session.inbuf.size() == before) {
+                return;
+            }
+        }
+    }
+
+    // Binary counterpart of processTextInput: decode frames from inbuf
+    void processFrames(Session& session) {
+        while (session.state != SessionState::SENDING_FILE &&
+               session.state != SessionState::CLOSING) {
+            if (!session.parser.inFrame()) {
+                size_t consumed = 0;
+                FrameParser::Status status =
+                    session.parser.readHeader(session.inbuf.data(), session.inbuf.size(), consumed);
+                if (status == FrameParser::Status::NEED_MORE) {
+                    return;
+                }
+                if (status == FrameParser::Status::INVALID) {
+                    protocolError(session, "Malformed frame");
+                    return;
+                }
+                session.inbuf.erase(0, consumed);
+
+                const FrameHeader& header = session.parser.current();
+                bool discard = session.discarding && header.request_id == session.discard_id;
+                uint64_t frame_limit = (session.encoding != CODEC_NONE)
+                    ? COMPRESS_FRAME_MAX : static_cast<uint64_t>(session.file_size - session.file_offset);
+                bool unpacking = session.state == SessionState::RECEIVING_ARCHIVE &&
+                                 header.request_id == session.batch->request_id;
+                if (header.type == FRAME_DATA && !discard && !unpacking &&
+                    (session.state != SessionState::RECEIVING_FILE || header.length > frame_limit)) {
+                    protocolError(session, "Unexpected data frame");
+                    return;
+                }
+            }
+
+            const FrameHeader& header = session.parser.current();
+
+            // Payload (and checksum trailer) of a pipelined upload that was refused
+            bool refused_trailer = header.type == FRAME_END && session.discarding &&
+                                   header.request_id == session.discard_id;
+            if ((header.type == FRAME_DATA && session.state != SessionState::RECEIVING_FILE &&
+                 session.state != SessionState::RECEIVING_ARCHIVE) || refused_trailer) {
+                size_t skip = std::min<uint64_t>(session.inbuf.size(), session.parser.payloadLeft());
+                session.inbuf.erase(0, skip);
+                session.parser.consumePayload(skip);
+                if (session.parser.inFrame()) {
+                    return;
+                }
+                continue;
+            }
+
+            // Archive payload is unpacked as it arrives
+            if (header.type == FRAME_DATA && session.state == SessionState::RECEIVING_ARCHIVE) {
+                size_t available = std::min<uint64_t>(session.inbuf.size(), session.parser.payloadLeft());
+                if (available == 0 && session.parser.payloadLeft() > 0) {
+                    return;
+                }
+                if (!unpackArchive(session, available)) {
+                    protocolError(session, "Invalid archive");
+                    return;
+                }
+                session.inbuf.erase(0, available);
+                session.parser.consumePayload(available);
+                continue;
+            }
+
+            // File payload is streamed; it never has to be buffered whole
+            if (header.type == FRAME_DATA) {
+                size_t available = std::min<uint64_t>(session.inbuf.size(), session.parser.payloadLeft());
+                if (available == 0 && session.parser.payloadLeft() > 0) {
+                    return;
+                }
+                if (session.encoding != CODEC_NONE) {
+                    // A compressed block can only be decoded whole
+                    if (available < session.parser.payloadLeft()) {
+                        return;
+                    }
+                    if (!writeCompressedBlock(session)) {
+                        protocolError(session, "Invalid compressed block");
+                        return;
+                    }
+                } else if (session.delta) {
+                    if (!applyDelta(session, available)) {
+                        protocolError(session, "Invalid delta");
+                        return;
+                    }
+                    session.parser.consumePayload(available);
+                } else {
+                    long before = session.file_offset;
+                    if (!writeUploadBytes(session, available)) {
+                        protocolError(session, "Upload failed");
+                        return;
+                    }
+                    session.parser.consumePayload(session.file_offset - before);
+                }
+                if (session.file_offset == session.file_size) {
+                    uploadReceived(session);
+                }
+                continue;
+            }
+
+            if (header.length > MAX_CONTROL_PAYLOAD) {
+                protocolError(session, "Frame too large");
+                return;
+            }
+            if (session.inbuf.size() < header.length) {
+                return;
+            }
+            if (session.pipeline.size() >= MAX_PIPELINE_DEPTH || session.listing || session.signing ||
+                session.archive) {
+                return; // Resumed by completePipelined(), continueListing(), continueSignatures() or continueArchive()
+            }
+
+            // The payload is handled in place and only dropped afterwards
+            FrameHeader frame = header;
+            session.parser.consumePayload(frame.length);
+            handleFrame(session, frame, std::string_view(session.inbuf.data(), frame.length));
+            session.inbuf.erase(0, frame.length);
+        }
+    }
+
+    // Dispatches one complete control frame according to the session state
+    void handleFrame(Session& session, const FrameHeader& frame, std::string_view payload) {
+        switch (session.state) {
+            case SessionState::AWAIT_COMMAND: {
+                if (frame.type != FRAME_COMMAND) {
+                    protocolError(session, "Expected a command frame");
+                    return;
+                }
+                session.request_id = frame.request_id;
+                session.pipelined = (frame.flags & FLAG_PIPELINED) != 0;
+                session.checksummed = (frame.flags & FLAG_CHECKSUM) != 0;
+                session.discarding = false;
+                if (!payload.empty() && payload.back() == '\n') {
+                    payload.remove_suffix(1);
+                }
+
+                if (payload == "EXIT") {
+                    sendMessage(session, "Goodbye!\n");
+                    std::cout << "Client requested disconnection" << std::endl;
+                    session.state = SessionState::CLOSING;
+                    return;
+                }
+                processCommand(session, std::string(payload));
+                return;
+            }
+            case SessionState::AWAIT_DOWNLOAD_READY:
+                if (frame.type != FRAME_READY) {
+                    // Client declined the transfer; the frame is its next request
+                    finishTransfer(session);
+                    handleFrame(session, frame, payload);
+                    return;
+                }
+                beginDownload(session);
+                return;
+            case SessionState::AWAIT_UPLOAD_METADATA:
+                if (frame.type != FRAME_METADATA) {
+                    protocolError(session, "Expected upload metadata");
+                    return;
+                }
+                startUpload(session, std::string(payload));
+                return;
+            case SessionState::AWAIT_UPLOAD_TRAILER:
+                if (frame.type != FRAME_END || frame.request_id != session.request_id) {
+                    protocolError(session, "Expected upload checksum");
+                    return;
+                }
+                verifyUpload(session, std::string(payload));
+                return;
+            case SessionState::RECEIVING_ARCHIVE:
+                if (frame.type != FRAME_END || frame.request_id != session.batch->request_id) {
+                    protocolError(session, "Expected archive data");
+                    return;
+                }
+                finishBatch(session);
+                return;
+            default:
+                protocolError(session, "Unexpected frame");
+                return;
+        }
+    }
+
+    // Sends queued replies; returns false if the connection failed
+    bool flushOutput(Session& session) {
+        while (session.out_offset < session.outbuf.size()) {
+            ssize_t sent = send(session.socket_fd,
+                                session.outbuf.data() + session.out_offset,
+                                session.outbuf.size() - session.out_offset, MSG_NOSIGNAL);
+            if (sent < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                return false;
             }
+            metrics.add(NET_BYTES_OUT, sent);
+            session.out_offset += sent;
         }
-        else if (cmd == "HELP") {
-            std::string help;
-            if (!is_authenticated) {
-                help = "Available Commands:\n"
-                       "  LOGIN <user>:<pass> - Authenticate with server\n"
-                       "  HELP                - Show this help message\n"
-                       "  EXIT                - Disconnect from server\n";
+        session.outbuf.clear();
+        session.out_offset = 0;
+        if (session.outbuf.capacity() > OUTBUF_RETAIN) {
+            std::string().swap(session.outbuf); // A big LIST or signature reply shouldn't pin memory
+        }
+        return true;
+    }
+
+    // Reads until EAGAIN, feeding the state machine; returns false on disconnect
+    bool readInput(Session& session) {
+        char* buffer = transferBuffer(session);
+        if (!buffer) {
+            return false;
+        }
+        session.tracing = session.trace.get();
+
+        while (session.inbuf.size() < MAX_INPUT_BUFFER) {
+            size_t allowance = POOL_BUFFER;
+            if (session.state == SessionState::RECEIVING_FILE ||
+                session.state == SessionState::RECEIVING_ARCHIVE) {
+                allowance = shapedGrant(session, POOL_BUFFER);
+                if (allowance == 0) {
+                    return true; // Parked; the upload waits in the socket meanwhile
+                }
+            }
+
+            uint64_t on_wire = 0;
+            bool via_ring = session.use_ring && session.ring;
+            if (session.state == SessionState::RECEIVING_FILE &&
+                (via_ring || session.use_splice) && session.inbuf.empty()) {
+                on_wire = std::min<uint64_t>(uploadBytesOnWire(session), allowance);
+            }
+            if (on_wire > 0) {
+                long before = session.file_offset;
+                PumpStatus status;
+                {
+                    TraceSpan span(session.tracing, via_ring ? "io_uring recv+write" : "splice");
+                    status = via_ring ? receiveFileRing(session, on_wire) : receiveFileZeroCopy(session, on_wire);
+                }
+                chargeTransfer(session, UPLOAD_BYTES, session.file_offset - before);
+                metrics.add(NET_BYTES_IN, session.file_offset - before);
+                // The io_uring path checksums its buffers as they fill
+                if (session.checksummed && !via_ring &&
+                    !checksumSource(session, session.file_fd, nullptr, before, session.file_offset, session.crc)) {
+                    return false;
+                }
+                if (status == PumpStatus::UNSUPPORTED) {
+                    (via_ring ? session.use_ring : session.use_splice) = false;
+                    continue;
+                }
+                if (status == PumpStatus::BLOCKED) {
+                    return true;
+                }
+                if (status == PumpStatus::FAILED) {
+                    return false;
+                }
+                if (session.file_offset == session.file_size) {
+                    uploadReceived(session);
+                    processInput(session);
+                }
+                continue;
+            }
+
+            ssize_t bytes_read;
+            {
+                TraceSpan span(session.state == SessionState::RECEIVING_FILE ? session.tracing : nullptr,
+                               "socket read");
+                bytes_read = read(session.socket_fd, buffer, allowance);
+            }
+
+            if (bytes_read < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    return true;
+                }
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            if (bytes_read == 0) {
+                return false;
+            }
+            metrics.add(NET_BYTES_IN, bytes_read);
+            if (session.state == SessionState::RECEIVING_FILE ||
+                session.state == SessionState::RECEIVING_ARCHIVE) {
+                chargeTransfer(session, UPLOAD_BYTES, bytes_read);
+            }
+
+            session.inbuf.append(buffer, bytes_read);
+            processInput(session);
+        }
+        return true;
+    }
+
+    // Drives one session forward after an epoll notification
+    bool serviceSession(Session& session, uint32_t events) {
+        if (events & (EPOLLERR | EPOLLHUP)) {
+            return false;
+        }
+
+        if ((events & EPOLLIN) && !readInput(session)) {
+            return false;
+        }
+
+        // Keep going while a finished download frees up buffered commands
+        while (true) {
+            // A half-sent DATA frame must finish before any other bytes go out
+            if (session.slice_active) {
+                PumpStatus status = pumpSlice(session);
+                if (status == PumpStatus::FAILED) {
+                    return false;
+                }
+                if (status == PumpStatus::BLOCKED) {
+                    return true; // Socket is full; wait for EPOLLOUT
+                }
+                continue;
+            }
+
+            // A cached download sends what is queued along with its own bytes
+            bool gathered = session.state == SessionState::SENDING_FILE && session.cached;
+            if (!gathered && !flushOutput(session)) {
+                return false;
+            }
+            if (!gathered && session.out_offset != 0) {
+                return true; // Socket is full; wait for EPOLLOUT
+            }
+            if (session.state == SessionState::CLOSING) {
+                return false;
+            }
+            if (session.state != SessionState::SENDING_FILE) {
+                if (session.listing) {
+                    continueListing(session);
+                    continue;
+                }
+                if (session.signing) {
+                    continueSignatures(session);
+                    continue;
+                }
+                if (session.archive) {
+                    size_t allowance = shapedGrant(session, ARCHIVE_BATCH);
+                    if (allowance == 0) {
+                        return true; // Parked by the shaper
+                    }
+                    continueArchive(session, allowance);
+                    continue;
+                }
+                if (session.pipeline.empty()) {
+                    return true;
+                }
+                size_t allowance = shapedGrant(session, PIPELINE_SLICE);
+                if (allowance == 0) {
+                    return true;
+                }
+                if (!startSlice(session, allowance)) {
+                    return false;
+                }
+                continue;
+            }
+
+            size_t allowance = shapedGrant(session, session.file_size - session.file_offset);
+            if (allowance == 0 && session.file_offset < session.file_size) {
+                return true; // Parked by the shaper
+            }
+            if (!pumpDownload(session, session.file_offset + allowance)) {
+                return false;
+            }
+            if (session.state == SessionState::SENDING_FILE) {
+                return true; // Socket is full or the shaper's allowance used up; wait for EPOLLOUT
+            }
+
+            // Download done: pick up anything the client sent meanwhile
+            processInput(session);
+            if (!readInput(session)) {
+                return false;
+            }
+        }
+    }
+
+    void closeSession(Session& session) {
+        if (session.state != SessionState::CLOSING) {
+            std::cout << "✗ Client disconnected" << std::endl;
+            if (session.is_authenticated) {
+                logActivity(session, "DISCONNECTED");
+            }
+        }
+        if (transferring(session) && session.state != SessionState::CLOSING) {
+            metrics.add(TRANSFERS_INTERRUPTED);
+        }
+        if (session.state == SessionState::RECEIVING_FILE ||
+            session.state == SessionState::AWAIT_UPLOAD_TRAILER) {
+            // Make what arrived durable so RESUME can report it after a crash
+            long kept = session.file_offset;
+            if (session.chunk_writer) {
+                session.chunk_writer->sync();
+                kept = session.chunk_writer->committedBytes(); // The unchunked tail is dropped
             } else {
-                help = "Available Commands:\n"
-                       "  LIST                - List all files\n"
-                       "  INFO <file>         - Get file information\n"
-                       "  DOWNLOAD <file>     - Download a file\n"
-                       "  UPLOAD <file>       - Upload a file\n"
-                       "  LOGOUT              - Logout from server\n"
-                       "  HELP                - Show this help\n"
-                       "  EXIT                - Disconnect\n";
+                fdatasync(session.file_fd);
             }
-            sendMessage(help);
+            logActivity(session, "UPLOAD INTERRUPTED - " + session.transfer_name + " (" +
+                        std::to_string(kept) + " bytes kept)");
         }
-        else if (cmd == "EXIT") {
-            if (is_authenticated) {
-                logActivity("DISCONNECT");
+        endTrace(session, "interrupted");
+        for (Transfer& transfer : session.pipeline) {
+            if (transfer.trace) {
+                transfer.trace->arg("end offset", transfer.file_offset);
+                transfer.trace->setOutcome("interrupted");
             }
-            sendMessage("Goodbye!\n");
         }
-        else {
-            sendMessage("ERROR: Unknown command. Type HELP for available commands.\n");
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session.socket_fd, nullptr);
+        shaper.idle(session.flow);
+        admission.release(session.client_ip);
+
+        std::lock_guard<std::mutex> guard(sessions_lock);
+        sessions.erase(session.socket_fd);
+    }
+
+    // Epoll interest for a session that has just been serviced. Only ask for
+    // EPOLLOUT while output is actually blocked, otherwise re-arming a
+    // writable socket would fire again immediately.
+    uint32_t sessionInterest(const Session& session) {
+        uint32_t events = EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+        if (session.inbuf.size() < MAX_INPUT_BUFFER) {
+            events |= EPOLLIN;
         }
+        if (session.out_offset != 0 || session.state == SessionState::SENDING_FILE ||
+            session.slice_active || !session.pipeline.empty() || session.listing || session.signing ||
+            session.archive) {
+            events |= EPOLLOUT;
+        }
+        return events;
     }
 
-public:
-    FileServer() : server_fd(0), client_socket(0), addrlen(sizeof(address)), 
-                   is_authenticated(false), current_user(""), client_ip("") {
-        address = {};
+    // True while file data is still to be moved for the session
+    static bool transferring(const Session& session) {
+        return session.state == SessionState::SENDING_FILE || session.state == SessionState::RECEIVING_FILE ||
+               session.state == SessionState::RECEIVING_ARCHIVE || !session.pipeline.empty() ||
+               session.slice_active || session.archive;
     }
 
-    bool initialize() {
-        loadUsers();
-        
-        struct stat st = {0};
-        if (stat(SHARED_DIR, &st) == -1) {
-            if (mkdir(SHARED_DIR, 0755) == 0) {
-                std::cout << "✓ Created shared directory: " << SHARED_DIR << std::endl;
+    bool armSession(Session& session, int op) {
+        struct epoll_event ev = {};
+        ev.events = sessionInterest(session);
+        ev.data.ptr = &session;
+        return epoll_ctl(epoll_fd, op, session.socket_fd, &ev) == 0;
+    }
+
+    // Until the next event, a traced transfer is waiting on the shaper or the
+    // socket. A trace still open outside a transfer belongs to a request
+    // that was refused, so it is written out now.
+    void traceIdle(Session& session) {
+        if (session.parked_ms > 0) {
+            session.trace->wait("throttled");
+        } else if (session.state == SessionState::SENDING_FILE) {
+            session.trace->wait("socket full");
+        } else if (session.state == SessionState::RECEIVING_FILE) {
+            session.trace->wait("awaiting data");
+        } else if (session.state == SessionState::AWAIT_COMMAND) {
+            endTrace(session, "rejected");
+        }
+    }
+
+    // Runs on a pool worker: service the session, then hand it back to epoll
+    void handleEvent(size_t worker, SessionEvent& event) {
+        Session& session = *event.session;
+        session.ring = worker_rings.empty() ? nullptr : worker_rings[worker].get();
+        session.worker = worker;
+        if (session.trace) {
+            session.trace->resume();
+        }
+        bool alive = serviceSession(session, event.events);
+        // Back on this worker's shelf before the session can reach another worker
+        session.buffer.release();
+        session.tracing = nullptr;
+        if (alive && session.trace) {
+            traceIdle(session);
+        }
+        if (alive && session.parked_ms > 0) {
+            // Held back by the shaper: the pool keeps the session until it has
+            // credit again, so it is never armed in epoll at the same time
+            std::chrono::milliseconds wait(session.parked_ms);
+            session.parked_ms = 0;
+            pool->submitAfter({&session, EPOLLIN | EPOLLOUT}, session.home_worker, wait);
+            return;
+        }
+        if (alive && session.flow.active && !transferring(session)) {
+            shaper.idle(session.flow); // Stop holding up other transfers' rounds
+        }
+        if (!alive || !armSession(session, EPOLL_CTL_MOD)) {
+            closeSession(session);
+        }
+    }
+
+    // Turns away a connection admission control refused: one non-blocking
+    // send of the BUSY line in place of the welcome banner, then close
+    void refuseConnection(int client_socket, const std::string& ip, const std::string& reason, long retry_ms) {
+        std::string busy = std::string(BUSY_REPLY) + " " + std::to_string(retry_ms) + " Server busy: " + reason +
+                           ", retry after " + std::to_string(retry_ms) + " ms\n";
+        send(client_socket, busy.data(), busy.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+        close(client_socket);
+        activity_log.append(ip, "ANONYMOUS", "REFUSED - " + reason);
+    }
+
+    // Sets up a session for a freshly accepted socket and hands it to epoll.
+    // Runs on the acceptor threads.
+    void addSession(int client_socket, const struct sockaddr_in& client_addr) {
+        char ip_buffer[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &(client_addr.sin_addr), ip_buffer, INET_ADDRSTRLEN);
+        std::string ip(ip_buffer);
+
+        std::string reason;
+        long retry_ms = 0;
+        if (!admission.admit(ip, reason, retry_ms)) {
+            refuseConnection(client_socket, ip, reason, retry_ms);
+            return;
+        }
+
+        metrics.add(CONNECTIONS_ACCEPTED);
+        std::cout << "✓ Client connected from " << ip_buffer
+                  << ":" << ntohs(client_addr.sin_port) << std::endl;
+
+        auto session = std::make_unique<Session>(client_socket, ip);
+        Session& s = *session;
+        s.home_worker = next_worker++ % pool->size();
+
+        logActivity(s, "CONNECTED");
+
+        std::string welcome =
+            "=== Secure File Sharing Server ===\n"
+            "Please login to continue.\n"
+            "Type HELP to see available commands\n\n";
+        sendMessage(s, welcome);
+        if (!flushOutput(s)) {
+            admission.release(ip);
+            return; // Session destructor closes the socket
+        }
+
+        // Once armed a worker may pick it up, so publish it first
+        {
+            std::lock_guard<std::mutex> guard(sessions_lock);
+            sessions[client_socket] = std::move(session);
+        }
+        if (!armSession(s, EPOLL_CTL_ADD)) {
+            perror("epoll_ctl failed");
+            admission.release(ip);
+            std::lock_guard<std::mutex> guard(sessions_lock);
+            sessions.erase(client_socket);
+        }
+    }
+
+    // Acceptor thread: blocks in accept() on its own listener until the
+    // server stops
+    void acceptConnections(Acceptor& acceptor) {
+        while (!stopping) {
+            struct sockaddr_in client_addr = {};
+            socklen_t client_len = sizeof(client_addr);
+
+            int client_socket = accept4(acceptor.listen_fd, (struct sockaddr *)&client_addr,
+                                        &client_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (client_socket < 0) {
+                if (stopping || errno == EINVAL) {
+                    return; // Listener shut down
+                }
+                if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                    // Retrying at once would just spin
+                    perror("Accept failed");
+                    std::this_thread::sleep_for(std::chrono::milliseconds(ACCEPT_BACKOFF_MS));
+                }
+                continue; // EINTR, or a connection that died in the backlog
+            }
+            addSession(client_socket, client_addr);
+        }
+    }
+
+    void postAccept(Acceptor& acceptor, uint64_t slot) {
+        AcceptSlot& target = acceptor.slots[slot];
+        target.addr_len = sizeof(target.addr);
+        acceptor.ring->prepAccept(acceptor.listen_fd, (struct sockaddr *)&target.addr, &target.addr_len,
+                                  SOCK_NONBLOCK | SOCK_CLOEXEC, slot);
+    }
+
+    // io_uring engine: the listener always has ACCEPT_BATCH accepts posted.
+    // The acceptor sleeps in io_uring_enter() until some have completed;
+    // each becomes a session and its slot is re-posted, all in one call.
+    void reapAccepts(Acceptor& acceptor) {
+        static const __kernel_timespec backoff = {0, ACCEPT_BACKOFF_MS * 1000 * 1000};
+        IoRing& ring = *acceptor.ring;
+        io_uring_cqe cqe;
+        while (ring.wait(cqe)) {
+            do {
+                if (stopping) {
+                    return; // Shutting the listener down fails the posted accepts
+                }
+                uint64_t slot = cqe.user_data & ~ACCEPT_RETRY;
+                if (cqe.user_data & ACCEPT_RETRY) {
+                    postAccept(acceptor, slot);
+                    continue;
+                }
+                if (cqe.res >= 0) {
+                    addSession(cqe.res, acceptor.slots[slot].addr);
+                } else if (cqe.res != -EAGAIN && cqe.res != -EINTR && cqe.res != -ECONNABORTED) {
+                    // Out of descriptors or memory: re-posting at once would just spin
+                    errno = -cqe.res;
+                    perror("Accept failed");
+                    ring.prepTimeout(&backoff, slot | ACCEPT_RETRY);
+                    continue;
+                }
+                postAccept(acceptor, slot);
+            } while (ring.pop(cqe));
+            if (!ring.submit()) {
+                perror("io_uring_enter failed");
+                return;
             }
         }
+    }
 
-        if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
+    // A listening socket on PORT, shared with the other acceptors' through
+    // SO_REUSEPORT; -1 on failure
+    static int openListener() {
+        int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0) {
             perror("Socket creation failed");
-            return false;
+            return -1;
         }
 
         int opt = 1;
-        if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR | SO_REUSEPORT,
-                       &opt, sizeof(opt))) {
+        if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) ||
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt))) {
             perror("Setsockopt failed");
-            return false;
+            close(fd);
+            return -1;
         }
 
+        struct sockaddr_in address = {};
         address.sin_family = AF_INET;
         address.sin_addr.s_addr = INADDR_ANY;
         address.sin_port = htons(PORT);
 
-        if (bind(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        if (bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
             perror("Bind failed");
-            return false;
+            close(fd);
+            return -1;
         }
 
-        if (listen(server_fd, 3) < 0) {
+        if (listen(fd, LISTEN_BACKLOG) < 0) {
             perror("Listen failed");
-            return false;
+            close(fd);
+            return -1;
         }
+        return fd;
+    }
 
-        std::cout << "✓ Server initialized successfully" << std::endl;
-        std::cout << "✓ Listening on port " << PORT << std::endl;
-        std::cout << "✓ Shared directory: " << SHARED_DIR << std::endl;
-        std::cout << "✓ Logging to: " << LOG_FILE << std::endl;
-        return true;
+    // listen() quietly caps the backlog at net.core.somaxconn
+    static int effectiveBacklog() {
+        std::ifstream limit("/proc/sys/net/core/somaxconn");
+        int somaxconn = 0;
+        return (limit >> somaxconn && somaxconn > 0 && somaxconn < LISTEN_BACKLOG) ? somaxconn : LISTEN_BACKLOG;
     }
 
-    void acceptConnection() {
-        std::cout << "\nWaiting for client connection..." << std::endl;
-        
-        if ((client_socket = accept(server_fd, (struct sockaddr *)&address,
-                                   (socklen_t*)&addrlen)) < 0) {
-            perror("Accept failed");
-            return;
+    // Raises the descriptor limit as far as allowed and returns how many
+    // sessions fit in it (a socket each, and a file while transferring);
+    // 0 if there is no limit
+    static size_t sessionsForDescriptors() {
+        struct rlimit limit;
+        if (getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+            return 0;
+        }
+        if (limit.rlim_cur < limit.rlim_max) {
+            rlim_t soft = limit.rlim_cur;
+            limit.rlim_cur = limit.rlim_max;
+            if (setrlimit(RLIMIT_NOFILE, &limit) != 0) {
+                limit.rlim_cur = soft;
+            }
         }
+        if (limit.rlim_cur == RLIM_INFINITY) {
+            return 0;
+        }
+        return limit.rlim_cur > FD_RESERVE * 2 ? (limit.rlim_cur - FD_RESERVE) / 2 : FD_RESERVE / 2;
+    }
 
-        char ip_buffer[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &(address.sin_addr), ip_buffer, INET_ADDRSTRLEN);
-        client_ip = std::string(ip_buffer);
-        
-        std::cout << "✓ Client connected from " << client_ip 
-                  << ":" << ntohs(address.sin_port) << std::endl;
-        
-        is_authenticated = false;
-        current_user = "";
-        logActivity("CONNECTED");
+    // The /metrics page: the recorded counters and histograms, then gauges
+    // read from the server's state at scrape time
+    void renderMetrics(std::string& page) {
+        metrics.render(page);
+        Metrics::describe(page, "fileserver_sessions", "gauge", "Open client sessions.");
+        Metrics::sample(page, "fileserver_sessions", admission.sessions());
+        Metrics::describe(page, "fileserver_connections_refused_total", "counter",
+                          "Connections turned away with BUSY by admission control.");
+        Metrics::sample(page, "fileserver_connections_refused_total", admission.refusedTotal());
+        Metrics::describe(page, "fileserver_file_cache_bytes", "gauge", "Memory held by the hot-file cache.");
+        Metrics::sample(page, "fileserver_file_cache_bytes", file_cache.usedBytes());
+        Metrics::describe(page, "fileserver_worker_threads", "gauge", "Threads servicing sessions.");
+        Metrics::sample(page, "fileserver_worker_threads", pool->size());
+    }
+
+    void startAcceptors() {
+        for (auto& acceptor : acceptors) {
+            Acceptor* target = acceptor.get();
+            target->thread = std::thread([this, target]() {
+                if (target->ring) {
+                    reapAccepts(*target);
+                } else {
+                    acceptConnections(*target);
+                }
+            });
+        }
+    }
+
+    // Shuts the listeners down, which wakes the acceptors out of accept(),
+    // and waits for them
+    void stopAcceptors() {
+        stopping = true;
+        for (auto& acceptor : acceptors) {
+            if (acceptor->thread.joinable()) {
+                shutdown(acceptor->listen_fd, SHUT_RDWR);
+                acceptor->thread.join();
+            }
+        }
+    }
+
+    // Creates each acceptor's accept ring and one ring per worker, each
+    // worker's with two registered transfer buffers; false if this kernel
+    // won't run io_uring
+    bool setupRings() {
+        for (auto& acceptor : acceptors) {
+            acceptor->ring = std::make_unique<IoRing>();
+            if (!acceptor->ring->setup(ACCEPT_BATCH)) {
+                return false;
+            }
+            acceptor->slots.resize(ACCEPT_BATCH);
+            for (uint64_t slot = 0; slot < ACCEPT_BATCH; slot++) {
+                postAccept(*acceptor, slot);
+            }
+            if (!acceptor->ring->submit()) {
+                return false;
+            }
+        }
+
+        for (size_t i = 0; i < pool->size(); i++) {
+            auto ring = std::make_unique<IoRing>();
+            if (!ring->setup(RING_ENTRIES)) {
+                return false;
+            }
+            ring->addBuffers(2, RING_BUFFER);
+            worker_rings.push_back(std::move(ring));
+        }
+        return true;
     }
 
-    void handleClient() {
-        char buffer[BUFFER_SIZE] = {0};
+public:
+    explicit FileServer(const ServerConfig& cfg)
+        : epoll_fd(-1), config(cfg), activity_log(LOG_FILE, cfg.log_max_bytes, cfg.log_fsync), next_worker(0),
+          stopping(false) {}
+
+    bool initialize() {
+        if (!loadUsers()) {
+            perror("Cannot load users");
+            return false;
+        }
         
-        std::string welcome = 
-            "=== Secure File Sharing Server ===\n"
-            "Please login to continue.\n"
-            "Type HELP to see available commands\n\n";
-        sendMessage(welcome);
+        struct stat st = {0};
+        if (stat(SHARED_DIR, &st) == -1) {
+            if (mkdir(SHARED_DIR, 0755) == 0) {
+                std::cout << "✓ Created shared directory: " << SHARED_DIR << std::endl;
+            }
+        }
 
-        while (true) {
-            memset(buffer, 0, BUFFER_SIZE);
-            
-            int bytes_read = read(client_socket, buffer, BUFFER_SIZE);
-            
-            if (bytes_read <= 0) {
-                std::cout << "✗ Client disconnected" << std::endl;
-                if (is_authenticated) {
-                    logActivity("DISCONNECTED");
-                }
-                break;
+        file_cache.setCapacity(config.cache_bytes);
+        // The stat() per cache hit catches changes too; this just frees memory sooner
+        dir_cache.onChange([this](const std::string& name) { file_cache.invalidate(name); });
+        if (!dir_cache.load(SHARED_DIR)) {
+            perror("Cannot open shared directory");
+            return false;
+        }
+
+        // Always opened: deduplicated files stay downloadable without --dedup
+        if (!chunk_store.open(CHUNK_STORE_DIR)) {
+            perror("Cannot open chunk store");
+            return false;
+        }
+
+        for (size_t i = 0; i < std::max<size_t>(config.acceptors, 1); i++) {
+            auto acceptor = std::make_unique<Acceptor>();
+            if ((acceptor->listen_fd = openListener()) < 0) {
+                return false;
             }
+            acceptors.push_back(std::move(acceptor));
+        }
+
+        size_t fit = sessionsForDescriptors();
+        if (fit > 0 && (config.max_sessions == 0 || config.max_sessions > fit)) {
+            std::cout << "✗ Descriptor limit leaves room for about " << fit << " sessions; capping there"
+                      << std::endl;
+            config.max_sessions = fit;
+        }
+        admission.configure(config.max_sessions, config.max_per_ip);
 
-            std::string command(buffer);
-            if (!command.empty() && command.back() == '\n') {
-                command.pop_back();
+        if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+            perror("epoll_create1 failed");
+            return false;
+        }
+
+        std::cout << "✓ Server initialized successfully" << std::endl;
+        std::cout << "✓ Listening on port " << PORT << " (" << acceptors.size() << " acceptor"
+                  << (acceptors.size() == 1 ? "" : "s") << ", backlog " << effectiveBacklog() << " each)"
+                  << std::endl;
+        auto cap = [](size_t limit) { return limit > 0 ? std::to_string(limit) : std::string("unlimited"); };
+        std::cout << "✓ Admission: " << cap(config.max_sessions) << " sessions, " << cap(config.max_per_ip)
+                  << " per address" << std::endl;
+        std::cout << "✓ Shared directory: " << SHARED_DIR << " (" << dir_cache.size() << " entries cached"
+                  << (dir_cache.watching() ? ", inotify" : ", rescanned per LIST") << ")" << std::endl;
+        std::cout << "✓ Logging to: " << LOG_FILE;
+        if (config.log_max_bytes > 0) {
+            std::cout << " (rotated at " << formatFileSize(config.log_max_bytes) << ")";
+        }
+        std::cout << (config.log_fsync ? ", fsync per batch" : "") << std::endl;
+        if (file_cache.enabled()) {
+            std::cout << "✓ Hot-file cache: " << formatFileSize(config.cache_bytes) << " (files up to "
+                      << formatFileSize(file_cache.maxFileSize()) << ")" << std::endl;
+        }
+        shaper.configure(config.rate_limit, config.user_rate, config.conn_rate);
+        if (shaper.enabled()) {
+            auto rate = [this](double limit) {
+                return limit > 0 ? formatFileSize(static_cast<long>(limit)) + "/s" : std::string("unlimited");
+            };
+            std::cout << "✓ Bandwidth shaping: server " << rate(config.rate_limit) << ", per user "
+                      << rate(config.user_rate) << " × weight, per connection " << rate(config.conn_rate)
+                      << std::endl;
+        }
+        if (config.dedup) {
+            std::cout << "✓ Deduplicating uploads into: " << CHUNK_STORE_DIR << std::endl;
+        }
+        if (config.compress) {
+#ifdef WITH_ZSTD
+            std::cout << "✓ Transfer compression: lz4, zstd" << std::endl;
+#else
+            std::cout << "✓ Transfer compression: lz4" << std::endl;
+#endif
+        }
+
+        pool = std::make_unique<WorkerPool<SessionEvent>>(config.workers,
+            [this](size_t worker, SessionEvent& event) { handleEvent(worker, event); });
+        std::cout << "✓ Worker threads: " << pool->size() << std::endl;
+        buffer_pool = std::make_unique<BufferPool>(pool->size());
+
+        if (config.io_uring && !setupRings()) {
+            std::cout << "✗ io_uring unavailable (" << strerror(errno) << "), using epoll and plain I/O"
+                      << std::endl;
+            worker_rings.clear();
+            for (auto& acceptor : acceptors) {
+                acceptor->ring.reset();
+                acceptor->slots.clear();
             }
+            config.io_uring = false;
+        }
+        if (config.io_uring) {
+            std::cout << "✓ I/O engine: io_uring (" << ACCEPT_BATCH << " accepts posted per acceptor, "
+                      << (worker_rings[0]->buffersRegistered() ? "registered" : "unregistered")
+                      << " buffers)" << std::endl;
+        }
 
-            if (command == "EXIT") {
-                sendMessage("Goodbye!\n");
-                std::cout << "Client requested disconnection" << std::endl;
-                break;
+        if (config.metrics_port > 0) {
+            if (metrics_endpoint.start(config.metrics_port, [this](std::string& page) { renderMetrics(page); })) {
+                std::cout << "✓ Metrics: http://127.0.0.1:" << config.metrics_port << "/metrics" << std::endl;
+            } else {
+                std::cout << "✗ Metrics port " << config.metrics_port << " unavailable (" << strerror(errno)
+                          << "), serving without metrics" << std::endl;
             }
+        }
 
-            processCommand(command);
+        if (config.trace_sample > 0) {
+            if (tracer.open(config.trace_file, config.trace_sample, "fileserver")) {
+                std::cout << "✓ Tracing 1 in " << config.trace_sample << " transfers to " << config.trace_file
+                          << std::endl;
+            } else {
+                std::cout << "✗ Cannot open " << config.trace_file << " (" << strerror(errno)
+                          << "), serving without tracing" << std::endl;
+            }
         }
 
-        close(client_socket);
+        // Epoll only watches sessions; connections arrive on the acceptor threads
+        startAcceptors();
+        return true;
     }
 
     void run() {
@@ -644,24 +3803,95 @@ public:
             return;
         }
 
+        std::cout << "\nWaiting for client connections..." << std::endl;
+
+        struct epoll_event events[MAX_EVENTS];
+
         while (true) {
-            acceptConnection();
-            handleClient();
+            int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+            if (ready < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("epoll_wait failed");
+                return;
+            }
+
+            for (int i = 0; i < ready; i++) {
+                Session* session = static_cast<Session*>(events[i].data.ptr);
+                pool->submit({session, events[i].events}, session->home_worker);
+            }
         }
     }
 
     ~FileServer() {
-        if (server_fd > 0) {
-            close(server_fd);
+        metrics_endpoint.stop();
+        stopAcceptors(); // No new sessions while the rest shuts down
+        pool.reset(); // Join workers before tearing down their sessions
+        sessions.clear();
+        if (epoll_fd >= 0) {
+            close(epoll_fd);
         }
         std::cout << "Server shutdown complete" << std::endl;
     }
 };
 
-int main() {
+int main(int argc, char const *argv[]) {
     std::cout << "=== Secure File Sharing Server (Day 5) ===" << std::endl;
     
-    FileServer server;
+    ServerConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) {
+            config.workers = std::stoul(argv[++i]);
+        } else if (arg == "--no-sendfile") {
+            config.use_sendfile = false;
+        } else if (arg == "--no-splice") {
+            config.use_splice = false;
+        } else if (arg == "--log-max-mb" && i + 1 < argc) {
+            config.log_max_bytes = std::stoul(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--log-fsync") {
+            config.log_fsync = true;
+        } else if (arg == "--dedup") {
+            config.dedup = true;
+        } else if (arg == "--no-compress") {
+            config.compress = false;
+        } else if (arg == "--io-uring") {
+            config.io_uring = true;
+        } else if (arg == "--cache-mb" && i + 1 < argc) {
+            config.cache_bytes = std::stoul(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--rate-mb" && i + 1 < argc) {
+            config.rate_limit = std::stod(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--user-rate-mb" && i + 1 < argc) {
+            config.user_rate = std::stod(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--conn-rate-mb" && i + 1 < argc) {
+            config.conn_rate = std::stod(argv[++i]) * 1024 * 1024;
+        } else if (arg == "--acceptors" && i + 1 < argc) {
+            config.acceptors = std::stoul(argv[++i]);
+        } else if (arg == "--max-sessions" && i + 1 < argc) {
+            config.max_sessions = std::stoul(argv[++i]);
+        } else if (arg == "--max-per-ip" && i + 1 < argc) {
+            config.max_per_ip = std::stoul(argv[++i]);
+        } else if (arg == "--metrics-port" && i + 1 < argc) {
+            config.metrics_port = std::stoi(argv[++i]);
+        } else if (arg == "--trace-sample" && i + 1 < argc) {
+            config.trace_sample = std::stoul(argv[++i]);
+        } else if (arg == "--trace-file" && i + 1 < argc) {
+            config.trace_file = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--workers N] [--no-sendfile] [--no-splice]"
+                      << " [--log-max-mb N] [--log-fsync] [--dedup] [--no-compress] [--io-uring]"
+                      << " [--cache-mb N] [--rate-mb N] [--user-rate-mb N] [--conn-rate-mb N]"
+                      << " [--acceptors N] [--max-sessions N] [--max-per-ip N] [--metrics-port N]"
+                      << " [--trace-sample N] [--trace-file PATH]" << std::endl;
+            return 1;
+        }
+    }
+
+    // A client vanishing mid-transfer must not take the whole server down
+    signal(SIGPIPE, SIG_IGN);
+
+    FileServer server(config);
     server.run();
 
     return 0;
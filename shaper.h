@@ -0,0 +1,257 @@
+// shaper.h - Bandwidth limits and fair sharing between transfers
+//
+// Every byte of file data a connection moves is paid for from three token
+// buckets: the server's, its user's (scaled by the weight in users.txt) and
+// its own. A transfer may move data while all of them are in credit. What it
+// actually moved is charged afterwards, so a bucket runs into debt by at most
+// one grant, and a transfer that finds a bucket in debt is parked until the
+// bucket has refilled.
+//
+// When the server bucket is limited, its bandwidth is shared by deficit
+// round robin. In every round each active transfer may move a quantum of
+// SHAPER_QUANTUM times its user's weight. Once it has spent that, it waits
+// for the round to end. A round ends when every active transfer has spent
+// its quantum, or when the server bucket fills up because nobody is using it.
+// A new transfer starts with a full quantum, so a small request goes out at
+// once, ahead of bulk transfers, which split what is left by weight.
+#ifndef SHAPER_H
+#define SHAPER_H
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#define SHAPER_QUANTUM (64 * 1024)     // Bytes per round for a transfer of weight 1
+#define SHAPER_BURST_MS 100            // Bucket depth in milliseconds of its rate (at least one quantum)
+#define SHAPER_MAX_WAIT_MS 50          // Longest a parked transfer sleeps before asking again
+
+class TokenBucket {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    double rate;            // Bytes per second; 0 = unlimited
+    double depth;
+    double tokens;
+    Clock::time_point last;
+
+public:
+    TokenBucket() : rate(0), depth(0), tokens(0), last(Clock::now()) {}
+
+    // A new rate starts with a full bucket
+    void setRate(double bytes_per_second) {
+        if (bytes_per_second == rate) {
+            return;
+        }
+        rate = bytes_per_second;
+        depth = std::max(rate * SHAPER_BURST_MS / 1000, static_cast<double>(SHAPER_QUANTUM));
+        tokens = depth;
+    }
+
+    bool limited() const { return rate > 0; }
+    bool full() const { return tokens >= depth; }
+    double burst() const { return depth; }
+    double bytesPerSecond() const { return rate; }
+
+    void refill(Clock::time_point now) {
+        if (rate > 0) {
+            tokens = std::min(depth, tokens + rate * std::chrono::duration<double>(now - last).count());
+        }
+        last = now;
+    }
+
+    void charge(size_t bytes) {
+        if (rate > 0) {
+            tokens -= bytes;
+        }
+    }
+
+    // Seconds until the bucket is out of debt
+    double debtSeconds() const {
+        return (rate > 0 && tokens < 0) ? -tokens / rate : 0;
+    }
+};
+
+// Shaping state of one connection
+struct ShapedFlow {
+    TokenBucket connection;
+    TokenBucket* user;      // Shared by all of the user's connections; null until login
+    unsigned weight;
+    bool active;            // Has a transfer in progress and takes part in the rounds
+    uint64_t round;         // Round the deficit belongs to
+    long deficit;           // Bytes left of this round's quantum
+
+    ShapedFlow() : user(nullptr), weight(1), active(false), round(0), deficit(0) {}
+};
+
+class TransferShaper {
+private:
+    typedef std::chrono::steady_clock Clock;
+
+    std::mutex lock;
+    bool shaping;           // Fixed by configure() before any transfer; read without the lock
+    double user_rate;       // Per weight unit
+    double connection_rate;
+    TokenBucket server;
+    std::unordered_map<std::string, std::unique_ptr<TokenBucket>> users;
+    uint64_t round;
+    size_t active;          // Flows taking part in the current round
+    size_t spent;           // Of those, flows that have used up their quantum
+
+    long quantum(const ShapedFlow& flow) const {
+        return static_cast<long>(SHAPER_QUANTUM) * flow.weight;
+    }
+
+    void nextRound() {
+        round++;
+        spent = 0;
+    }
+
+    // Gives flow its quantum for the current round, less any overdraft
+    void enterRound(ShapedFlow& flow) {
+        if (flow.round == round) {
+            return;
+        }
+        flow.round = round;
+        flow.deficit = std::min(flow.deficit, 0L) + quantum(flow);
+        if (flow.deficit <= 0 && ++spent >= active) {
+            nextRound();
+        }
+    }
+
+    static std::chrono::milliseconds clampWait(double seconds) {
+        long ms = static_cast<long>(seconds * 1000) + 1;
+        return std::chrono::milliseconds(std::min<long>(ms, SHAPER_MAX_WAIT_MS));
+    }
+
+public:
+    TransferShaper() : shaping(false), user_rate(0), connection_rate(0), round(0), active(0), spent(0) {}
+
+    TransferShaper(const TransferShaper&) = delete;
+    TransferShaper& operator=(const TransferShaper&) = delete;
+
+    // Limits in bytes per second; 0 = unlimited. All 0 turns shaping off,
+    // and every other call returns at once.
+    void configure(double server_rate, double per_user_rate, double per_connection_rate) {
+        std::lock_guard<std::mutex> guard(lock);
+        server.setRate(server_rate);
+        user_rate = per_user_rate;
+        connection_rate = per_connection_rate;
+        shaping = server_rate > 0 || per_user_rate > 0 || per_connection_rate > 0;
+    }
+
+    bool enabled() const {
+        return shaping;
+    }
+
+    // Ties a connection to its user's bucket and weight (at login)
+    void bind(ShapedFlow& flow, const std::string& username, unsigned weight) {
+        if (!shaping) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        flow.weight = std::max(1u, weight);
+        flow.connection.setRate(connection_rate);
+        std::unique_ptr<TokenBucket>& bucket = users[username];
+        if (!bucket) {
+            bucket = std::make_unique<TokenBucket>();
+        }
+        // The latest login sets the rate, so a weight change applies without a restart
+        bucket->setRate(user_rate * flow.weight);
+        flow.user = bucket.get();
+    }
+
+    // How many bytes flow may move now, at most wanted. 0 means the flow is
+    // parked and should ask again after wait.
+    size_t grant(ShapedFlow& flow, size_t wanted, std::chrono::milliseconds& wait) {
+        if (!shaping) {
+            return wanted;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        Clock::time_point now = Clock::now();
+        server.refill(now);
+        flow.connection.refill(now);
+        if (flow.user) {
+            flow.user->refill(now);
+        }
+        if (!flow.active) {
+            flow.active = true;
+            flow.round = round - 1; // Fresh quantum below
+            active++;
+        }
+        enterRound(flow);
+
+        double debt = std::max(server.debtSeconds(), flow.connection.debtSeconds());
+        if (flow.user) {
+            debt = std::max(debt, flow.user->debtSeconds());
+        }
+        if (debt > 0) {
+            wait = clampWait(debt);
+            return 0;
+        }
+
+        // No grant may overdraw a bucket by more than its depth
+        const TokenBucket* buckets[] = {&server, &flow.connection, flow.user};
+        for (const TokenBucket* bucket : buckets) {
+            if (bucket && bucket->limited()) {
+                wanted = std::min<size_t>(wanted, bucket->burst());
+            }
+        }
+
+        if (server.limited()) {
+            if (flow.deficit <= 0 && server.full()) {
+                nextRound(); // Bandwidth is going unused; don't hold anyone back
+                enterRound(flow);
+            }
+            if (flow.deficit <= 0) {
+                wait = clampWait(static_cast<double>(quantum(flow)) / server.bytesPerSecond());
+                return 0;
+            }
+            wanted = std::min<size_t>(wanted, flow.deficit);
+        }
+        return wanted;
+    }
+
+    // Records bytes flow has moved
+    void charge(ShapedFlow& flow, size_t bytes) {
+        if (!shaping || bytes == 0) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        server.charge(bytes);
+        flow.connection.charge(bytes);
+        if (flow.user) {
+            flow.user->charge(bytes);
+        }
+        if (flow.active && flow.round == round) {
+            bool had_quantum = flow.deficit > 0;
+            flow.deficit -= bytes;
+            if (had_quantum && flow.deficit <= 0 && ++spent >= active) {
+                nextRound();
+            }
+        }
+    }
+
+    // flow has no transfer in progress any more; it stops holding up rounds
+    void idle(ShapedFlow& flow) {
+        if (!flow.active) {
+            return;
+        }
+        std::lock_guard<std::mutex> guard(lock);
+        flow.active = false;
+        active--;
+        if (flow.round == round && flow.deficit <= 0) {
+            spent--;
+        }
+        flow.deficit = std::min(flow.deficit, 0L); // An overdraft is still owed next time
+        if (active > 0 && spent >= active) {
+            nextRound();
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,62 @@
+// admission_test.cpp - Session caps, overall and per client address
+#include <string>
+#include "check.h"
+#include "admission.h"
+
+static bool admit(AdmissionControl& admission, const std::string& address, std::string& reason, long& retry_ms) {
+    reason.clear();
+    retry_ms = -1;
+    return admission.admit(address, reason, retry_ms);
+}
+
+static void testLimits() {
+    AdmissionControl admission;
+    std::string reason;
+    long retry_ms;
+    admission.configure(3, 2);
+
+    CHECK(admit(admission, "10.0.0.1", reason, retry_ms));
+    CHECK(admit(admission, "10.0.0.1", reason, retry_ms));
+    CHECK(!admit(admission, "10.0.0.1", reason, retry_ms));
+    CHECK(reason == "too many connections from 10.0.0.1 (limit 2)");
+    CHECK(retry_ms >= ADMISSION_RETRY_MS && retry_ms < 2 * ADMISSION_RETRY_MS);
+
+    CHECK(admit(admission, "10.0.0.2", reason, retry_ms));
+    CHECK(!admit(admission, "10.0.0.3", reason, retry_ms));
+    CHECK(reason == "server at capacity (3 sessions)");
+    CHECK(admission.sessions() == 3);
+    CHECK(admission.refusedTotal() == 2);
+
+    // A session ending frees both its address's slot and the overall one
+    admission.release("10.0.0.1");
+    CHECK(admission.sessions() == 2);
+    CHECK(admit(admission, "10.0.0.3", reason, retry_ms));
+    CHECK(!admit(admission, "10.0.0.1", reason, retry_ms));
+    admission.release("10.0.0.3");
+    CHECK(admit(admission, "10.0.0.1", reason, retry_ms));
+
+    // Releasing an address with no sessions changes nothing
+    admission.release("10.0.0.9");
+    CHECK(admission.sessions() == 3);
+}
+
+static void testUnlimited() {
+    AdmissionControl admission;
+    std::string reason;
+    long retry_ms;
+    for (int i = 0; i < 1000; i++) {
+        CHECK(admit(admission, "10.0.0.1", reason, retry_ms));
+    }
+    CHECK(admission.sessions() == 1000);
+    for (int i = 0; i < 1000; i++) {
+        admission.release("10.0.0.1");
+    }
+    CHECK(admission.sessions() == 0);
+    CHECK(admission.refusedTotal() == 0);
+}
+
+int main() {
+    testLimits();
+    testUnlimited();
+    return checkResult("admission");
+}
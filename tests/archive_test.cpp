@@ -0,0 +1,99 @@
+// archive_test.cpp - ArchiveReader fed streams cut at every boundary
+#include <string>
+#include <vector>
+#include "check.h"
+#include "archive.h"
+
+struct Entry {
+    std::string name;
+    long size;
+    std::string body;
+    bool intact;
+    bool ended;
+};
+
+static std::string entry(const std::string& name, const std::string& body, bool corrupt = false) {
+    std::string out;
+    appendArchiveHeader(out, name, body.size());
+    out += body;
+    return out + checksumTrailer(crc32c(0, body.data(), body.size()) ^ (corrupt ? 1 : 0));
+}
+
+// Feeds stream in pieces of at most step bytes
+static bool unpack(ArchiveReader& reader, const std::string& stream, size_t step, std::vector<Entry>& entries) {
+    auto begin = [&](const std::string& name, long size) {
+        entries.push_back({name, size, "", false, false});
+    };
+    auto body = [&](const char* data, size_t length) {
+        entries.back().body.append(data, length);
+    };
+    auto end = [&](bool intact) {
+        entries.back().intact = intact;
+        entries.back().ended = true;
+    };
+    for (size_t at = 0; at < stream.size(); at += step) {
+        if (!reader.feed(stream.data() + at, std::min(step, stream.size() - at), begin, body, end)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void testBoundaries() {
+    std::string stream = entry("a.txt", "hello") + entry("empty", "") + entry("b.bin", std::string(1000, '\n')) +
+                         entry("bad", "data", true);
+    for (size_t step = 1; step <= stream.size(); step++) {
+        ArchiveReader reader;
+        std::vector<Entry> entries;
+        CHECK(unpack(reader, stream, step, entries));
+        CHECK(reader.idle());
+        CHECK(entries.size() == 4);
+        if (entries.size() != 4) {
+            continue;
+        }
+        CHECK(entries[0].name == "a.txt" && entries[0].size == 5 && entries[0].body == "hello" && entries[0].intact);
+        CHECK(entries[1].name == "empty" && entries[1].body.empty() && entries[1].intact);
+        CHECK(entries[2].body == std::string(1000, '\n') && entries[2].intact);
+        CHECK(entries[3].ended && !entries[3].intact);
+    }
+}
+
+// Only a cut between entries leaves the reader idle
+static void testTruncated() {
+    std::string first = entry("a", "xyz");
+    std::string stream = first + entry("b", "uvw");
+    size_t header = strlen("FILE 3 a\n");   // begin() comes with the header's newline
+    for (size_t cut = 0; cut <= stream.size(); cut++) {
+        ArchiveReader reader;
+        std::vector<Entry> entries;
+        CHECK(unpack(reader, stream.substr(0, cut), 1, entries));
+        CHECK(reader.idle() == (cut == 0 || cut == first.size() || cut == stream.size()));
+        CHECK(entries.size() == (cut < header ? 0u : cut < first.size() + header ? 1u : 2u));
+    }
+}
+
+static void testMalformed() {
+    std::string bad[] = {
+        "DIR 3 a\nxyz",
+        "FILE x a\n",
+        "FILE -1 a\n",
+        "FILE 3 ../a\nxyz",
+        "FILE 3 a/b\nxyz",
+        "FILE 3 ..\nxyz",
+        "FILE 0 a\nno trailer\n",
+        "FILE 0 a\nCRC32C:123\n",
+        "FILE 1 " + std::string(ARCHIVE_LINE_MAX, 'n'),
+    };
+    for (const std::string& stream : bad) {
+        ArchiveReader reader;
+        std::vector<Entry> entries;
+        CHECK(!unpack(reader, stream, stream.size(), entries));
+    }
+}
+
+int main() {
+    testBoundaries();
+    testTruncated();
+    testMalformed();
+    return checkResult("archive");
+}
@@ -0,0 +1,31 @@
+// check.h - Minimal assertions for the programs under tests/
+//
+// Each test is a standalone program that "make test" builds and runs. A
+// failed CHECK() prints its file, line and condition and the test carries
+// on, so one run shows every failure; main() ends with checkResult(), which
+// is nonzero if anything failed.
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <cstdio>
+
+static int check_failures = 0;
+
+#define CHECK(condition)                                                                  \
+    do {                                                                                  \
+        if (!(condition)) {                                                               \
+            fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            check_failures++;                                                             \
+        }                                                                                 \
+    } while (0)
+
+inline int checkResult(const char* test) {
+    if (check_failures > 0) {
+        printf("✗ %s: %d checks failed\n", test, check_failures);
+        return 1;
+    }
+    printf("✓ %s passed\n", test);
+    return 0;
+}
+
+#endif
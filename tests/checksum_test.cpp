@@ -0,0 +1,80 @@
+// checksum_test.cpp - CRC32C against published vectors and a bitwise
+// reference, across the lengths and alignments each code path handles
+#include <random>
+#include <string>
+#include "check.h"
+#include "checksum.h"
+
+// One bit at a time, straight from the polynomial
+static uint32_t reference(uint32_t crc, const std::string& data) {
+    crc = ~crc;
+    for (unsigned char c : data) {
+        crc ^= c;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+    }
+    return ~crc;
+}
+
+static uint32_t crc(const std::string& data) {
+    return crc32c(0, data.data(), data.size());
+}
+
+// RFC 3720, appendix B.4, plus the usual check value
+static void testKnownVectors() {
+    std::string ascending, descending;
+    for (int i = 0; i < 32; i++) {
+        ascending += static_cast<char>(i);
+        descending += static_cast<char>(31 - i);
+    }
+    CHECK(crc("") == 0);
+    CHECK(crc("123456789") == 0xE3069283);
+    CHECK(crc(std::string(32, '\0')) == 0x8A9136AA);
+    CHECK(crc(std::string(32, '\xFF')) == 0x62A8AB43);
+    CHECK(crc(ascending) == 0x46DD794E);
+    CHECK(crc(descending) == 0x113FDB5C);
+}
+
+// Lengths around the hardware loop's stride boundaries, at every alignment
+static void testAgainstReference() {
+    std::mt19937 random(5);
+    std::string data(3 * CRC32C_LONG * 2 + 64, '\0');
+    for (char& c : data) {
+        c = static_cast<char>(random());
+    }
+    size_t lengths[] = {1, 7, 8, 9, 3 * CRC32C_SHORT - 1, 3 * CRC32C_SHORT, 3 * CRC32C_SHORT + 5,
+                        3 * CRC32C_LONG - 1, 3 * CRC32C_LONG, 3 * CRC32C_LONG + 3 * CRC32C_SHORT + 13,
+                        2 * 3 * CRC32C_LONG};
+    for (size_t length : lengths) {
+        for (size_t offset = 0; offset < 8; offset++) {
+            std::string piece = data.substr(offset, length);
+            CHECK(crc(piece) == reference(0, piece));
+        }
+    }
+}
+
+static void testChaining() {
+    std::string data = "The quick brown fox jumps over the lazy dog, repeatedly and at length.";
+    for (size_t split = 0; split <= data.size(); split++) {
+        uint32_t first = crc32c(0, data.data(), split);
+        CHECK(crc32c(first, data.data() + split, data.size() - split) == crc(data));
+    }
+}
+
+static void testTrailer() {
+    uint32_t value = 0;
+    CHECK(checksumTrailer(0xE3069283) == "CRC32C:e3069283\n");
+    CHECK(parseChecksumTrailer("CRC32C:e3069283\n", value) && value == 0xE3069283);
+    CHECK(parseChecksumTrailer("CRC32C:0000beef", value) && value == 0xBEEF);
+    CHECK(!parseChecksumTrailer("CRC32C:beef\n", value));
+    CHECK(!parseChecksumTrailer("MD5:e3069283\n", value));
+}
+
+int main() {
+    testKnownVectors();
+    testAgainstReference();
+    testChaining();
+    testTrailer();
+    return checkResult("checksum");
+}
@@ -0,0 +1,120 @@
+// compression_test.cpp - Block round trips, and decodeBlock on truncated
+// and corrupted blocks
+#include <random>
+#include <string>
+#include "check.h"
+#include "compression.h"
+
+static std::string text(size_t length) {
+    std::mt19937 random(7);
+    const char* words[] = {"alpha ", "beta ", "gamma ", "delta ", "epsilon "};
+    std::string out;
+    while (out.size() < length) {
+        out += words[random() % 5];
+    }
+    out.resize(length);
+    return out;
+}
+
+static std::string noise(size_t length) {
+    std::mt19937 random(11);
+    std::string out(length, '\0');
+    for (char& c : out) {
+        c = static_cast<char>(random());
+    }
+    return out;
+}
+
+static std::string encoded(Codec codec, const std::string& data) {
+    std::string block;
+    encodeBlock(codec, data.data(), data.size(), block);
+    return block;
+}
+
+static bool decodes(const std::string& block, std::string& out) {
+    out.clear();
+    return decodeBlock(block.data(), block.size(), out);
+}
+
+static void testRoundTrip() {
+    std::string out;
+    for (size_t length : {0, 1, 12, 13, 100, 65536, COMPRESS_BLOCK}) {
+        std::string data = text(length);
+        CHECK(decodes(encoded(CODEC_LZ4, data), out) && out == data);
+    }
+
+    std::string packed = encoded(CODEC_LZ4, text(COMPRESS_BLOCK));
+    CHECK(packed[0] == CODEC_LZ4 && packed.size() < COMPRESS_BLOCK / 2);
+
+    // Incompressible data goes out stored
+    std::string random = noise(4096);
+    std::string stored = encoded(CODEC_LZ4, random);
+    CHECK(stored[0] == CODEC_NONE && stored.size() == COMPRESS_BLOCK_HEADER + random.size());
+    CHECK(decodes(stored, out) && out == random);
+
+    // Long runs need overlapping matches and extended length bytes
+    std::string run(100000, 'z');
+    CHECK(decodes(encoded(CODEC_LZ4, run), out) && out == run);
+}
+
+static void testTruncated() {
+    std::string out;
+    std::string block = encoded(CODEC_LZ4, text(20000));
+    for (size_t length = 0; length < block.size(); length++) {
+        CHECK(!decodes(block.substr(0, length), out));
+        CHECK(out.empty());
+    }
+    std::string stored = encoded(CODEC_NONE, "abc");
+    CHECK(!decodes(stored.substr(0, stored.size() - 1), out));
+    CHECK(!decodes(stored + "d", out));
+}
+
+static void testCorrupt() {
+    std::string out;
+    std::string data = text(20000);
+    std::string block = encoded(CODEC_LZ4, data);
+
+    // A wrong raw length never decodes, however the body looks
+    std::string longer = block;
+    longer[4]++;
+    CHECK(!decodes(longer, out));
+    std::string shorter = block;
+    shorter[4]--;
+    CHECK(!decodes(shorter, out));
+
+    std::string huge = block;
+    huge[1] = 0x7F;
+    CHECK(!decodes(huge, out));
+
+    std::string unknown = block;
+    unknown[0] = 9;
+    CHECK(!decodes(unknown, out));
+
+    // A match offset of zero, or reaching back before the start
+    std::string zero_offset = encoded(CODEC_NONE, "");
+    zero_offset[0] = CODEC_LZ4;
+    zero_offset[4] = 8;
+    CHECK(!decodes(zero_offset + std::string("\x10" "a\x00\x00", 4), out));
+    std::string far_offset = zero_offset;
+    CHECK(!decodes(far_offset + std::string("\x10" "a\x05\x00", 4), out));
+
+    // Flipping any body byte must be caught or yield the right length;
+    // it must never overrun the output
+    std::mt19937 random(3);
+    for (int i = 0; i < 2000; i++) {
+        std::string flipped = block;
+        flipped[COMPRESS_BLOCK_HEADER + random() % (block.size() - COMPRESS_BLOCK_HEADER)] ^= 1 + random() % 255;
+        if (decodes(flipped, out)) {
+            CHECK(out.size() == data.size());
+        } else {
+            CHECK(out.empty());
+        }
+    }
+}
+
+int main() {
+    testRoundTrip();
+    testTruncated();
+    testCorrupt();
+    return checkResult("compression");
+}
@@ -0,0 +1,143 @@
+// delta_test.cpp - Delta round trip, and DeltaDecoder fed op streams cut at every byte
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "check.h"
+#include "delta.h"
+
+struct Decoded {
+    std::string literal;
+    std::vector<std::pair<uint64_t, uint32_t>> copies;
+};
+
+// Feeds stream in pieces of at most step bytes
+static bool decode(const std::string& stream, size_t step, Decoded& out, bool& idle) {
+    DeltaDecoder decoder;
+    auto literal = [&](const char* data, size_t length) {
+        out.literal.append(data, length);
+        return true;
+    };
+    auto copy = [&](uint64_t block, uint32_t count) {
+        out.copies.push_back({block, count});
+        return true;
+    };
+    for (size_t at = 0; at < stream.size(); at += step) {
+        if (!decoder.feed(stream.data() + at, std::min(step, stream.size() - at), literal, copy)) {
+            return false;
+        }
+    }
+    idle = decoder.idle();
+    return true;
+}
+
+static std::string literalOp(const std::string& data) {
+    std::string op(1, DELTA_OP_LITERAL);
+    putBigEndian(op, data.size(), 4);
+    return op + data;
+}
+
+static std::string copyOp(uint64_t block, uint32_t count) {
+    std::string op(1, DELTA_OP_COPY);
+    putBigEndian(op, block, 8);
+    putBigEndian(op, count, 4);
+    return op;
+}
+
+// Every op header split at every position decodes the same as whole
+static void testSplitOps() {
+    std::string stream = literalOp("hello") + copyOp(0x0102030405ULL, 7) + literalOp("") + copyOp(9, 1) +
+                         literalOp(std::string(300, 'x'));
+    for (size_t step = 1; step <= stream.size(); step++) {
+        Decoded out;
+        bool idle = false;
+        CHECK(decode(stream, step, out, idle));
+        CHECK(idle);
+        CHECK(out.literal == "hello" + std::string(300, 'x'));
+        CHECK(out.copies.size() == 2);
+        if (out.copies.size() == 2) {
+            CHECK(out.copies[0].first == 0x0102030405ULL && out.copies[0].second == 7);
+            CHECK(out.copies[1].first == 9 && out.copies[1].second == 1);
+        }
+    }
+}
+
+// A stream cut inside an op header or literal is not idle
+static void testTruncated() {
+    std::string stream = literalOp("abc") + copyOp(1, 2);
+    for (size_t cut = 1; cut < stream.size(); cut++) {
+        Decoded out;
+        bool idle = true;
+        CHECK(decode(stream.substr(0, cut), 1, out, idle));
+        CHECK(idle == (cut == 8));  // Only between the two ops
+    }
+}
+
+static void testMalformed() {
+    Decoded out;
+    bool idle;
+    CHECK(!decode("X", 1, out, idle));
+    CHECK(!decode(copyOp(1, 1) + "?", 4, out, idle));
+
+    // A failing callback stops the decoder
+    DeltaDecoder decoder;
+    std::string stream = copyOp(5, 1);
+    CHECK(!decoder.feed(stream.data(), stream.size(),
+                        [](const char*, size_t) { return true; },
+                        [](uint64_t, uint32_t) { return false; }));
+}
+
+// Encoding a changed file against the old one's signatures and applying
+// the delta to the old one gives back the new file
+static void testRoundTrip() {
+    std::string basis;
+    for (int i = 0; i < 50000; i++) {
+        basis += std::to_string(i * 7919 % 10007) + ' ';
+    }
+    std::string changed = basis.substr(0, 20000) + "inserted" + basis.substr(20000, 90000) + basis.substr(150000);
+
+    size_t block = deltaBlockSize(basis.size());
+    std::string signatures;
+    for (size_t at = 0; at < basis.size(); at += block) {
+        appendSignature(signatures, reinterpret_cast<const unsigned char*>(basis.data()) + at,
+                        std::min(block, basis.size() - at));
+    }
+
+    FILE* file = tmpfile();
+    CHECK(file && fwrite(changed.data(), 1, changed.size(), file) == changed.size() && fflush(file) == 0);
+    if (!file) {
+        return;
+    }
+    lseek(fileno(file), 0, SEEK_SET);
+    DeltaEncoder encoder(block, basis.size(), signatures);
+    std::string delta;
+    CHECK(encoder.encode(fileno(file), [&](const std::string& ops, uint64_t) {
+        delta += ops;
+        return true;
+    }));
+    fclose(file);
+    CHECK(encoder.copiedBytes() > 0);
+    CHECK(encoder.literalBytes() < changed.size() / 2);
+    CHECK(encoder.checksum() == crc32c(0, changed.data(), changed.size()));
+
+    std::string rebuilt;
+    DeltaDecoder decoder;
+    CHECK(decoder.feed(delta.data(), delta.size(),
+                       [&](const char* data, size_t length) {
+                           rebuilt.append(data, length);
+                           return true;
+                       },
+                       [&](uint64_t first, uint32_t count) {
+                           rebuilt += basis.substr(first * block, count * block);
+                           return first * block < basis.size();
+                       }));
+    CHECK(decoder.idle());
+    CHECK(rebuilt == changed);
+}
+
+int main() {
+    testRoundTrip();
+    testSplitOps();
+    testTruncated();
+    testMalformed();
+    return checkResult("delta");
+}
@@ -0,0 +1,239 @@
+// protocol_test.cpp - Runs the server in a scratch directory and talks the
+// binary protocol to it
+//
+// Usage: protocol_test [server binary]   (default ./server)
+// The server listens on its fixed port, so nothing else may be using it.
+#include <arpa/inet.h>
+#include <ftw.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include "archive.h"
+#include "check.h"
+#include "protocol.h"
+
+#define TEST_PORT 8080
+#define CONNECT_ATTEMPTS 50     // 100 ms apart
+
+static std::string readFile(const std::string& path) {
+    std::ifstream in(path, std::ios::binary);
+    std::ostringstream content;
+    content << in.rdbuf();
+    return content.str();
+}
+
+static bool exists(const std::string& path) {
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static int removeEntry(const char* path, const struct stat*, int, struct FTW*) {
+    return remove(path);
+}
+
+// The server running in a fresh directory, stopped on destruction
+class TestServer {
+private:
+    std::string dir;
+    pid_t pid;
+
+public:
+    explicit TestServer(const std::string& binary) : pid(-1) {
+        char real[PATH_MAX];
+        char scratch[] = "/tmp/fileshare-test.XXXXXX";
+        if (!realpath(binary.c_str(), real) || !mkdtemp(scratch) || chdir(scratch) != 0) {
+            return;
+        }
+        dir = scratch;
+        mkdir("shared_files", 0755);
+        std::ofstream("shared_files/x.part") << "half";
+
+        pid = fork();
+        if (pid == 0) {
+            int null_fd = open("/dev/null", O_WRONLY);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+            execl(real, real, "--metrics-port", "0", static_cast<char*>(nullptr));
+            _exit(127);
+        }
+    }
+
+    ~TestServer() {
+        if (pid > 0) {
+            kill(pid, SIGTERM);
+            waitpid(pid, nullptr, 0);
+        }
+        if (!dir.empty()) {
+            nftw(dir.c_str(), removeEntry, 16, FTW_DEPTH | FTW_PHYS);
+        }
+    }
+
+    bool started() const {
+        return pid > 0;
+    }
+};
+
+// A logged-in binary protocol connection
+class Connection {
+private:
+    int fd;
+    uint32_t next_id;
+
+    bool readExactly(char* out, size_t length) {
+        for (size_t done = 0; done < length;) {
+            ssize_t n = recv(fd, out + done, length - done, 0);
+            if (n <= 0) {
+                return false;
+            }
+            done += n;
+        }
+        return true;
+    }
+
+    // Reads text until it ends with marker
+    bool readUntil(const std::string& marker, std::string& text) {
+        char c;
+        while (text.size() < marker.size() || text.compare(text.size() - marker.size(), marker.size(), marker) != 0) {
+            if (recv(fd, &c, 1, 0) != 1) {
+                return false;
+            }
+            text += c;
+        }
+        return true;
+    }
+
+public:
+    Connection() : fd(-1), next_id(0) {}
+
+    ~Connection() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    bool open(const std::string& login) {
+        sockaddr_in address = {};
+        address.sin_family = AF_INET;
+        address.sin_port = htons(TEST_PORT);
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        for (int attempt = 0; attempt < CONNECT_ATTEMPTS; attempt++) {
+            fd = socket(AF_INET, SOCK_STREAM, 0);
+            if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) {
+                break;
+            }
+            close(fd);
+            fd = -1;
+            usleep(100 * 1000);
+        }
+        timeval timeout = {10, 0};
+        std::string banner, reply;
+        std::string proto = std::string(PROTO_REQUEST) + " " + std::to_string(PROTOCOL_VERSION) + "\n";
+        if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) != 0 ||
+            !readUntil("commands\n\n", banner) || !send(proto) || !readUntil("\n", reply) ||
+            reply.compare(0, strlen(PROTO_ACCEPTED), PROTO_ACCEPTED) != 0) {
+            return false;
+        }
+        return command("LOGIN " + login).compare(0, 2, "OK") == 0;
+    }
+
+    bool send(const std::string& bytes) {
+        return ::send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(bytes.size());
+    }
+
+    bool sendFrame(uint8_t type, uint8_t flags, uint32_t request_id, const std::string& payload) {
+        std::string frame;
+        appendFrame(frame, type, flags, request_id, payload);
+        return send(frame);
+    }
+
+    // Next frame's header and payload; type is 0 if the connection failed
+    FrameHeader readFrame(std::string& payload) {
+        char bytes[FRAME_HEADER_SIZE];
+        FrameHeader header = {0, 0, 0, 0};
+        if (!readExactly(bytes, sizeof(bytes)) || !decodeFrameHeader(bytes, header)) {
+            header.type = 0;
+            return header;
+        }
+        payload.resize(header.length);
+        if (!readExactly(&payload[0], payload.size())) {
+            header.type = 0;
+        }
+        return header;
+    }
+
+    // Sends a command and returns the payload of the frame that answers it
+    std::string command(const std::string& text, uint8_t flags = 0) {
+        std::string payload;
+        if (sendFrame(FRAME_COMMAND, flags, ++next_id, text)) {
+            readFrame(payload);
+        }
+        return payload;
+    }
+
+    uint32_t nextRequestId() {
+        return ++next_id;
+    }
+};
+
+#define RESERVED "ERROR: Reserved file name\n"
+
+// A .part name is another upload's partial file: never written, read or served
+static void testPartialNames() {
+    Connection c;
+    CHECK(c.open("admin:admin123"));
+
+    CHECK(c.command("UPLOAD x.part 4 0", FLAG_PIPELINED) == RESERVED);
+    CHECK(c.command("SIGNATURES x.part") == RESERVED);
+    CHECK(c.command("RESUME x.part") == RESERVED);
+    CHECK(c.command("DOWNLOAD x.part") == RESERVED);
+    CHECK(c.command("INFO x.part") == RESERVED);
+
+    CHECK(readFile("shared_files/x.part") == "half");
+    CHECK(!exists("shared_files/x.part.part"));
+    CHECK(c.command("INFO x").compare(0, 5, "ERROR") == 0);
+}
+
+// An MPUT stream that stops inside a header keeps the entries before it
+// and fails only the stream
+static void testMputCutInHeader() {
+    Connection c;
+    CHECK(c.open("admin:admin123"));
+
+    std::string archive;
+    appendArchiveHeader(archive, "kept.txt", 3);
+    archive += "abc" + checksumTrailer(crc32c(0, "abc", 3)) + "FILE 5 cu";
+    uint32_t id = c.nextRequestId();
+    CHECK(c.sendFrame(FRAME_COMMAND, FLAG_PIPELINED, id, "MPUT"));
+    CHECK(c.sendFrame(FRAME_DATA, 0, id, archive));
+    CHECK(c.sendFrame(FRAME_END, 0, id, ""));
+
+    std::string reply;
+    FrameHeader header = c.readFrame(reply);
+    CHECK(header.type == FRAME_RESPONSE && header.request_id == id);
+    CHECK(reply.compare(0, 26, "ERROR: Incomplete archive\n") == 0);
+    CHECK(reply.find("COMMITTED:1\n") != std::string::npos);
+    CHECK(reply.find("FAILED:0\n") != std::string::npos);
+    CHECK(reply.find("kept.txt\tOK") != std::string::npos);
+    CHECK(readFile("shared_files/kept.txt") == "abc");
+    CHECK(!exists("shared_files/kept.txt.part"));
+}
+
+int main(int argc, char** argv) {
+    signal(SIGPIPE, SIG_IGN);
+    TestServer server(argc > 1 ? argv[1] : "./server");
+    CHECK(server.started());
+    if (server.started()) {
+        testPartialNames();
+        testMputCutInHeader();
+    }
+    return checkResult("protocol");
+}
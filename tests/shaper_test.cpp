@@ -0,0 +1,119 @@
+// shaper_test.cpp - Token bucket limits and deficit round robin sharing
+//
+// The rates are picked so that buckets barely refill while a test runs;
+// only the bucket debt test sleeps.
+#include <chrono>
+#include <thread>
+#include "check.h"
+#include "shaper.h"
+
+#define MB (1024.0 * 1024.0)
+
+static void testDisabled() {
+    TransferShaper shaper;
+    ShapedFlow flow;
+    std::chrono::milliseconds wait(0);
+    shaper.configure(0, 0, 0);
+    shaper.bind(flow, "user", 5);
+    CHECK(!shaper.enabled());
+    CHECK(shaper.grant(flow, 1 << 30, wait) == 1u << 30);
+    CHECK(!flow.active);
+}
+
+// Each round, a flow of weight 3 moves three times what one of weight 1 does
+static void testWeightedRounds() {
+    TransferShaper shaper;
+    ShapedFlow light, heavy;
+    std::chrono::milliseconds wait(0);
+    shaper.configure(100 * MB, 0, 0);
+    shaper.bind(light, "light", 1);
+    shaper.bind(heavy, "heavy", 3);
+
+    // Both take part from the first round on
+    CHECK(shaper.grant(heavy, 1 << 20, wait) == 3 * SHAPER_QUANTUM);
+
+    size_t light_bytes = 0, heavy_bytes = 0;
+    for (int round = 0; round < 10; round++) {
+        size_t granted = shaper.grant(light, 1 << 20, wait);
+        CHECK(granted == SHAPER_QUANTUM);
+        shaper.charge(light, granted);
+        light_bytes += granted;
+
+        // Its quantum spent, light waits for heavy to finish the round
+        CHECK(shaper.grant(light, 1 << 20, wait) == 0);
+        CHECK(wait.count() > 0);
+
+        granted = shaper.grant(heavy, 1 << 20, wait);
+        CHECK(granted == 3 * SHAPER_QUANTUM);
+        shaper.charge(heavy, granted);
+        heavy_bytes += granted;
+    }
+    CHECK(heavy_bytes == 3 * light_bytes);
+}
+
+// A flow that goes idle stops holding up the round
+static void testIdleEndsRound() {
+    TransferShaper shaper;
+    ShapedFlow a, b;
+    std::chrono::milliseconds wait(0);
+    shaper.configure(100 * MB, 0, 0);
+    shaper.bind(a, "a", 1);
+    shaper.bind(b, "b", 0);
+    CHECK(b.weight == 1);
+
+    size_t granted = shaper.grant(a, 1 << 20, wait);
+    CHECK(shaper.grant(b, 1 << 20, wait) == SHAPER_QUANTUM);
+    shaper.charge(a, granted);
+    CHECK(shaper.grant(a, 1 << 20, wait) == 0);
+
+    shaper.idle(b);
+    CHECK(!b.active);
+    CHECK(shaper.grant(a, 1 << 20, wait) == SHAPER_QUANTUM);
+}
+
+// No grant exceeds a bucket's depth, and a bucket in debt parks the flow
+// until it has refilled
+static void testBucketDebt() {
+    TransferShaper shaper;
+    ShapedFlow flow;
+    std::chrono::milliseconds wait(0);
+    shaper.configure(0, 0, 1 * MB);
+    shaper.bind(flow, "user", 1);
+
+    size_t depth = static_cast<size_t>(1 * MB * SHAPER_BURST_MS / 1000);
+    size_t granted = shaper.grant(flow, 1 << 30, wait);
+    CHECK(granted == depth);
+    shaper.charge(flow, 2 * granted);
+    CHECK(shaper.grant(flow, 1 << 30, wait) == 0);
+    CHECK(wait.count() > 0 && wait.count() <= SHAPER_MAX_WAIT_MS);
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(3 * SHAPER_BURST_MS / 2));
+    CHECK(shaper.grant(flow, 1 << 30, wait) > 0);
+}
+
+// A user's connections draw on one bucket, sized by the user's weight
+static void testSharedUserBucket() {
+    TransferShaper shaper;
+    ShapedFlow first, second, other;
+    std::chrono::milliseconds wait(0);
+    shaper.configure(0, 1 * MB, 0);
+    shaper.bind(first, "user", 2);
+    shaper.bind(second, "user", 2);
+    shaper.bind(other, "someone else", 1);
+
+    size_t depth = static_cast<size_t>(2 * MB * SHAPER_BURST_MS / 1000);
+    size_t granted = shaper.grant(first, 1 << 30, wait);
+    CHECK(granted == depth);
+    shaper.charge(first, 2 * granted);
+    CHECK(shaper.grant(second, 1 << 30, wait) == 0);
+    CHECK(shaper.grant(other, 1 << 30, wait) > 0);
+}
+
+int main() {
+    testDisabled();
+    testWeightedRounds();
+    testIdleEndsRound();
+    testBucketDebt();
+    testSharedUserBucket();
+    return checkResult("shaper");
+}
@@ -0,0 +1,315 @@
+// trace.h - Sampled phase tracing of single transfers
+//
+// A traced DOWNLOAD or UPLOAD records when each of its phases started and
+// ended: the permission check, opening the file, waiting for the client's
+// READY, moving the data, committing the upload, and so on. Inside a phase,
+// each disk read, socket send and wait is recorded as a nested span. A slow
+// transfer then shows whether its time went to the disk, the network or the
+// shaper. Per-span totals are kept even past TRACE_MAX_SPANS, when further
+// spans are dropped from the timeline.
+//
+// Traces are written in Chrome's trace-event JSON array format, which
+// ui.perfetto.dev and chrome://tracing open directly. Each request is drawn
+// as a track of its own. The server and the client both stamp events with
+// CLOCK_MONOTONIC, so when both run on one host, their trace files can be
+// loaded together and their events line up.
+//
+// Only one request in every N is traced, so tracing can stay on in
+// production. For an untraced request, each trace point costs one null
+// check. A trace is written out when it is destroyed, with a single
+// O_APPEND write(). Events of concurrent requests therefore never
+// interleave, and nothing is lost when the process is killed. The JSON
+// array is never closed, which the trace viewers accept.
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <string>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TRACE_MAX_SPANS 256     // Spans and waits kept per request; phases are always kept
+
+class TraceLog;
+
+class RequestTrace {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+private:
+    struct Record {
+        const char* name;
+        const char* category;   // "phase", "io" or "wait"
+        int64_t begin_us;
+        int64_t end_us;
+    };
+
+    struct Total {
+        const char* name;
+        int64_t us;
+        uint64_t count;
+    };
+
+    TraceLog* log;
+    uint64_t id;
+    const char* name;
+    std::string subject;
+    int64_t begin_us;
+    const char* phase_name;     // Null between phases
+    int64_t phase_begin_us;
+    const char* wait_reason;    // Null unless waiting
+    int64_t wait_begin_us;
+    std::vector<Record> records;
+    std::vector<Total> totals;
+    size_t spans;               // Non-phase records kept so far
+    uint64_t dropped;
+    std::string args;           // Rendered JSON members
+    const char* outcome;
+
+    static int64_t micros(Clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+    }
+
+    static void appendEscaped(std::string& out, const std::string& text) {
+        for (unsigned char c : text) {
+            if (c == '"' || c == '\\') {
+                out += '\\';
+                out += c;
+            } else if (c < 0x20) {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                out += escaped;
+            } else {
+                out += c;
+            }
+        }
+    }
+
+    void record(const char* span_name, const char* category, int64_t from, int64_t to) {
+        Total* total = nullptr;
+        for (Total& t : totals) {
+            if (t.name == span_name) {
+                total = &t;
+                break;
+            }
+        }
+        if (!total) {
+            totals.push_back({span_name, 0, 0});
+            total = &totals.back();
+        }
+        total->us += to - from;
+        total->count++;
+
+        bool is_phase = category[0] == 'p';
+        if (!is_phase && spans >= TRACE_MAX_SPANS) {
+            dropped++;
+            return;
+        }
+        spans += !is_phase;
+        records.push_back({span_name, category, from, to});
+    }
+
+    void appendEvent(std::string& out, int pid, const char* event_name, const char* category,
+                     int64_t from, int64_t to) const {
+        char fields[160];
+        snprintf(fields, sizeof(fields), "\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%lld,\"pid\":%d,\"tid\":%llu",
+                 static_cast<long long>(from), static_cast<long long>(to - from), pid,
+                 static_cast<unsigned long long>(id));
+        out.append("{\"name\":\"").append(event_name).append("\",\"cat\":\"").append(category) += fields;
+    }
+
+public:
+    RequestTrace(TraceLog* trace_log, uint64_t trace_id, const char* request, const std::string& what)
+        : log(trace_log), id(trace_id), name(request), subject(what), begin_us(micros(Clock::now())),
+          phase_name(nullptr), phase_begin_us(0), wait_reason(nullptr), wait_begin_us(0),
+          spans(0), dropped(0), outcome("unfinished") {}
+
+    RequestTrace(const RequestTrace&) = delete;
+    RequestTrace& operator=(const RequestTrace&) = delete;
+
+    ~RequestTrace();
+
+    // Ends the current phase, if any, and starts the next one. Span and
+    // phase names must be string literals; only the pointers are kept.
+    void phase(const char* next) {
+        int64_t now = micros(Clock::now());
+        if (phase_name) {
+            record(phase_name, "phase", phase_begin_us, now);
+        }
+        phase_name = next;
+        phase_begin_us = now;
+    }
+
+    // An operation inside the current phase
+    void span(const char* span_name, Clock::time_point from, Clock::time_point to) {
+        record(span_name, "io", micros(from), micros(to));
+    }
+
+    // The request is idle until resume(), e.g. on a full socket
+    void wait(const char* reason) {
+        if (!wait_reason) {
+            wait_reason = reason;
+            wait_begin_us = micros(Clock::now());
+        }
+    }
+
+    void resume() {
+        if (wait_reason) {
+            record(wait_reason, "wait", wait_begin_us, micros(Clock::now()));
+            wait_reason = nullptr;
+        }
+    }
+
+    void arg(const char* key, const std::string& value) {
+        args.append(",\"").append(key).append("\":\"");
+        appendEscaped(args, value);
+        args += '"';
+    }
+
+    void arg(const char* key, long value) {
+        args.append(",\"").append(key).append("\":") += std::to_string(value);
+    }
+
+    // How the request ended; "unfinished" unless set
+    void setOutcome(const char* how) {
+        outcome = how;
+    }
+
+    // Renders the request as trace events: a thread name for its track, the
+    // request span carrying args and totals, then its phases, spans and waits
+    std::string render(int pid) {
+        resume();
+        int64_t end_us = micros(Clock::now());
+        if (phase_name) {
+            record(phase_name, "phase", phase_begin_us, end_us);
+            phase_name = nullptr;
+        }
+
+        std::string out;
+        out.reserve(256 + records.size() * 128);
+        out.append("{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":").append(std::to_string(pid))
+           .append(",\"tid\":").append(std::to_string(id)).append(",\"args\":{\"name\":\"")
+           .append(name).append(" ");
+        appendEscaped(out, subject);
+        out.append("\"}},\n");
+
+        appendEvent(out, pid, name, "request", begin_us, end_us);
+        out.append(",\"args\":{\"outcome\":\"").append(outcome) += '"';
+        out += args;
+        if (dropped > 0) {
+            out.append(",\"spans dropped\":") += std::to_string(dropped);
+        }
+        out += ",\"totals\":{";
+        for (size_t i = 0; i < totals.size(); i++) {
+            out.append(i ? ",\"" : "\"").append(totals[i].name).append("\":{\"us\":")
+               .append(std::to_string(totals[i].us)).append(",\"count\":")
+               .append(std::to_string(totals[i].count)) += '}';
+        }
+        out += "}}},\n";
+
+        for (const Record& r : records) {
+            appendEvent(out, pid, r.name, r.category, r.begin_us, r.end_us);
+            out += "},\n";
+        }
+        return out;
+    }
+};
+
+// Where sampled traces go. Disabled until open() succeeds.
+class TraceLog {
+private:
+    int fd;
+    int pid;
+    unsigned sample_every;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> next_id;
+
+public:
+    TraceLog() : fd(-1), pid(getpid()), sample_every(0), requests(0), next_id(1) {}
+
+    TraceLog(const TraceLog&) = delete;
+    TraceLog& operator=(const TraceLog&) = delete;
+
+    ~TraceLog() {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+
+    // Appends to path, tracing one request in every `every`; process names
+    // this program's tracks in the viewer
+    bool open(const std::string& path, unsigned every, const std::string& process) {
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+        sample_every = every;
+        struct stat st;
+        std::string header = (fstat(fd, &st) == 0 && st.st_size == 0) ? "[\n" : "";
+        header += "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":" + std::to_string(pid) +
+                  ",\"args\":{\"name\":\"" + process + "\"}},\n";
+        write(header);
+        return true;
+    }
+
+    bool enabled() const {
+        return fd >= 0;
+    }
+
+    // A trace for the next request if it is sampled, otherwise null
+    std::unique_ptr<RequestTrace> start(const char* request, const std::string& subject) {
+        if (fd < 0 || requests.fetch_add(1, std::memory_order_relaxed) % sample_every != 0) {
+            return nullptr;
+        }
+        return std::make_unique<RequestTrace>(this, next_id.fetch_add(1, std::memory_order_relaxed),
+                                              request, subject);
+    }
+
+    void write(const std::string& events) {
+        for (size_t done = 0; done < events.size();) {
+            ssize_t n = ::write(fd, events.data() + done, events.size() - done);
+            if (n <= 0) {
+                return; // Tracing must never get in the way of a transfer
+            }
+            done += n;
+        }
+    }
+
+    int processId() const {
+        return pid;
+    }
+};
+
+inline RequestTrace::~RequestTrace() {
+    log->write(render(log->processId()));
+}
+
+// Records the enclosing scope as a span of trace; does nothing if trace is null
+class TraceSpan {
+private:
+    RequestTrace* trace;
+    const char* name;
+    RequestTrace::Clock::time_point begin;
+
+public:
+    TraceSpan(RequestTrace* request, const char* span_name)
+        : trace(request), name(span_name),
+          begin(request ? RequestTrace::Clock::now() : RequestTrace::Clock::time_point()) {}
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+    ~TraceSpan() {
+        if (trace) {
+            trace->span(name, begin, RequestTrace::Clock::now());
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,235 @@
+// user_store.h - Accounts from users.txt, reloaded while the server runs,
+// and the signed session tokens that let a client skip LOGIN
+//
+// The accounts live in an immutable hash table published through an atomic
+// shared pointer. A lookup takes a snapshot of the pointer and never waits
+// for a writer: when users.txt changes, a background thread parses it into
+// a fresh table and swaps that in, while readers still holding the old one
+// finish with it undisturbed (read-copy-update). Permission changes thus
+// apply from the next command on, with no restart.
+//
+// A session token is <user>:<expiry>:<mac>, the mac being HMAC-SHA256 of
+// the user name, the expiry and the user's password under a server key. It
+// is checked without any per-session state on the server, survives a
+// restart (the key is kept in a file), and stops working once it expires or
+// the user is removed or given a new password.
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include "sha256.h"
+
+#define TOKEN_TTL (12 * 3600)       // Seconds a session token stays valid
+#define TOKEN_KEY_SIZE 32
+#define USERS_POLL_MS 1000          // How often users.txt is checked for changes
+#define USER_MAX_WEIGHT 1000        // Largest bandwidth weight; keeps weight * SHAPER_QUANTUM in range
+
+struct User {
+    std::string username;
+    std::string password;
+    bool can_upload;
+    bool can_download;
+    unsigned weight;        // Bandwidth share under contention (optional fifth field, 1 to USER_MAX_WEIGHT, default 1)
+};
+
+class UserStore {
+private:
+    typedef std::unordered_map<std::string, User> Table;
+
+    std::string path;
+    std::shared_ptr<const Table> table;     // Only touched through std::atomic_load/atomic_store
+    struct stat loaded;                     // What users.txt looked like when table was read
+    unsigned char key[TOKEN_KEY_SIZE];
+
+    std::thread watcher;
+    std::mutex stop_lock;
+    std::condition_variable stop_signal;
+    bool stopping;
+
+    static bool sameFile(const struct stat& a, const struct stat& b) {
+        return a.st_ino == b.st_ino && a.st_dev == b.st_dev && a.st_size == b.st_size &&
+               a.st_mtim.tv_sec == b.st_mtim.tv_sec && a.st_mtim.tv_nsec == b.st_mtim.tv_nsec;
+    }
+
+    // Parses users.txt into a new table and publishes it; false if unreadable
+    bool reload() {
+        struct stat st;
+        std::ifstream userfile(path);
+        if (!userfile.is_open() || stat(path.c_str(), &st) != 0) {
+            return false;
+        }
+
+        auto fresh = std::make_shared<Table>();
+        std::string line;
+        while (std::getline(userfile, line)) {
+            std::istringstream iss(line);
+            std::string username, password, upload, download, weight;
+
+            if (std::getline(iss, username, ':') &&
+                std::getline(iss, password, ':') &&
+                std::getline(iss, upload, ':') &&
+                std::getline(iss, download, ':')) {
+                std::getline(iss, weight);
+                char* end = nullptr;
+                long share = weight.empty() ? 1 : strtol(weight.c_str(), &end, 10);
+                if (!weight.empty() && (*end != '\0' || share < 1 || share > USER_MAX_WEIGHT)) {
+                    continue;   // Malformed like a line with missing fields: the user is left out
+                }
+
+                User user;
+                user.username = username;
+                user.password = password;
+                user.can_upload = (upload == "1");
+                user.can_download = (download == "1");
+                user.weight = static_cast<unsigned>(share);
+
+                (*fresh)[username] = user;
+            }
+        }
+        loaded = st;
+        std::atomic_store(&table, std::shared_ptr<const Table>(std::move(fresh)));
+        return true;
+    }
+
+    void watchLoop() {
+        std::unique_lock<std::mutex> guard(stop_lock);
+        while (!stop_signal.wait_for(guard, std::chrono::milliseconds(USERS_POLL_MS),
+                                     [this]() { return stopping; })) {
+            struct stat st;
+            if (stat(path.c_str(), &st) == 0 && !sameFile(st, loaded) && reload()) {
+                std::cout << "✓ Reloaded " << size() << " users from " << path << std::endl;
+            }
+        }
+    }
+
+    // Reads the token key from key_path, creating it on first start. If it
+    // can't be stored, a key for this run only is used instead.
+    bool loadKey(const std::string& key_path) {
+        int fd = ::open(key_path.c_str(), O_RDONLY);
+        if (fd >= 0) {
+            bool complete = read(fd, key, sizeof(key)) == static_cast<ssize_t>(sizeof(key));
+            close(fd);
+            if (complete) {
+                return true;
+            }
+        }
+
+        fd = ::open("/dev/urandom", O_RDONLY);
+        if (fd < 0 || read(fd, key, sizeof(key)) != static_cast<ssize_t>(sizeof(key))) {
+            if (fd >= 0) {
+                close(fd);
+            }
+            return false;
+        }
+        close(fd);
+
+        fd = ::open(key_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        bool stored = fd >= 0 && write(fd, key, sizeof(key)) == static_cast<ssize_t>(sizeof(key));
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (!stored) {
+            std::cout << "✗ Cannot store " << key_path << "; session tokens end with this run" << std::endl;
+        }
+        return true;
+    }
+
+    std::string mac(const std::string& username, const std::string& expiry, const std::string& password) const {
+        std::string message = username + '\n' + expiry + '\n' + password;
+        unsigned char digest[SHA256_DIGEST_SIZE];
+        Sha256::hmac(key, sizeof(key), message.data(), message.size(), digest);
+        return Sha256::hex(digest);
+    }
+
+public:
+    UserStore() : table(std::make_shared<const Table>()), loaded(), key(), stopping(false) {}
+
+    UserStore(const UserStore&) = delete;
+    UserStore& operator=(const UserStore&) = delete;
+
+    ~UserStore() {
+        if (watcher.joinable()) {
+            {
+                std::lock_guard<std::mutex> guard(stop_lock);
+                stopping = true;
+            }
+            stop_signal.notify_all();
+            watcher.join();
+        }
+    }
+
+    // Loads the accounts and token key, then keeps watching users.txt
+    bool open(const std::string& users_path, const std::string& key_path) {
+        path = users_path;
+        if (!reload() || !loadKey(key_path)) {
+            return false;
+        }
+        watcher = std::thread(&UserStore::watchLoop, this);
+        return true;
+    }
+
+    size_t size() const {
+        return std::atomic_load(&table)->size();
+    }
+
+    // Copies a user record out of the current table; false if unknown
+    bool lookup(const std::string& username, User& user) const {
+        std::shared_ptr<const Table> snapshot = std::atomic_load(&table);
+        auto it = snapshot->find(username);
+        if (it == snapshot->end()) {
+            return false;
+        }
+        user = it->second;
+        return true;
+    }
+
+    std::string issueToken(const User& user) const {
+        std::string expiry = std::to_string(time(nullptr) + TOKEN_TTL);
+        return user.username + ":" + expiry + ":" + mac(user.username, expiry, user.password);
+    }
+
+    // The user a token was issued to, if it is genuine, unexpired and the
+    // user still exists with the same password
+    bool verifyToken(const std::string& token, User& user) const {
+        size_t mac_start = token.rfind(':');
+        size_t expiry_start = mac_start == std::string::npos || mac_start == 0
+                                  ? std::string::npos : token.rfind(':', mac_start - 1);
+        if (expiry_start == std::string::npos) {
+            return false;
+        }
+        std::string username = token.substr(0, expiry_start);
+        std::string expiry = token.substr(expiry_start + 1, mac_start - expiry_start - 1);
+        std::string given = token.substr(mac_start + 1);
+
+        char* end = nullptr;
+        long long expires = strtoll(expiry.c_str(), &end, 10);
+        if (expiry.empty() || *end != '\0' || expires < time(nullptr) || !lookup(username, user)) {
+            return false;
+        }
+
+        // Constant time, so a forged mac can't be found byte by byte
+        std::string expected = mac(username, expiry, user.password);
+        unsigned char diff = given.size() != expected.size();
+        for (size_t i = 0; i < given.size() && i < expected.size(); i++) {
+            diff |= given[i] ^ expected[i];
+        }
+        return diff == 0;
+    }
+};
+
+#endif
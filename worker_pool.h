@@ -0,0 +1,186 @@
+// worker_pool.h - Fixed-size worker pool with per-worker queues and work stealing
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Each worker owns a queue. Jobs are pushed to a preferred worker so a
+// session keeps hitting the same warm cache; a worker whose queue is empty
+// takes jobs from the back of the busiest-looking neighbour instead of
+// sleeping while others are backed up. A job can also be submitted with a
+// delay; it waits on a timer list and joins its worker's queue when due.
+template <typename Job>
+class WorkerPool {
+private:
+    struct Worker {
+        std::mutex lock;
+        std::deque<Job> jobs;
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::vector<std::thread> threads;
+    std::function<void(size_t, Job&)> handler;
+
+    typedef std::chrono::steady_clock Clock;
+
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    std::atomic<size_t> pending;
+    bool stopping;
+    std::multimap<Clock::time_point, std::pair<size_t, Job>> timers;   // Delayed jobs, under idle_lock
+    std::atomic<int64_t> next_due;      // Earliest timer, so busy workers can check it without the lock
+    uint64_t timer_generation;          // Bumped when a timer is added, to wake sleepers early
+
+    // Moves due timers onto their workers' queues; call with idle_lock held
+    bool releaseDue() {
+        Clock::time_point now = Clock::now();
+        bool released = false;
+        while (!timers.empty() && timers.begin()->first <= now) {
+            auto& entry = timers.begin()->second;
+            Worker& w = *workers[entry.first];
+            {
+                std::lock_guard<std::mutex> guard(w.lock);
+                pending.fetch_add(1, std::memory_order_relaxed); // Before the job can be taken
+                w.jobs.push_back(std::move(entry.second));
+            }
+            timers.erase(timers.begin());
+            released = true;
+        }
+        next_due.store(timers.empty() ? INT64_MAX : timers.begin()->first.time_since_epoch().count(),
+                       std::memory_order_relaxed);
+        if (released) {
+            idle_cv.notify_all();
+        }
+        return released;
+    }
+
+    bool popLocal(size_t id, Job& job) {
+        Worker& w = *workers[id];
+        std::lock_guard<std::mutex> guard(w.lock);
+        if (w.jobs.empty()) {
+            return false;
+        }
+        job = std::move(w.jobs.front());
+        w.jobs.pop_front();
+        return true;
+    }
+
+    bool steal(size_t id, Job& job) {
+        for (size_t i = 1; i < workers.size(); i++) {
+            Worker& victim = *workers[(id + i) % workers.size()];
+            std::unique_lock<std::mutex> guard(victim.lock, std::try_to_lock);
+            if (!guard.owns_lock() || victim.jobs.empty()) {
+                continue;
+            }
+            job = std::move(victim.jobs.back());
+            victim.jobs.pop_back();
+            return true;
+        }
+        return false;
+    }
+
+    void workerLoop(size_t id) {
+        while (true) {
+            if (Clock::now().time_since_epoch().count() >= next_due.load(std::memory_order_relaxed)) {
+                std::lock_guard<std::mutex> guard(idle_lock);
+                releaseDue();
+            }
+
+            Job job;
+            if (popLocal(id, job) || steal(id, job)) {
+                pending.fetch_sub(1, std::memory_order_relaxed);
+                handler(id, job);
+                continue;
+            }
+
+            std::unique_lock<std::mutex> guard(idle_lock);
+            if (releaseDue()) {
+                continue;
+            }
+            uint64_t generation = timer_generation;
+            auto ready = [this, generation] {
+                return stopping || pending.load(std::memory_order_relaxed) > 0 || timer_generation != generation;
+            };
+            if (timers.empty()) {
+                idle_cv.wait(guard, ready);
+            } else {
+                idle_cv.wait_until(guard, timers.begin()->first, ready);
+            }
+            if (stopping) {
+                return;
+            }
+        }
+    }
+
+public:
+    WorkerPool(size_t count, std::function<void(size_t, Job&)> fn)
+        : handler(std::move(fn)), pending(0), stopping(false), next_due(INT64_MAX), timer_generation(0) {
+        if (count == 0) {
+            count = 1;
+        }
+        for (size_t i = 0; i < count; i++) {
+            workers.push_back(std::make_unique<Worker>());
+        }
+        for (size_t i = 0; i < count; i++) {
+            threads.emplace_back(&WorkerPool::workerLoop, this, i);
+        }
+    }
+
+    size_t size() const {
+        return workers.size();
+    }
+
+    // Queues a job on the preferred worker; any idle worker may steal it
+    void submit(Job job, size_t preferred) {
+        Worker& w = *workers[preferred % workers.size()];
+        {
+            std::lock_guard<std::mutex> guard(w.lock);
+            // Counted before the job is visible, so a worker that takes it
+            // at once can't drive pending below zero
+            pending.fetch_add(1, std::memory_order_relaxed);
+            w.jobs.push_back(std::move(job));
+        }
+        {
+            // A worker between checking pending and sleeping holds idle_lock;
+            // waiting for it here means it can't miss the notify
+            std::lock_guard<std::mutex> guard(idle_lock);
+        }
+        idle_cv.notify_one();
+    }
+
+    // Queues a job on the preferred worker once delay has passed. Jobs still
+    // waiting when the pool is destroyed are dropped.
+    void submitAfter(Job job, size_t preferred, std::chrono::milliseconds delay) {
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            auto due = Clock::now() + delay;
+            timers.emplace(due, std::make_pair(preferred % workers.size(), std::move(job)));
+            next_due.store(timers.begin()->first.time_since_epoch().count(), std::memory_order_relaxed);
+            timer_generation++;
+        }
+        idle_cv.notify_one();
+    }
+
+    ~WorkerPool() {
+        {
+            std::lock_guard<std::mutex> guard(idle_lock);
+            stopping = true;
+        }
+        idle_cv.notify_all();
+        for (auto& t : threads) {
+            t.join();
+        }
+    }
+};
+
+#endif